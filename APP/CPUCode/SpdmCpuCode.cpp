@@ -5,10 +5,18 @@
 
 #include <cmath>
 #include <iostream>
-#include <iomanip>
 #include <cerrno>
 #include <cstring>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
 
+#include <dirent.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "tiff.hpp"
@@ -17,6 +25,14 @@
 #include "Spdm.h"
 
 #include "SpdmCpuCode.hpp"
+#include "benchmark.hpp"
+#include "cpu_engine.hpp"
+#include "image_prefetcher.hpp"
+#include "live_pipeline.hpp"
+#include "live_source.hpp"
+#include "localization_scorer.hpp"
+#include "result_writer.hpp"
+#include "shard_scheduler.hpp"
 
 
 /// Look for last_pixel indicator in output stream to check whether the DFE is done
@@ -24,35 +40,22 @@
     @param length Length of the array
     @return True iff all images have been processed
 **/
-bool end_of_results(estimator_result *results, int length)
+bool end_of_results(estimator_result const* results, int length)
 {
 	return results[length - 1].img == last_pixel;
 }
 
 
-/// Print results as text, separated with tabs
-/** @param results Array with results
-    @param length Length of array
+/// Print the counters of the image prefetcher
+/** @param stats The counters
 **/
-void print_results(estimator_result *results, int length)
+void print_prefetch_stats(prefetch_stats const& stats)
 {
-	int w = 10;
-	for(int i = 0; i < length; i++) {
-		estimator_result result = results[i];
-
-		if(result.img >= 0) {
-			std::cout << 0 << '\t'
-				 << std::setw(w) << result.mu_y << '\t'
-				 << std::setw(w) << result.mu_x << '\t'
-				 << std::setw(w) << result.delta_mu_y << '\t'
-				 << std::setw(w) << result.delta_mu_x << '\t'
-				 << std::setw(w) << result.sigma_y << '\t'
-				 << std::setw(w) << result.sigma_x << '\t'
-				 << std::setw(w) << result.Q << '\t'
-				 << std::setw(w) << result.img
-			     << std::endl;
-		}
-	}
+	std::cerr << "Prefetch images read / consumed            :  " << stats.images_read << " / " << stats.images_consumed << std::endl;
+	std::cerr << "Prefetch mean / max queue depth            :  "
+			  << (stats.images_consumed ? (double) stats.depth_sum / stats.images_consumed : 0.0) << " / " << stats.max_depth << std::endl;
+	std::cerr << "Prefetch consumer stalls (I/O-bound)       :  " << stats.consumer_stalls << std::endl;
+	std::cerr << "Prefetch reader stalls (engine-bound)      :  " << stats.reader_stalls << std::endl;
 }
 
 /// Get the DFE configuration
@@ -95,22 +98,34 @@ dfe_config_constants const& dfe_config::constants() const
 	return constants_;
 }
 
-/// Configure the DFE
+/// Load the DFE, the engine stays loaded for any number of runs
 /** @param config The DFE configuration
-    @param scalars Scalar values to be set before execution
 **/
-dataflow_engine::dataflow_engine(dfe_config const& config, dfe_scalars const& scalars)
+dataflow_engine::dataflow_engine(dfe_config const& config)
+	: config_(config)
 {
-	if(in_use_) {
-		throw std::runtime_error("dataflow engine already in use");
-	}
-	in_use_ = true;
-
-	std::cerr << "Configuring DFE" << std::endl;
+	std::cerr << "Loading DFE" << std::endl;
 	engine_ = max_load(config.maxfile(), "*");
+}
 
 
-	max_actions_t *action = max_actions_init(config.maxfile(), NULL);
+dataflow_engine::~dataflow_engine()
+{
+	std::cerr << "Unloading engine" << std::endl;
+	max_unload(engine_);
+	engine_ = 0;
+}
+
+/// Configure the DFE for the next stack
+/** @param scalars Scalar values to be set before execution
+**/
+void dataflow_engine::configure(dfe_scalars const& scalars)
+{
+	std::cerr << "Configuring DFE" << std::endl;
+	if(scalars.roi_radius != dfe_roi_radius) {
+		throw std::runtime_error("dataflow_engine: the DFE is built for a ROI radius of 3, use -c for other radii");
+	}
+	max_actions_t *action = max_actions_init(config_.maxfile(), NULL);
 
 	std::cerr << "SignalFinder.total_images                  :  " << scalars.total_images << std::endl;
 	max_set_uint64t(action, "SignalFinder", "total_images", scalars.total_images);
@@ -156,15 +171,6 @@ dataflow_engine::dataflow_engine(dfe_config const& config, dfe_scalars const& sc
 
 }
 
-
-dataflow_engine::~dataflow_engine()
-{
-	std::cerr << "Unloading engine" << std::endl;
-	max_unload(engine_);
-	engine_ = 0;
-	in_use_ = false;
-}
-
 /// Get the engine handle
 /** @return The engine handle
 **/
@@ -173,91 +179,872 @@ max_engine_t* dataflow_engine::handle() const
 	return engine_;
 }
 
-bool dataflow_engine::in_use_;
+/// Set up the streams of a configured DFE
+/** @param dfe The DFE, configured with the scalars
+    @param prefetcher Source of the images, with the number of images given in the scalars
+    @param scalars Scalar values the DFE is configured with
+**/
+dfe_stream_run::dfe_stream_run(dataflow_engine const& dfe, image_prefetcher& prefetcher, dfe_scalars const& scalars,
+		int recv_slot_count)
+	: sender_(dfe, "from_host", slot_send_length, send_slot_count(prefetcher, scalars)),
+	  receiver_(dfe, "to_host", slot_recv_length, recv_slot_count), prefetcher_(prefetcher), total_images_(scalars.total_images),
+	  image_size_(scalars.img_width * scalars.img_height), img_(0), pixel_(0), pixels_(0), finished_(false),
+	  counters_(0), backoff_(policy_), engine_(0), started_(false), lent_images_(0), lending_(0), lending_slots_(0)
+{}
 
-int main(int argc, char* argv[])
+/// Run one iteration of the polling loop, send a slot of pixels if possible and receive a slot of results
+/** All slots of results that have arrived are received together.
+    @param length Receives the number of results, a multiple of slot_length()
+    @return Null if no results were received, otherwise the results, valid until the next call
+**/
+estimator_result const* dfe_stream_run::poll(int& length)
 {
-	if(argc != 2) {
-		std::cerr << "Usage: " << argv[0] << " image.tif" << std::endl;
-		exit(1);
+	length = 0;
+	if(finished_) {
+		return 0;
 	}
-	char *filename = argv[1];
+	if(!started_) {
+		started_ = true;
+		pin_thread(policy_, engine_);
+		if(counters_) {
+			counters_->start_cpu_time();
+		}
+	}
+	uint32_t ready_seen = prefetcher_.ready_word().load();
 
-	std::cerr << "Opening Tiff file" << std::endl;
-	tiff_container tiff(argv[1], "r");
-	if(!tiff.good()) {
-		std::cerr << "Could not open tiff file '" << filename << "'" << std::endl;
-		exit(1);
+	if(img_ < total_images_ && !pixels_) {
+		pixels_ = prefetcher_.try_acquire();		// images are read on the prefetcher threads, never here
 	}
-	int total_imgs = tiff.total_img_count();
-	tiff_image16_ref img_ref = tiff.image(0);
 
-	dfe_scalars scalars;
-	scalars.total_images = total_imgs;
-	scalars.nm_per_px = 102.0;
-	scalars.start_image = 0;
-	scalars.bg_threshold_factor = 4;
-	scalars.img_width = img_ref.width();
-	scalars.img_height = img_ref.height();
-	scalars.separator_threshold_factor = 0.7;
+	uint64_t start = counters_ ? cycle_clock::now() : 0;
+	if(prefetcher_.lent_buffers()) {
+		lend_slots();
+	}
+	bool have_pixels = pixels_ != 0;
+	int sent = 0;
+	if(pixels_ && prefetcher_.lent_buffers()) {
+		sent = (image_size_ - pixel_) / sender_.slot_length();		// the image was read into acquired slots
+		sender_.write(sent);
+	} else if(pixels_) {
+		sent = sender_.send(pixels_ + pixel_, (image_size_ - pixel_) / sender_.slot_length());
+	}
+	bool image_sent = false;
+	uint64_t sent_time = counters_ ? cycle_clock::now() : 0;
+	if(sent) {
+		pixel_ += sent * sender_.slot_length();
+		if(pixel_ >= image_size_) {
+			image_sent = true;
+			prefetcher_.release();
+			pixels_ = 0;
+			pixel_ = 0;
+			img_++;
+		}
+//		std::cerr << "img: " << img_ << ", pixel: " << pixel_ << std::endl;
+	}
 
-	dfe_config config;
+	int slots = 0;
+	estimator_result* results = receiver_.recv(receiver_.slot_count(), slots);
+	if(counters_) {
+		counters_->record_poll(start, sent_time, cycle_clock::now(), have_pixels, sent, image_sent, results, slots);
+	}
+	length = slots * receiver_.slot_length();
+	if(results && end_of_results(results, length)) {
+		finished_ = true;
+	}
+
+	uint64_t slept_ns;
+	if(sent || results) {
+		backoff_.progress();
+	} else if(backoff_.idle(prefetcher_.ready_word(), ready_seen, slept_ns) && counters_) {
+		counters_->record_wait(slept_ns);
+	}
+	if(counters_ && (finished_ || counters_->polls.value() % 4096 == 0)) {
+		counters_->add_cpu_time();
+	}
+	return results;
+}
+
+/// Check whether the last results have been received
+bool dfe_stream_run::finished() const
+{
+	return finished_;
+}
+
+/// Get the number of results in a slot, poll() returns whole slots
+int dfe_stream_run::slot_length() const
+{
+	return receiver_.slot_length();
+}
+
+/// Count the events of the polling loop, which costs three reads of the cycle counter per iteration
+/** @param counters Receives the events, added to the values it holds; null to stop counting
+**/
+void dfe_stream_run::set_counters(poll_counters *counters)
+{
+	counters_ = counters;
+}
+
+/// Wait and pin the polling thread as a policy says, the thread is pinned at the first poll
+/** @param policy The policy
+    @param engine Number of the engine, selects the core if the policy gives several
+**/
+void dfe_stream_run::set_policy(poll_policy const& policy, int engine)
+{
+	policy_ = policy;
+	backoff_ = poll_backoff(policy);
+	engine_ = engine;
+}
+
+// private
+/// Get the number of slots of the input stream
+/** @param prefetcher The prefetcher the images are taken from
+    @param scalars Scalar values of the DFE configuration
+    @return Two slots to copy into, or the slots of prefetcher.depth() images to read into
+**/
+int dfe_stream_run::send_slot_count(image_prefetcher const& prefetcher, dfe_scalars const& scalars)
+{
+	int image_size = scalars.img_width * scalars.img_height;
+	if(image_size % slot_send_length != 0) {
+		throw std::runtime_error("(scalars.img_height * scalars.img_width) % slot_send_length != 0");
+	}
+	return prefetcher.lent_buffers() ? prefetcher.depth() * (image_size / slot_send_length) : 2;
+}
+
+/// Acquire the slots of the next images and lend them to the prefetcher, as many as are free
+void dfe_stream_run::lend_slots()
+{
+	int slots_per_image = image_size_ / sender_.slot_length();
+	while(lent_images_ < total_images_) {
+		int16 *slots = 0;
+		int acquired = sender_.acquire(slots_per_image - lending_slots_, &slots);
+		if(acquired == 0) {
+			return;
+		}
+		if(lending_slots_ == 0) {
+			lending_ = slots;
+		} else if(slots != lending_ + lending_slots_ * sender_.slot_length()) {
+			throw std::runtime_error("dfe_stream_run: slots of an image are not contiguous");
+		}
+		lending_slots_ += acquired;
+		if(lending_slots_ == slots_per_image) {
+			prefetcher_.lend(lending_);
+			lent_images_++;
+			lending_slots_ = 0;
+		}
+	}
+}
+
+/// Check that the images of a stack fit into the DFE
+/** @param config The DFE configuration
+    @param tiff The image stack
+    @param scalars Scalar values of the DFE configuration
+**/
+void check_dfe_limits(dfe_config const& config, tiff_container& tiff, dfe_scalars const& scalars)
+{
+	tiff_image16_ref img_ref = tiff.image(0);
+	if(scalars.img_height != img_ref.height() || scalars.img_width != img_ref.width()) {
+		throw std::runtime_error("scalars.img_height != img_ref.height() || scalars.img_width != img_ref.width()");
+	}
 
 	if(scalars.img_width > config.constants().max_img_width || scalars.img_height > config.constants().max_img_height) {
 		throw std::runtime_error("scalars.img_width > config.constants().max_img_width || scalars.img_height > config.constants().max_img_height");
 	}
+}
 
-	dataflow_engine dfe(config, scalars);
+/// Stream all images of a stack through the DFE and print the results
+/** @param config The DFE configuration
+    @param dfe The loaded DFE, configured here for the stack
+    @param tiff The image stack
+    @param scalars Scalar values of the DFE configuration
+    @param options Options of the run
+    @param writer Output backend for the results
+**/
+void run_dfe(dfe_config const& config, dataflow_engine& dfe, tiff_container& tiff, dfe_scalars const& scalars,
+		run_options const& options, result_writer& writer)
+{
+	check_dfe_limits(config, tiff, scalars);
+	dfe.configure(scalars);
 
 	std::cerr << "Setting up input and output streams" << std::endl;
+	image_prefetcher prefetcher(tiff, 0, scalars.total_images, options.prefetch_depth, options.reader_count,
+			!options.copy_slots);
+	dfe_stream_run run(dfe, prefetcher, scalars, options.recv_slot_count);
+	run.set_policy(options.policy, 0);
+	if(options.instrumentation) {
+		run.set_counters(&options.instrumentation->engine(0));
+	}
+
+	while(!run.finished()) {		// active polling, required by the low-latency interface
+		int length;
+		estimator_result const* results = run.poll(length);
+		if(results) {
+			writer.write(results, length);
+		}
+	}
+
+	print_prefetch_stats(prefetcher.stats());
+}
+
+/// Process all images of a stack on the CPU and print the results
+/** @param tiff The image stack
+    @param scalars Scalar values, as they would be set on the DFE
+    @param options Options of the run
+    @param writer Output backend for the results
+**/
+void run_cpu(tiff_container& tiff, dfe_scalars const& scalars, run_options const& options, result_writer& writer)
+{
+	std::cerr << "Setting up CPU engine with " << options.thread_count << " threads" << std::endl;
+	cpu_engine engine(scalars, options.thread_count, options.fit_gaussians);
+	std::cerr << "Background kernel                          :  " << engine.background_kernel_name() << std::endl;
+	std::cerr << "ROI radius                                 :  " << engine.roi_radius() << std::endl;
+	if(engine.fit_gaussians()) {
+		std::cerr << "Gaussian fit kernel                        :  " << gaussian_fitter::kernel_name() << std::endl;
+	}
 
-	const int slot_send_length = 2048;
-	const int slot_recv_length = 16;
-	ll_send_stream<int16_t> sender(dfe, "from_host", slot_send_length);
-	ll_recv_stream<estimator_result> receiver(dfe, "to_host", slot_recv_length);
+	image_prefetcher prefetcher(tiff, 0, scalars.total_images, options.prefetch_depth, options.reader_count);
 
-	if((scalars.img_height * scalars.img_width) % slot_send_length != 0) {
-		throw std::runtime_error("(config.constants().img_height * config.constants().img_width) % slot_send_length != 0");
+	std::vector<estimator_result> results;
+	for(int img = 0; img < scalars.total_images; img++) {
+		engine.process(prefetcher.acquire(), results);
+		prefetcher.release();
+		if(!results.empty()) {
+			writer.write(results.data(), results.size());
+			results.clear();
+		}
 	}
 
-	int img = 0;
-	int pixel = 0;
-	bool all_send = false;
-	while(true) {		// active polling, required by the low-latency interface
-		if(scalars.img_height != img_ref.height() || scalars.img_width != img_ref.width()) {
-			throw std::runtime_error("scalars.img_height != img_ref.height() || scalars.img_width != img_ref.width()");
+	print_prefetch_stats(prefetcher.stats());
+}
+
+/// Check whether a path ends with an extension of tiff files
+static bool has_tiff_extension(std::string const& path)
+{
+	char const* extensions[] = {".tif", ".tiff", ".TIF", ".TIFF"};
+	for(size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+		std::string extension(extensions[i]);
+		if(path.size() > extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		if(!all_send && sender.send(img_ref.data()[0] + pixel)) {
-			pixel += sender.slot_length();
-			if(pixel >= img_ref.height() * img_ref.width()) {
-				pixel = 0;
-				img++;
-				if(img < total_imgs) {
-					img_ref = tiff.image(img);
-				} else {
-					all_send = true;
-				}
-			}
-//			std::cerr << "img: " << img << ", pixel: " << pixel << std::endl;
+/// Add a stack, or all stacks in a directory in alphabetical order, to a list
+/** A multi-file OME-TIFF series in a directory is added once, by its first file.
+    @param path Path of a tiff file or of a directory
+    @param stacks The list
+**/
+void collect_stacks(std::string const& path, std::vector<std::string>& stacks)
+{
+	struct stat path_stat;
+	if(stat(path.c_str(), &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
+		stacks.push_back(path);
+		return;
+	}
+
+	DIR *dir = opendir(path.c_str());
+	if(!dir) {
+		throw std::runtime_error("opendir: " + path + ": " + strerror(errno));
+	}
+	std::vector<std::string> entries;
+	while(struct dirent *entry = readdir(dir)) {
+		std::string name(entry->d_name);
+		if(has_tiff_extension(name)) {
+			entries.push_back(path + "/" + name);
 		}
+	}
+	closedir(dir);
 
-		estimator_result* results = receiver.recv();
-		if(results) {
-//			std::cerr << "received results" << std::endl;
-			print_results(results, receiver.slot_length());
-			if(end_of_results(results, receiver.slot_length())) {
-				break;
+	std::sort(entries.begin(), entries.end());
+	for(size_t i = 0; i < entries.size(); i++) {
+		std::vector<std::string> series = tiff_container::series_paths(entries[i]);
+		if(series.empty() || series[0] == entries[i]) {		// opening any file of a series opens all of it
+			stacks.push_back(entries[i]);
+		}
+	}
+}
+
+/// Add the stacks and directories listed in a file, one per line, to a list
+/** @param list_path Path of the file, "-" for standard input
+    @param stacks The list
+**/
+void read_stack_list(std::string const& list_path, std::vector<std::string>& stacks)
+{
+	std::ifstream list_file;
+	if(list_path != "-") {
+		list_file.open(list_path.c_str());
+		if(!list_file) {
+			throw std::runtime_error("Could not open list of stacks '" + list_path + "'");
+		}
+	}
+	std::istream& list = list_path == "-" ? std::cin : list_file;
+
+	std::string line;
+	while(std::getline(list, line)) {
+		if(!line.empty()) {
+			collect_stacks(line, stacks);
+		}
+	}
+}
+
+/// Get the path of the output file of a stack, the stack path with the extension of the output format
+/** @param stack Path of the stack
+    @param options Options of the run, with output format and directory
+    @return The path of the output file
+**/
+std::string output_path(std::string const& stack, run_options const& options)
+{
+	std::string base = stack;
+	if(!options.output_dir.empty()) {
+		size_t slash = base.rfind('/');
+		base = options.output_dir + "/" + (slash == std::string::npos ? base : base.substr(slash + 1));
+	}
+	size_t dot = base.rfind('.');
+	if(dot != std::string::npos && base.find('/', dot) == std::string::npos) {
+		base.erase(dot);
+	}
+	return base + "." + options.output_format;
+}
+
+/// Get the scalar values of the engine for a stack
+/** @param width Width of the images in pixels
+    @param height Height of the images in pixels
+    @param total_images Number of images of the stack
+    @param options Options of the run, with the thresholds and pixel size
+    @return The scalar values
+**/
+dfe_scalars stack_scalars(int width, int height, int total_images, run_options const& options)
+{
+	dfe_scalars scalars;
+	scalars.total_images = total_images;
+	scalars.nm_per_px = options.nm_per_px > 0 ? options.nm_per_px : default_nm_per_px;
+	scalars.start_image = 0;
+	scalars.bg_threshold_factor = options.bg_threshold_factor;
+	scalars.img_width = width;
+	scalars.img_height = height;
+	scalars.separator_threshold_factor = options.separator_threshold_factor;
+	if(options.roi_radius) {
+		scalars.roi_radius = options.roi_radius;
+	} else if(options.psf_sigma > 0) {
+		scalars.roi_radius = cpu_engine::roi_radius_for_psf(options.psf_sigma / scalars.nm_per_px);
+	} else {
+		scalars.roi_radius = dfe_roi_radius;
+	}
+	return scalars;
+}
+
+/// Set engine parameters given as a comma-separated list of name=value pairs
+/** Names are bg_threshold_factor, separator_threshold_factor, nm_per_px, roi_radius and psf_sigma.
+    @param spec The list
+    @param options Receives the parameters
+**/
+void parse_engine_params(std::string const& spec, run_options& options)
+{
+	std::istringstream list(spec);
+	std::string item;
+	while(std::getline(list, item, ',')) {
+		size_t equals = item.find('=');
+		std::string name = item.substr(0, equals);
+		char const* value = equals == std::string::npos ? "" : item.c_str() + equals + 1;
+		if(name == "bg_threshold_factor") {
+			char *end;
+			options.bg_threshold_factor = strtol(value, &end, 10);
+			if(end == value || *end) {		// the DFE compares with an integer factor
+				throw std::runtime_error("bg_threshold_factor must be an integer");
+			}
+		} else if(name == "separator_threshold_factor") {
+			options.separator_threshold_factor = atof(value);
+		} else if(name == "nm_per_px") {
+			options.nm_per_px = atof(value);
+			if(!(options.nm_per_px > 0)) {
+				throw std::runtime_error("nm_per_px must be positive");
 			}
+		} else if(name == "roi_radius") {
+			options.roi_radius = atoi(value);
+			if(options.roi_radius < cpu_engine::min_roi_radius || options.roi_radius > cpu_engine::max_roi_radius) {
+				throw std::runtime_error("roi_radius must be from 2 to 6");
+			}
+		} else if(name == "psf_sigma") {
+			options.psf_sigma = atof(value);
+			if(!(options.psf_sigma > 0)) {
+				throw std::runtime_error("psf_sigma must be positive");
+			}
+		} else {
+			throw std::runtime_error("Unknown engine parameter '" + item + "'");
 		}
+	}
+	if(options.bg_threshold_factor < 0 || options.separator_threshold_factor < 0) {
+		throw std::runtime_error("Engine parameters must not be negative");
+	}
+}
 
+/// Process a stack on the CPU or the loaded DFEs and write its results
+/** @param path Path of the stack
+    @param options Options of the run
+    @param config The DFE configuration, null for the CPU
+    @param engines The loaded DFEs, empty for the CPU
+    @param results Receives the results instead of the output file or stdout, may be null
+    @return False if the stack could not be opened
+**/
+bool process_stack(std::string const& path, run_options const& options, dfe_config const* config,
+		std::vector<dataflow_engine*> const& engines, result_writer *results)
+{
+	std::cerr << "Opening Tiff file '" << path << "'" << std::endl;
+	tiff_container tiff(path, "r", options.use_index_file);
+	if(!tiff.good() || tiff.total_img_count() == 0) {
+		std::cerr << "Could not open tiff file '" << path << "'" << std::endl;
+		return false;
+	}
+	run_options stack_options = options;
+	if(!(stack_options.nm_per_px > 0) && tiff.nm_per_px() > 0) {
+		stack_options.nm_per_px = tiff.nm_per_px();
+		std::cerr << "Pixel size from OME-XML (nm)               :  " << stack_options.nm_per_px << std::endl;
 	}
+	tiff_image16_ref img_ref = tiff.image(0);
+	dfe_scalars scalars = stack_scalars(img_ref.width(), img_ref.height(), tiff.total_img_count(), stack_options);
 
+	if(!stack_options.reader_count) {		// a mapped stack is only copied, compressed stacks are decoded in parallel
+		stack_options.reader_count = tiff.mapped() ? 1 : thread_pool::default_thread_count();
+		std::cerr << "Image readers                              :  " << stack_options.reader_count
+				  << (tiff.mapped() ? " (mapped)" : " (decoded with libtiff)") << std::endl;
+	}
 
-	std::cerr << "Shutting down" << std::endl;
+	std::ofstream output_file;
+	if(options.per_stack_output && !results) {
+		std::string output = output_path(path, options);
+		std::cerr << "Writing results to '" << output << "'" << std::endl;
+		output_file.open(output.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!output_file) {
+			throw std::runtime_error("Could not open output file '" + output + "'");
+		}
+	}
+	std::ostream& out = options.per_stack_output ? output_file : std::cout;
+	std::unique_ptr<result_writer> output_writer;
+	if(!results) {
+		output_writer = result_writer::create(options.output_format, out, scalars);
+	}
+	result_writer& writer = results ? *results : *output_writer;
+
+	// a region, or frames larger than the engine or the tile size, are processed tile by tile
+	int max_width = options.use_cpu ? img_ref.width() : config->constants().max_img_width;
+	int max_height = options.use_cpu ? img_ref.height() : config->constants().max_img_height;
+	if(options.tile_size) {
+		max_width = std::min(max_width, options.tile_size);
+		max_height = std::min(max_height, options.tile_size);
+	}
+	if(options.region.width || img_ref.width() > max_width || img_ref.height() > max_height) {
+		frame_window frame = {0, 0, img_ref.width(), img_ref.height()};
+		int width_multiple = options.use_cpu ? 1 : tile_width_multiple;
+		std::vector<frame_tile> tiles = split_frame(img_ref.width(), img_ref.height(),
+				options.region.width ? options.region : frame, max_width, max_height,
+				width_multiple, options.use_cpu ? 1 : dfe_stream_run::slot_send_length / width_multiple,
+				tile_margin(scalars.roi_radius));
+		std::cerr << "Tiles                                      :  " << tiles.size() << " of "
+				  << tiles[0].window.width << "x" << tiles[0].window.height << std::endl;
+		run_tiled(config, engines, tiff, tiles, scalars, stack_options, writer);
+	} else if(options.use_cpu) {
+		run_cpu(tiff, scalars, stack_options, writer);
+	} else if(engines.size() == 1) {
+		run_dfe(*config, *engines[0], tiff, scalars, stack_options, writer);
+	} else {
+		run_dfe_sharded(*config, engines, tiff, scalars, stack_options, writer);
+	}
+	writer.finish();
 
-	return 0;
+	return true;
 }
 
+/// Process frames from a live source and write the results of each frame to stdout as soon as it is complete
+/** @param path Path of the pipe for -s, or of the stack replayed for -f
+    @param options Options of the run
+    @param config The DFE configuration, null for the CPU
+    @param engines The loaded DFEs, empty for the CPU
+    @return False if the source could not be opened
+**/
+bool process_live(std::string const& path, run_options const& options, dfe_config const* config,
+		std::vector<dataflow_engine*> const& engines)
+{
+	std::unique_ptr<tiff_container> tiff;
+	std::unique_ptr<live_source> source;
+	if(options.replay_fps > 0) {
+		std::cerr << "Replaying Tiff file '" << path << "' at " << options.replay_fps << " frames per second" << std::endl;
+		tiff.reset(new tiff_container(path, "r", options.use_index_file));
+		if(!tiff->good() || tiff->total_img_count() == 0) {
+			std::cerr << "Could not open tiff file '" << path << "'" << std::endl;
+			return false;
+		}
+		source.reset(new replay_source(*tiff, options.replay_fps));
+	} else {
+		std::cerr << "Waiting for live stream '" << path << "'" << std::endl;
+		source.reset(new pipe_source(path));
+	}
+	if(source->frame_count() <= 0 || source->width() <= 0 || source->height() <= 0) {
+		std::cerr << "Live stream '" << path << "' announced no frames" << std::endl;
+		return false;
+	}
+
+	std::ofstream latency_file;
+	if(!options.latency_log.empty()) {
+		latency_file.open(options.latency_log.c_str(), std::ios::out | std::ios::trunc);
+		if(!latency_file) {
+			throw std::runtime_error("Could not open latency log '" + options.latency_log + "'");
+		}
+		latency_file << "frame\tlocalizations\tlatency_us\n";
+	}
+
+	run_options live_options = options;
+	if(tiff && !(live_options.nm_per_px > 0)) {
+		live_options.nm_per_px = tiff->nm_per_px();
+	}
+	dfe_scalars scalars = stack_scalars(source->width(), source->height(), source->frame_count(), live_options);
+	std::unique_ptr<result_writer> writer = result_writer::create(options.output_format, std::cout, scalars);
+	run_live(*source, scalars, options, config, engines.empty() ? 0 : engines[0], *writer,
+			latency_file.is_open() ? &latency_file : 0);
+	writer->finish();
+
+	return true;
+}
+
+/// Parse the value of an option with a parser that throws std::runtime_error if the value is invalid
+/** @param parse Function that parses the value
+    @return True iff the value was valid, otherwise the message of the parser is printed
+**/
+template<class parser> bool parse_option(parser parse)
+{
+	try {
+		parse();
+	} catch(std::runtime_error const& e) {
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/// Print the command line options
+void usage(char const* name)
+{
+	std::cerr << "Usage: " << name << " [-c] [-t threads] [-i] [-p depth] [-r readers] [-o format] [-l list] [-d dir] [-e engines] [-w images] [-C] [-R slots] [-X region] [-T size] [-F] image.tif|dir ..." << std::endl
+			  << "       " << name << " [-c] [-t threads] [-o format] [-L file] [-X region] -s pipe|-" << std::endl
+			  << "       " << name << " [-c] [-t threads] [-o format] [-L file] [-X region] -f fps image.tif" << std::endl
+			  << "       " << name << " [-c] [-t threads] [-p depth] [-r readers] [-o format] [-d dir] -B key=value,..." << std::endl
+			  << "       " << name << " [-t threads] -G key=value,... out.tif" << std::endl
+			  << "       " << name << " [-c] [-t threads] [-e engines] [-P name=value,...] [-m nm] -A truth.tsv image.tif" << std::endl
+			  << "  -c          process the images on the CPU instead of the DFE" << std::endl
+			  << "  -t threads  number of threads for the CPU, default is one per core" << std::endl
+			  << "  -i          keep an index of the images in image.tif.index for faster opening" << std::endl
+			  << "  -p depth    number of images read ahead, default is 4" << std::endl
+			  << "  -r readers  number of threads reading images, default is 1 for uncompressed stacks and one per core for compressed ones" << std::endl
+			  << "  -o format   output format, tsv for text (default) or bin for binary columns" << std::endl
+			  << "  -l list     also process the stacks and directories listed in a file, - for stdin" << std::endl
+			  << "  -d dir      write the results of each stack to dir instead of next to the stack" << std::endl
+			  << "  -e engines  number of DFEs to split each stack across, default is 1" << std::endl
+			  << "  -w images   images streamed before each part of a split stack for the background, default is 32" << std::endl
+			  << "  -C          copy the images into the DFE input stream instead of reading them into its slots" << std::endl
+			  << "  -R slots    number of slots of the DFE output stream, all filled slots are read at once, default is 16" << std::endl
+			  << "  -X region   process only x,y,width,height of every frame, positions stay in frame coordinates" << std::endl
+			  << "  -T size     split frames into overlapping tiles of at most size x size pixels, default is the limit" << std::endl
+			  << "              of the DFE; a tile keeps the localizations of its part, so seams give no duplicates" << std::endl
+			  << "  -F          with -c, refine the signals by maximum-likelihood fits of a Gaussian to their ROIs;" << std::endl
+			  << "              intensity, position, width and delta_mu (Cramer-Rao bound) are taken from the fit" << std::endl
+			  << "With more than one stack or with -d, the results of image.tif are written to image.tsv or image.bin," << std::endl
+			  << "otherwise to stdout. The DFE is loaded once for all stacks." << std::endl
+			  << "  -s pipe     process frames from a live stream as they arrive, - for stdin" << std::endl
+			  << "  -f fps      replay image.tif as a live stream at fps frames per second" << std::endl
+			  << "  -L file     write the latency of every live frame to file" << std::endl
+			  << "Live results are written to stdout and flushed after every frame." << std::endl
+			  << "  -B params   benchmark a synthetic stack and write the report as JSON to stdout, params are" << std::endl
+			  << "              width, height, frames, density (on per um^2), on_frames and off_frames (mean frames on and off)," << std::endl
+			  << "              photons, background, sigma (px), nm_per_px and seed," << std::endl
+			  << "              e.g. -B width=256,height=256,frames=500; the stack is written to dir or $TMPDIR" << std::endl
+			  << "  -P params   engine parameters bg_threshold_factor (default 4), separator_threshold_factor (0.7)" << std::endl
+			  << "              and nm_per_px (from the OME-XML of the stack, otherwise 102), e.g. -P bg_threshold_factor=3;" << std::endl
+			  << "              with -c also roi_radius (2 to 6, default 3) or psf_sigma (nm), which sets it to 2.5 PSF sigma" << std::endl
+			  << "  -G params   write a synthetic stack like -B, with camera offset, gain and read_noise, to out.tif" << std::endl
+			  << "              and the true emitter positions and ids to out.truth.tsv" << std::endl
+			  << "  -A truth    process image.tif and write recall, precision, RMSE, delta_mu calibration and runtime" << std::endl
+			  << "              against the ground truth as JSON to stdout" << std::endl
+			  << "  -m nm       largest distance of a localization from its emitter for -A, default is 200" << std::endl
+			  << "  -I target   count the events of the DFE polling loops and write them as JSON lines to a file" << std::endl
+			  << "              every second, or to clients of a Unix socket with unix:path; target,ms sets the interval" << std::endl
+			  << "  -W policy   how DFE polling threads wait without progress: spin (default), pause or sleep, followed by" << std::endl
+			  << "              spin=polls before waiting (1000), max_pauses (64), max_us (200) and the cores to pin the" << std::endl
+			  << "              threads to, cpu=2+4-6 (one per engine) or node=numa node, e.g. -W sleep,max_us=100,cpu=3" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	run_options options;
+	options.use_cpu = false;
+	options.use_index_file = false;
+	options.thread_count = thread_pool::default_thread_count();
+	options.prefetch_depth = 4;
+	options.reader_count = 0;		// chosen per stack
+	options.output_format = "tsv";
+	options.per_stack_output = false;
+	options.engine_count = 1;
+	options.warmup_images = 32;
+	options.replay_fps = 0;
+	options.copy_slots = false;
+	options.benchmark = false;
+	options.bg_threshold_factor = 4;
+	options.separator_threshold_factor = 0.7;
+	options.nm_per_px = 0;		// from the metadata of each stack
+	options.roi_radius = 0;		// from the PSF and the pixel size of each stack
+	options.psf_sigma = 0;
+	options.instrumentation = 0;
+	options.recv_slot_count = dfe_stream_run::default_recv_slot_count;
+	options.region = frame_window();
+	options.tile_size = 0;
+	options.fit_gaussians = false;
 
+	std::vector<std::string> stacks;
+	synthetic_params benchmark_params = synthetic_stack::default_params();
+	std::unique_ptr<poll_instrumentation> instrumentation;
+	bool generate = false;
+	synthetic_params generate_params = synthetic_stack::default_params();
+	std::string truth_path;
+	double tolerance_nm = 200;
 
+	int opt;
+	while((opt = getopt(argc, argv, "ct:ip:r:o:l:d:e:w:CR:W:X:T:Fs:f:L:B:P:G:A:m:I:")) != -1) {
+		switch(opt) {
+		case 'c':
+			options.use_cpu = true;
+			break;
+		case 't':
+			options.thread_count = atoi(optarg);
+			if(options.thread_count < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'i':
+			options.use_index_file = true;
+			break;
+		case 'p':
+			options.prefetch_depth = atoi(optarg);
+			if(options.prefetch_depth < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'r':
+			options.reader_count = atoi(optarg);
+			if(options.reader_count < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'o':
+			options.output_format = optarg;
+			if(options.output_format != "tsv" && options.output_format != "bin") {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'l':
+			if(!parse_option([&] { read_stack_list(optarg, stacks); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'd':
+			options.output_dir = optarg;
+			options.per_stack_output = true;
+			break;
+		case 'e':
+			options.engine_count = atoi(optarg);
+			if(options.engine_count < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'w':
+			options.warmup_images = atoi(optarg);
+			if(options.warmup_images < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'C':
+			options.copy_slots = true;
+			break;
+		case 'W':
+			if(!parse_option([&] { options.policy = poll_policy::parse(optarg); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'R':
+			options.recv_slot_count = atoi(optarg);
+			if(options.recv_slot_count < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 's':
+			options.live_pipe = optarg;
+			break;
+		case 'f':
+			options.replay_fps = atof(optarg);
+			if(!(options.replay_fps > 0)) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'L':
+			options.latency_log = optarg;
+			break;
+		case 'B':
+			if(!parse_option([&] { benchmark_params = synthetic_stack::parse_params(optarg); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			options.benchmark = true;
+			break;
+		case 'P':
+			if(!parse_option([&] { parse_engine_params(optarg, options); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'G':
+			if(!parse_option([&] { generate_params = synthetic_stack::parse_params(optarg); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			generate = true;
+			break;
+		case 'A':
+			truth_path = optarg;
+			break;
+		case 'X':
+			if(!parse_option([&] { options.region = parse_frame_window(optarg); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'T':
+			options.tile_size = atoi(optarg);
+			if(options.tile_size < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'F':
+			options.fit_gaussians = true;
+			break;
+		case 'I':
+			if(!parse_option([&] { instrumentation = poll_instrumentation::create(optarg, dfe_stream_run::slot_recv_length); })) {
+				usage(argv[0]);
+				exit(1);
+			}
+			options.instrumentation = instrumentation.get();
+			break;
+		case 'm':
+			tolerance_nm = atof(optarg);
+			if(!(tolerance_nm > 0)) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if(instrumentation) {
+		instrumentation->set_policy(options.policy.description());
+	}
+
+	if(options.fit_gaussians && !options.use_cpu) {		// the DFE streams no ROIs
+		usage(argv[0]);
+		exit(1);
+	}
+	if((options.roi_radius || options.psf_sigma > 0) && !options.use_cpu) {		// the DFE is built for ROIs of radius 3
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if(generate) {
+		if(optind + 1 != argc) {
+			usage(argv[0]);
+			exit(1);
+		}
+		generate_stack(argv[optind], generate_params, options.thread_count);
+		return 0;
+	}
+
+	if(options.benchmark && (options.engine_count != 1 || !stacks.empty() || optind != argc
+			|| !options.live_pipe.empty() || options.replay_fps > 0)) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	bool live = !options.live_pipe.empty() || options.replay_fps > 0;
+	if(live && (options.engine_count != 1 || stacks.size() + (argc - optind) != (options.replay_fps > 0 ? 1 : 0)
+			|| (!options.live_pipe.empty() && options.replay_fps > 0))) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	for(int i = optind; i < argc && !live; i++) {
+		collect_stacks(argv[i], stacks);
+	}
+	if(stacks.empty() && !live && !options.benchmark) {
+		usage(argv[0]);
+		exit(1);
+	}
+	if(stacks.size() > 1) {
+		options.per_stack_output = true;
+	}
+	if(!truth_path.empty() && (stacks.size() != 1 || live || options.benchmark)) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	std::unique_ptr<dfe_config> config;
+	std::vector<std::unique_ptr<dataflow_engine> > loaded_engines;
+	std::vector<dataflow_engine*> engines;
+	if(!options.use_cpu) {
+		config.reset(new dfe_config);
+		for(int i = 0; i < options.engine_count; i++) {
+			loaded_engines.push_back(std::unique_ptr<dataflow_engine>(new dataflow_engine(*config)));
+			engines.push_back(loaded_engines.back().get());
+		}
+	}
+
+	int failed = 0;
+	if(options.benchmark) {
+		run_benchmark(benchmark_params, options, config.get(), engines.empty() ? 0 : engines[0], std::cout);
+	}
+	if(live && !process_live(options.replay_fps > 0 ? argv[optind] : options.live_pipe, options, config.get(), engines)) {
+		failed++;
+	}
+	if(!truth_path.empty()) {
+		failed += !score_stack(stacks[0], truth_path, tolerance_nm, options, config.get(), engines, std::cout);
+		stacks.clear();
+	}
+	for(size_t i = 0; i < stacks.size(); i++) {
+		try {
+			if(!process_stack(stacks[i], options, config.get(), engines)) {
+				failed++;
+			}
+		} catch(std::exception const& e) {		// a failed stack does not stop the batch
+			std::cerr << "Could not process tiff file '" << stacks[i] << "': " << e.what() << std::endl;
+			failed++;
+		}
+	}
+	if(stacks.size() > 1) {
+		std::cerr << "Stacks processed / failed                  :  " << stacks.size() - failed << " / " << failed << std::endl;
+	}
+
+	engines.clear();
+	loaded_engines.clear();
+	config.reset();
+
+	std::cerr << "Shutting down" << std::endl;
+
+	return failed ? 1 : 0;
+}
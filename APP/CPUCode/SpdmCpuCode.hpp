@@ -11,27 +11,23 @@
 
 //#include <stdlib.h>
 //#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "tiff.h"
+#include "spdm_types.hpp"
+#include "frame_tiler.hpp"
+#include "image_prefetcher.hpp"
+#include "poll_instrumentation.hpp"
+#include "poll_policy.hpp"
 
+class result_writer;
 
 
-const int end_of_image = -1;	///< Indicates end of an image in the img field of estimator_result
-const int last_pixel   = -2;	///< Indicates last pixel of input has been processed in the img field of estimator_result
-
-
-/// Scalar values of the DFE configuration
-struct dfe_scalars
-{
-	int total_images;					///< total number of images to process
-	float nm_per_px;					///< size of an object that covers one pixel in nanometers
-	long start_image;					///< first image to process, ignore earlier images
-	long bg_threshold_factor;			///< threshold above image background for signal finder
-	long img_width;						///< width in pixels of each image frame
-	long img_height;					///< height in pixels of each image frame
-	double separator_threshold_factor;	///< threshold for signal separator, signals below are discarded
-};
 
 /// Maxfile constants
 struct dfe_config_constants
@@ -61,28 +57,50 @@ private:
 class dataflow_engine
 {
 public:
-	dataflow_engine(dfe_config const& config, dfe_scalars const& scalars);
+	explicit dataflow_engine(dfe_config const& config);
 	~dataflow_engine();
+	void configure(dfe_scalars const& scalars);
 	max_engine_t* handle() const;
 
 private:
 	dataflow_engine(dataflow_engine const&);		// no copying
 	dataflow_engine& operator=(const dataflow_engine&);
+	dfe_config const& config_;
 	max_engine_t *engine_;
-	static bool in_use_;
 };
 
-/// Result type as streamed from the signal estimator
-struct estimator_result
+/// Edge length of a pixel in nanometers if neither the options nor the metadata of a stack give one
+const float default_nm_per_px = 102.0;
+
+/// Command line options that apply to all stacks of a run
+struct run_options
 {
-	int32_t img;			///< Image (frame) number
-	float Q;				///< Total charge / intensity
-	float mu_x;				///< X position of the signal center with sub-pixel accuracy
-	float mu_y;				///< Y position of the signal center with sub-pixel accuracy
-	float sigma_x;			///< Width of the signal in x direction, squared
-	float sigma_y;			///< Width of the signal in y direction, squared
-	float delta_mu_x;		///< Confidence of the x position, squared
-	float delta_mu_y;		///< Confidence of the y position, squared
+	bool use_cpu;					///< process the images on the CPU instead of the DFE
+	bool use_index_file;			///< keep an index of the images next to each stack
+	int thread_count;				///< number of threads of the CPU engine
+	int prefetch_depth;				///< number of images read ahead
+	int reader_count;				///< number of threads reading images, 0 to choose per stack
+	std::string output_format;		///< "tsv" or "bin"
+	std::string output_dir;			///< directory for per-stack output, empty for the directory of the stack
+	bool per_stack_output;			///< write the results of each stack to its own file instead of stdout
+	int engine_count;				///< number of DFEs a stack is split across
+	int warmup_images;				///< images streamed before each part of a split stack to let the background converge
+	std::string live_pipe;			///< live stream to process, empty for stacks
+	double replay_fps;				///< frame rate of a stack replayed as a live stream, 0 for none
+	std::string latency_log;		///< file for the latency of every live frame, empty for none
+	bool copy_slots;				///< copy the pixels into the slots of the input stream instead of reading images into them
+	bool benchmark;					///< process a synthetic stack and report the throughput instead of processing stacks
+	long bg_threshold_factor;		///< threshold above image background for the signal finder
+	double separator_threshold_factor;	///< threshold for the signal separator
+	float nm_per_px;				///< size of an object that covers one pixel in nanometers, 0 to take it from the stack
+	int roi_radius;					///< distance of the ROI border from its center, 0 to derive it from psf_sigma
+	double psf_sigma;				///< standard deviation of the PSF of the optics in nanometers, 0 if not known
+	poll_instrumentation *instrumentation;	///< counters of the DFE polling loops, null if not counted
+	int recv_slot_count;			///< number of slots of the DFE output stream
+	poll_policy policy;				///< waiting and CPU affinity of the threads driving the DFEs
+	frame_window region;			///< part of the frames to process, width 0 for the whole frames
+	int tile_size;					///< largest edge of a tile the frames are split into, 0 for the limit of the DFE
+	bool fit_gaussians;				///< refine the signals of the CPU engine by maximum-likelihood fits of a Gaussian
 };
 
 /// Low-latency stream between, base class for stream from host to DFE or vice versa
@@ -171,13 +189,19 @@ max_llstream_t* ll_stream<T>::handle() const
 }
 
 /// Low-latency stream for sending data from host to DFE
+/** Slots can be filled in place: acquire() hands out free slots in ring order, they stay acquired
+    until write() passes the oldest of them to the DFE. The slots of a ring whose slot count is a
+    multiple of n are acquired in contiguous groups of n if at most n are acquired at a time.
+**/
 template<class T>
 class ll_send_stream : public ll_stream<T>
 {
 public:
-	ll_send_stream(dataflow_engine const& dfe, std::string name, int slot_length);
+	ll_send_stream(dataflow_engine const& dfe, std::string name, int slot_length, int slot_count = 2);
 	virtual ~ll_send_stream();
-	bool send(T* slot_data);
+	int send(T const* data, int max_slots = 1);
+	int acquire(int max_slots, T **slots);
+	void write(int slots);
 
 private:
 	ll_send_stream(ll_send_stream<T> const&);	// no copying
@@ -188,10 +212,11 @@ private:
 /** @param dfe The DFE to connect with
     @param name The name of the stream
     @param slot_length The length of each slot in units of T
+    @param slot_count The number of slots in the ring
  **/
 template<class T>
-ll_send_stream<T>::ll_send_stream(dataflow_engine const& dfe, std::string name, int slot_length)
-	: ll_stream<T>(dfe, name, slot_length)
+ll_send_stream<T>::ll_send_stream(dataflow_engine const& dfe, std::string name, int slot_length, int slot_count)
+	: ll_stream<T>(dfe, name, slot_length, slot_count)
 {
 }
 
@@ -199,35 +224,55 @@ template<class T>
 ll_send_stream<T>::~ll_send_stream()
 {}
 
-/// Send data if a slot is available
-/** @param slot_data The data to be send
-    @return True iff the data was sent
+/// Copy data into as many free slots as available and send them
+/** @param data The data to be sent, max_slots slots long
+    @param max_slots The largest number of slots to send
+    @return The number of slots sent, 0 if no slot was free
  **/
 template<class T>
-bool ll_send_stream<T>::send(T* slot_data)
+int ll_send_stream<T>::send(T const* data, int max_slots)
 {
 	T *write_ptr = 0;
-	int slots = max_llstream_write_acquire(ll_stream<T>::handle(), 1, (void **) &write_ptr);
-	if(slots == 0) {
-//		std::cerr << "No space to send data" << std::endl;
-		return false;
-	} else {
-//		std::cerr << "Sending data" << std::endl;
-		std::copy(slot_data, slot_data + ll_stream<T>::slot_length(), write_ptr);
-		max_llstream_write(ll_stream<T>::handle(), 1);
-		return true;
+	int slots = acquire(max_slots, &write_ptr);
+	if(slots) {
+		std::copy(data, data + slots * ll_stream<T>::slot_length(), write_ptr);
+		write(slots);
 	}
+	return slots;
+}
+
+/// Acquire free slots to fill in place
+/** @param max_slots The largest number of slots to acquire
+    @param slots Receives the first slot, the others follow it contiguously
+    @return The number of slots acquired, 0 if no slot was free
+ **/
+template<class T>
+int ll_send_stream<T>::acquire(int max_slots, T **slots)
+{
+	return max_llstream_write_acquire(ll_stream<T>::handle(), max_slots, (void **) slots);
+}
+
+/// Send the oldest acquired slots to the DFE
+/** @param slots The number of slots to send, at most the number acquired and not sent yet
+ **/
+template<class T>
+void ll_send_stream<T>::write(int slots)
+{
+	max_llstream_write(ll_stream<T>::handle(), slots);
 }
 
 
 /// Low-latency stream for receiving data on the host from the DFE
+/** Received slots stay valid until the next receive, which discards them together.
+**/
 template<class T>
 class ll_recv_stream : public ll_stream<T>
 {
 public:
-	ll_recv_stream(dataflow_engine const& dfe, std::string name, int slot_length);
+	ll_recv_stream(dataflow_engine const& dfe, std::string name, int slot_length, int slot_count = 2);
 	virtual ~ll_recv_stream();
 	T* recv();
+	T* recv(int max_slots, int& slots);
 
 private:
 	ll_recv_stream(ll_recv_stream<T> const&);	// no copying
@@ -239,10 +284,11 @@ private:
 /** @param dfe The DFE to connect with
     @param name The name of the stream
     @param slot_length The length of each slot in units of T
+    @param slot_count The number of slots in the ring
  **/
 template<class T>
-ll_recv_stream<T>::ll_recv_stream(dataflow_engine const& dfe, std::string name, int slot_length)
-	: ll_stream<T>(dfe, name, slot_length), outstanding_discards_(0)
+ll_recv_stream<T>::ll_recv_stream(dataflow_engine const& dfe, std::string name, int slot_length, int slot_count)
+	: ll_stream<T>(dfe, name, slot_length, slot_count), outstanding_discards_(0)
 {}
 
 template<class T>
@@ -254,29 +300,94 @@ ll_recv_stream<T>::~ll_recv_stream()
 	}
 }
 
-/// Receive data if available
+/// Receive a slot of data if available
 /** @return Null if no data was available, slot with data otherwise
  **/
 template<class T>
 T* ll_recv_stream<T>::recv()
 {
+	int slots;
+	return recv(1, slots);
+}
 
+/// Receive all available slots of data with one read, up to a maximum
+/** @param max_slots The largest number of slots to receive
+    @param slots Receives the number of slots received
+    @return Null if no data was available, otherwise the first slot, the others follow it contiguously
+ **/
+template<class T>
+T* ll_recv_stream<T>::recv(int max_slots, int& slots)
+{
 	if(outstanding_discards_) {
 		max_llstream_read_discard(ll_stream<T>::handle(), outstanding_discards_);
 		outstanding_discards_ = 0;
 	}
 
 	T *read_ptr = 0;
-	ssize_t slots = max_llstream_read(ll_stream<T>::handle(), 1, (void **) &read_ptr);
+	slots = max_llstream_read(ll_stream<T>::handle(), max_slots, (void **) &read_ptr);
 	if(slots == 0) {
-//		std::cerr << "No data received from stream" << std::endl;
 		return 0;
-	} else {
-//		std::cerr << "Data received from stream" << std::endl;
-		outstanding_discards_ += slots;
-		return read_ptr;
 	}
+	outstanding_discards_ = slots;
+	return read_ptr;
 }
 
 
+/// Images of a stack streamed through a configured DFE with the low-latency interface
+/** Drives one iteration of the active polling loop per call of poll(), so several engines can be
+    driven from one thread or from one thread each. The images are taken from a prefetcher. If the
+    prefetcher reads into lent buffers, the input stream gets a ring of prefetcher.depth() images and
+    the slots of each image are lent to the prefetcher, so the pixels are read directly into the slots
+    and sent without a copy. Otherwise the pixels are copied from the buffers of the prefetcher.
+**/
+class dfe_stream_run
+{
+public:
+	dfe_stream_run(dataflow_engine const& dfe, image_prefetcher& prefetcher, dfe_scalars const& scalars,
+			int recv_slot_count = default_recv_slot_count);
+	estimator_result const* poll(int& length);
+	bool finished() const;
+	int slot_length() const;
+	void set_counters(poll_counters *counters);
+	void set_policy(poll_policy const& policy, int engine);
+
+	static const int slot_send_length = 2048;	///< number of pixels in a slot of the input stream
+	static const int slot_recv_length = 16;		///< number of results in a slot of the output stream
+	static const int default_recv_slot_count = 16;	///< number of slots of the output stream
+
+private:
+	dfe_stream_run(dfe_stream_run const&);		// no copying
+	dfe_stream_run& operator=(const dfe_stream_run&);
+
+	static int send_slot_count(image_prefetcher const& prefetcher, dfe_scalars const& scalars);
+	void lend_slots();
+
+	ll_send_stream<int16_t> sender_;
+	ll_recv_stream<estimator_result> receiver_;
+	image_prefetcher& prefetcher_;
+	int total_images_;
+	int image_size_;
+	int img_;
+	int pixel_;
+	int16 const* pixels_;
+	bool finished_;
+	poll_counters *counters_;
+	poll_policy policy_;
+	poll_backoff backoff_;
+	int engine_;				///< number of the engine for the policy
+	bool started_;				///< true after the first poll
+	int lent_images_;			///< images whose slots have been lent to the prefetcher
+	int16 *lending_;			///< first acquired slot of the image to lend next
+	int lending_slots_;			///< slots acquired for the image to lend next
+};
+
+bool end_of_results(estimator_result const* results, int length);
+void check_dfe_limits(dfe_config const& config, tiff_container& tiff, dfe_scalars const& scalars);
+void print_prefetch_stats(prefetch_stats const& stats);
+dfe_scalars stack_scalars(int width, int height, int total_images, run_options const& options);
+void parse_engine_params(std::string const& spec, run_options& options);
+bool process_stack(std::string const& path, run_options const& options, dfe_config const* config,
+		std::vector<dataflow_engine*> const& engines, result_writer *results = 0);
+
+
 #endif /* SPDMCPUCODE_H */
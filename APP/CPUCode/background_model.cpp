@@ -0,0 +1,193 @@
+/** Moving-average background model of the signal finder with SIMD implementations
+    \file background_model.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "background_model.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+
+/// Compute the square roots of all raw background values, the background has only 2^16 different values
+static std::vector<pixel_frac_t> make_sigma_table()
+{
+	std::vector<pixel_frac_t> table(1 << 16);
+	for(int bg = -(1 << 15); bg < (1 << 15); bg++) {
+		table[(uint16_t) bg] = sqrt_pixel_frac(bg);
+	}
+	return table;
+}
+
+/// Advance all arrays by a number of pixels
+static background_arrays offset_arrays(background_arrays const& arrays, int offset)
+{
+	background_arrays result;
+	result.pixels         = arrays.pixels + offset;
+	result.background     = arrays.background + offset;
+	result.pixel_no_bg    = arrays.pixel_no_bg + offset;
+	result.old_background = arrays.old_background + offset;
+	result.threshold      = arrays.threshold + offset;
+	return result;
+}
+
+/// Subtract the background from a run of pixels and update it, see SignalFinderKernel::subtractBackground
+/** @param arrays The per-pixel arrays
+    @param count Number of pixels
+    @param first_image True for the first image of the stack, which initializes the background
+    @param threshold_factor bg_threshold_factor cast to pixelFracValueType
+**/
+void update_background_scalar(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor)
+{
+	static const std::vector<pixel_frac_t> sigma = make_sigma_table();
+
+	for(int i = 0; i < count; i++) {
+		pixel_frac_t pixel = to_pixel_frac(arrays.pixels[i]);
+		pixel_frac_t bg = first_image ? pixel : arrays.background[i];
+		pixel_frac_t sigma_bg = sigma[(uint16_t) bg];
+		pixel_frac_t delta = wrap_pixel_frac(pixel - bg);
+
+		arrays.background[i] = first_image ? pixel : wrap_pixel_frac(bg + div8_pixel_frac(std::min(delta, sigma_bg)));
+
+		arrays.pixel_no_bg[i] = std::max(delta, (pixel_frac_t) 0);
+		arrays.old_background[i] = bg;
+		arrays.threshold[i] = wrap_pixel_frac((threshold_factor * sigma_bg) >> frac_bits);
+	}
+}
+
+
+#ifdef __x86_64__
+
+// The SIMD kernels compute the same bits as the scalar one:
+// - int16 arithmetic wraps like pixelFracValueType on the DFE
+// - the square root is taken in single precision, scaling by 16 is exact in float
+// - the rounding offset of the division by eight cannot overflow, the delta is clamped to the square root
+// - threshold_factor is an integer, so the product with the root needs only the low 16 bits
+
+/// Square root of 8 raw values widened to 32 bits, rounded to pixelFracValueType
+__attribute__((target("avx2")))
+static inline __m256i sqrt_pixel_frac_avx2(__m256i bg)
+{
+	__m256 value = _mm256_mul_ps(_mm256_cvtepi32_ps(bg), _mm256_set1_ps(1.0f / frac_scale));
+	__m256 root = _mm256_add_ps(_mm256_mul_ps(_mm256_sqrt_ps(value), _mm256_set1_ps(frac_scale)), _mm256_set1_ps(0.5f));
+	return _mm256_cvttps_epi32(_mm256_floor_ps(root));
+}
+
+/// Square root of 16 background values, the root of a negative background is cast to zero
+__attribute__((target("avx2")))
+static inline __m256i sigma_bg_avx2(__m256i bg)
+{
+	bg = _mm256_max_epi16(bg, _mm256_setzero_si256());
+	__m256i low  = sqrt_pixel_frac_avx2(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(bg)));
+	__m256i high = sqrt_pixel_frac_avx2(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(bg, 1)));
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/// Background update with AVX2, 16 pixels per instruction
+__attribute__((target("avx2")))
+void update_background_avx2(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i rounding = _mm256_set1_epi16(4);
+	const __m256i factor = _mm256_set1_epi16(threshold_factor >> frac_bits);
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i pixel = _mm256_slli_epi16(_mm256_loadu_si256((__m256i const*) (arrays.pixels + i)), frac_bits);
+		__m256i bg = first_image ? pixel : _mm256_loadu_si256((__m256i const*) (arrays.background + i));
+		__m256i sigma_bg = sigma_bg_avx2(bg);
+		__m256i delta = _mm256_sub_epi16(pixel, bg);
+		__m256i step = _mm256_srai_epi16(_mm256_add_epi16(_mm256_min_epi16(delta, sigma_bg), rounding), 3);
+
+		_mm256_storeu_si256((__m256i*) (arrays.background + i), first_image ? pixel : _mm256_add_epi16(bg, step));
+		_mm256_storeu_si256((__m256i*) (arrays.pixel_no_bg + i), _mm256_max_epi16(delta, zero));
+		_mm256_storeu_si256((__m256i*) (arrays.old_background + i), bg);
+		_mm256_storeu_si256((__m256i*) (arrays.threshold + i), _mm256_mullo_epi16(factor, sigma_bg));
+	}
+
+	update_background_scalar(offset_arrays(arrays, i), count - i, first_image, threshold_factor);
+}
+
+// the AVX-512 intrinsics of GCC start from undefined registers that it then reports as maybe uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/// Square root of 16 raw values widened to 32 bits, rounded to pixelFracValueType
+__attribute__((target("avx512f,avx512bw")))
+static inline __m256i sqrt_pixel_frac_avx512(__m512i bg)
+{
+	__m512 value = _mm512_mul_ps(_mm512_cvtepi32_ps(bg), _mm512_set1_ps(1.0f / frac_scale));
+	__m512 root = _mm512_add_ps(_mm512_mul_ps(_mm512_sqrt_ps(value), _mm512_set1_ps(frac_scale)), _mm512_set1_ps(0.5f));
+	root = _mm512_roundscale_ps(root, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+	return _mm512_cvtepi32_epi16(_mm512_cvttps_epi32(root));
+}
+
+/// Square root of 32 background values, the root of a negative background is cast to zero
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i sigma_bg_avx512(__m512i bg)
+{
+	bg = _mm512_max_epi16(bg, _mm512_setzero_si512());
+	__m256i low  = sqrt_pixel_frac_avx512(_mm512_cvtepi16_epi32(_mm512_castsi512_si256(bg)));
+	__m256i high = sqrt_pixel_frac_avx512(_mm512_cvtepi16_epi32(_mm512_extracti64x4_epi64(bg, 1)));
+	return _mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1);
+}
+
+/// Background update with AVX-512, 32 pixels per instruction
+__attribute__((target("avx512f,avx512bw")))
+void update_background_avx512(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i rounding = _mm512_set1_epi16(4);
+	const __m512i factor = _mm512_set1_epi16(threshold_factor >> frac_bits);
+
+	int i = 0;
+	for(; i + 32 <= count; i += 32) {
+		__m512i pixel = _mm512_slli_epi16(_mm512_loadu_si512(arrays.pixels + i), frac_bits);
+		__m512i bg = first_image ? pixel : _mm512_loadu_si512(arrays.background + i);
+		__m512i sigma_bg = sigma_bg_avx512(bg);
+		__m512i delta = _mm512_sub_epi16(pixel, bg);
+		__m512i step = _mm512_srai_epi16(_mm512_add_epi16(_mm512_min_epi16(delta, sigma_bg), rounding), 3);
+
+		_mm512_storeu_si512(arrays.background + i, first_image ? pixel : _mm512_add_epi16(bg, step));
+		_mm512_storeu_si512(arrays.pixel_no_bg + i, _mm512_max_epi16(delta, zero));
+		_mm512_storeu_si512(arrays.old_background + i, bg);
+		_mm512_storeu_si512(arrays.threshold + i, _mm512_mullo_epi16(factor, sigma_bg));
+	}
+
+	update_background_avx2(offset_arrays(arrays, i), count - i, first_image, threshold_factor);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+
+/// Select the fastest background kernel the processor supports
+/** @param name Set to the name of the selected kernel if not null
+    @return The kernel
+**/
+background_kernel select_background_kernel(char const **name)
+{
+	background_kernel kernel = &update_background_scalar;
+	char const *kernel_name = "scalar";
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512bw")) {
+		kernel = &update_background_avx512;
+		kernel_name = "avx512";
+	} else if(__builtin_cpu_supports("avx2")) {
+		kernel = &update_background_avx2;
+		kernel_name = "avx2";
+	}
+#endif
+
+	if(name) {
+		*name = kernel_name;
+	}
+	return kernel;
+}
@@ -0,0 +1,37 @@
+/** Moving-average background model of the signal finder with SIMD implementations
+    \file background_model.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef BACKGROUND_MODEL_HPP
+#define BACKGROUND_MODEL_HPP
+
+
+#include <stdint.h>
+
+#include "fixed_point.hpp"
+
+
+/// Per-pixel arrays read and written by the background update of a run of pixels
+struct background_arrays
+{
+	int16_t const *pixels;			///< pixel values of the image
+	pixel_frac_t *background;		///< moving average background, updated in place
+	pixel_frac_t *pixel_no_bg;		///< pixel values above the background
+	pixel_frac_t *old_background;	///< background before the update
+	pixel_frac_t *threshold;		///< signal threshold, bg_threshold_factor times the square root of the background
+};
+
+/// Function that updates the background of count pixels
+typedef void (*background_kernel)(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor);
+
+void update_background_scalar(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor);
+#ifdef __x86_64__
+void update_background_avx2(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor);
+void update_background_avx512(background_arrays const& arrays, int count, bool first_image, pixel_frac_t threshold_factor);
+#endif
+
+background_kernel select_background_kernel(char const **name = 0);
+
+
+#endif /* BACKGROUND_MODEL_HPP */
@@ -0,0 +1,249 @@
+/** End-to-end benchmark of the host path on synthetic stacks
+    \file benchmark.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <MaxSLiCInterface.h>
+
+#include "SpdmCpuCode.hpp"
+#include "cpu_engine.hpp"
+#include "image_prefetcher.hpp"
+#include "live_pipeline.hpp"
+#include "live_source.hpp"
+#include "result_writer.hpp"
+
+#ifndef SPDM_REVISION
+#define SPDM_REVISION "unknown"		///< git revision of the sources, passed in by Makefile.rules
+#endif
+
+
+/// Stream buffer that counts and discards the output
+class discard_buffer : public std::streambuf
+{
+public:
+	discard_buffer() : bytes_(0) {}
+	uint64_t bytes() const { return bytes_; }
+
+protected:
+	int overflow(int c) { bytes_++; return traits_type::not_eof(c); }
+	std::streamsize xsputn(char const* /*s*/, std::streamsize n) { bytes_ += n; return n; }
+
+private:
+	uint64_t bytes_;
+};
+
+/// Writer that measures the time spent formatting results and counts the localizations
+/** Flushing is left to finish(), so the output is written in full buffers like for stacks.
+**/
+class timed_writer : public result_writer
+{
+public:
+	explicit timed_writer(result_writer& writer) : writer_(writer), format_ns_(0), localizations_(0) {}
+
+	void write(estimator_result const* results, int length)
+	{
+		uint64_t start_ns = monotonic_ns();
+		writer_.write(results, length);
+		for(int i = 0; i < length; i++) {
+			localizations_ += results[i].img >= 0;
+		}
+		format_ns_ += monotonic_ns() - start_ns;
+	}
+	void flush() {}
+	void finish()
+	{
+		uint64_t start_ns = monotonic_ns();
+		writer_.finish();
+		format_ns_ += monotonic_ns() - start_ns;
+	}
+
+	uint64_t format_ns() const { return format_ns_; }
+	uint64_t localizations() const { return localizations_; }
+
+private:
+	result_writer& writer_;
+	uint64_t format_ns_;
+	uint64_t localizations_;
+};
+
+/// Create a file for the synthetic stack
+/** @param options Options of the run, the stack is created in the output directory if one is given
+    @return Path of the empty file
+**/
+static std::string temporary_stack_path(run_options const& options)
+{
+	char const* tmpdir = getenv("TMPDIR");
+	std::string dir = !options.output_dir.empty() ? options.output_dir : tmpdir ? tmpdir : "/tmp";
+	std::vector<char> path(dir.begin(), dir.end());
+	char const suffix[] = "/spdm_bench_XXXXXX.tif";
+	path.insert(path.end(), suffix, suffix + sizeof(suffix));		// with the terminating zero
+
+	int fd = mkstemps(path.data(), 4);
+	if(fd < 0) {
+		throw std::runtime_error("mkstemps: " + dir + ": " + strerror(errno));
+	}
+	close(fd);
+	return std::string(path.data());
+}
+
+/// Convert nanoseconds to seconds
+static double seconds(uint64_t ns)
+{
+	return ns * 1e-9;
+}
+
+/// Generate a synthetic stack, process it with the host path and write throughput and latencies as JSON
+/** The stack is written to a temporary TIFF file first, so decoding is measured from the page cache.
+    Decode time is summed over the reader threads, the other stages are measured on the thread that
+    drives the engine. On the DFE, the engine time is the time of the polling loop not spent sending,
+    receiving or formatting. The latency of a frame is measured from the start of its decoding until
+    its results are formatted.
+    @param params Parameters of the synthetic stack
+    @param options Options of the run, with threads, readers, prefetch depth and output format
+    @param config The DFE configuration, null for the CPU
+    @param dfe The loaded DFE, null for the CPU
+    @param json Receives the report
+**/
+void run_benchmark(synthetic_params const& params, run_options const& options, dfe_config const* config,
+		dataflow_engine *dfe, std::ostream& json)
+{
+	synthetic_stack stack(params);
+	std::string path = temporary_stack_path(options);
+	std::cerr << "Writing synthetic stack to '" << path << "'" << std::endl;
+	uint64_t generate_start_ns = monotonic_ns();
+	{
+		tiff_container output(path, "w");
+		if(!output.good()) {
+			throw std::runtime_error("Could not create tiff file '" + path + "'");
+		}
+		stack.write(output, options.thread_count);
+	}
+	uint64_t generate_ns = monotonic_ns() - generate_start_ns;
+
+	tiff_container tiff(path, "r", false);
+	unlink(path.c_str());		// the mapping and the handle keep the file alive
+	if(!tiff.good() || tiff.total_img_count() != params.frame_count) {
+		throw std::runtime_error("Could not read back tiff file '" + path + "'");
+	}
+
+	dfe_scalars scalars = stack_scalars(params.img_width, params.img_height, params.frame_count, options);
+	scalars.nm_per_px = params.nm_per_px;
+
+	discard_buffer discarded;
+	std::ostream out(&discarded);
+	std::unique_ptr<result_writer> format_writer = result_writer::create(options.output_format, out, scalars);
+	timed_writer writer(*format_writer);
+	frame_publisher publisher(writer, params.frame_count);
+
+	size_t image_size = (size_t) params.img_width * params.img_height;
+	std::atomic<uint64_t> decode_ns(0);
+	image_reader reader = [&](int img, int16 *pixels) {
+		uint64_t start_ns = monotonic_ns();
+		publisher.set_timestamp(img, start_ns);
+		tiff_image16_ref image = tiff.image(img);
+		std::memcpy(pixels, image.data()[0], image_size * sizeof(int16));
+		decode_ns += monotonic_ns() - start_ns;
+	};
+
+	uint64_t engine_ns = 0;
+	poll_counters counters(dfe_stream_run::slot_recv_length);
+	uint64_t send_ns = 0, receive_ns = 0;
+	uint64_t start_ns = monotonic_ns();
+	{
+		image_prefetcher prefetcher(reader, image_size, params.frame_count, options.prefetch_depth, std::max(options.reader_count, 1),
+				dfe && !options.copy_slots);
+
+		if(dfe) {
+			if(scalars.img_width > config->constants().max_img_width || scalars.img_height > config->constants().max_img_height) {
+				throw std::runtime_error("scalars.img_width > config.constants().max_img_width || scalars.img_height > config.constants().max_img_height");
+			}
+			dfe->configure(scalars);
+			start_ns = monotonic_ns();		// configuring the DFE is not part of the host path
+			dfe_stream_run run(*dfe, prefetcher, scalars, options.recv_slot_count);
+			run.set_policy(options.policy, 0);
+			run.set_counters(&counters);
+
+			while(!run.finished()) {
+				int length;
+				estimator_result const* results = run.poll(length);
+				if(results) {
+					publisher.add(results, length);
+				}
+			}
+			send_ns = counters.cycles_to_ns(counters.send_cycles.value());
+			receive_ns = counters.cycles_to_ns(counters.recv_cycles.value());
+			engine_ns = monotonic_ns() - start_ns - send_ns - receive_ns - writer.format_ns();
+		} else {
+			cpu_engine engine(scalars, options.thread_count, options.fit_gaussians);
+			std::vector<estimator_result> results;
+			start_ns = monotonic_ns();
+			for(int img = 0; img < params.frame_count; img++) {
+				int16 const* pixels = prefetcher.acquire();
+				uint64_t process_start_ns = monotonic_ns();
+				engine.process(pixels, results);
+				engine_ns += monotonic_ns() - process_start_ns;
+				prefetcher.release();
+				publisher.add(results.data(), results.size());
+				publisher.complete_through(img - 1);
+				results.clear();
+			}
+		}
+		writer.finish();
+		print_prefetch_stats(prefetcher.stats());
+	}
+	uint64_t wall_ns = monotonic_ns() - start_ns;
+
+	std::vector<double> latencies(publisher.latencies_us());
+	std::sort(latencies.begin(), latencies.end());
+	double latency_sum = 0;
+	for(size_t i = 0; i < latencies.size(); i++) {
+		latency_sum += latencies[i];
+	}
+	double wall_s = seconds(wall_ns);
+
+	json << "{\n"
+		 << "  \"backend\": \"" << (dfe ? "dfe" : "cpu") << "\",\n"
+		 << "  \"revision\": \"" << SPDM_REVISION << "\",\n"
+		 << "  \"build\": \"" << __DATE__ << " " << __TIME__ << "\",\n"
+		 << "  \"stack\": {\"width\": " << params.img_width << ", \"height\": " << params.img_height
+		 << ", \"frames\": " << params.frame_count << ", \"density\": " << params.density
+		 << ", \"photons\": " << params.photons << ", \"background\": " << params.background
+		 << ", \"sigma\": " << params.psf_sigma << ", \"nm_per_px\": " << params.nm_per_px
+		 << ", \"offset\": " << params.offset << ", \"gain\": " << params.gain << ", \"read_noise\": " << params.read_noise
+		 << ", \"seed\": " << params.seed << "},\n"
+		 << "  \"options\": {\"threads\": " << (dfe ? 0 : options.thread_count) << ", \"readers\": " << std::max(options.reader_count, 1)
+		 << ", \"prefetch_depth\": " << options.prefetch_depth << ", \"copy_slots\": " << (options.copy_slots ? "true" : "false")
+		 << ", \"recv_slots\": " << options.recv_slot_count << ", \"policy\": \"" << options.policy.description() << '"'
+		 << ", \"output_format\": \"" << options.output_format << "\"},\n"
+		 << "  \"generate_s\": " << seconds(generate_ns) << ",\n"
+		 << "  \"wall_s\": " << wall_s << ",\n"
+		 << "  \"frames_per_s\": " << params.frame_count / wall_s << ",\n"
+		 << "  \"pixels_per_s\": " << image_size * params.frame_count / wall_s << ",\n"
+		 << "  \"localizations\": " << writer.localizations() << ",\n"
+		 << "  \"localizations_per_s\": " << writer.localizations() / wall_s << ",\n"
+		 << "  \"output_bytes\": " << discarded.bytes() << ",\n"
+		 << "  \"stages_s\": {\"decode\": " << seconds(decode_ns) << ", \"send\": " << seconds(send_ns)
+		 << ", \"engine\": " << seconds(engine_ns) << ", \"receive\": " << seconds(receive_ns)
+		 << ", \"format\": " << seconds(writer.format_ns()) << "},\n"
+		 << "  \"latency_us\": {\"mean\": " << (latencies.empty() ? 0 : latency_sum / latencies.size())
+		 << ", \"p50\": " << (latencies.empty() ? 0 : frame_publisher::percentile(latencies, 0.5))
+		 << ", \"p99\": " << (latencies.empty() ? 0 : frame_publisher::percentile(latencies, 0.99))
+		 << ", \"max\": " << (latencies.empty() ? 0 : latencies.back()) << "}\n"
+		 << "}" << std::endl;
+}
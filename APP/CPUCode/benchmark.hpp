@@ -0,0 +1,23 @@
+/** End-to-end benchmark of the host path on synthetic stacks
+    \file benchmark.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+
+#include <ostream>
+
+#include "synthetic_stack.hpp"
+
+
+class dfe_config;
+class dataflow_engine;
+struct run_options;
+
+void run_benchmark(synthetic_params const& params, run_options const& options, dfe_config const* config,
+		dataflow_engine *dfe, std::ostream& json);
+
+
+#endif /* BENCHMARK_HPP */
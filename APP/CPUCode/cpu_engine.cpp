@@ -0,0 +1,499 @@
+/** CPU implementation of the signal finder and signal estimator kernels
+    \file cpu_engine.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "cpu_engine.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+
+template<int radius>
+static inline void separate_signal(pixel_frac_t *roi, bool horizontal);
+
+/// Create an engine for images of the size given in the scalars
+/** @param scalars Scalar values as they would be set on the DFE
+    @param thread_count Number of threads to process each image with
+    @param fit_gaussians True to refine the signals by maximum-likelihood fits of a Gaussian
+**/
+cpu_engine::cpu_engine(dfe_scalars const& scalars, int thread_count, bool fit_gaussians)
+	: scalars_(scalars), pool_(thread_count), width_(scalars.img_width), height_(scalars.img_height), img_(0),
+	  fit_gaussians_(fit_gaussians), roi_radius_(scalars.roi_radius), estimate_signal_(select_signal_estimator(scalars.roi_radius))
+{
+	if(width_ < 2 * roi_radius_ + 1 || height_ < 2 * roi_radius_ + 1) {
+		throw std::runtime_error("cpu_engine: image smaller than the region of interest");
+	}
+	if(fit_gaussians_ && roi_radius_ != fit_roi_radius) {
+		throw std::runtime_error("cpu_engine: Gaussians are only fitted to ROIs of radius 3");
+	}
+
+	int pixel_count = width_ * height_;
+	int lookahead = width_ + 1;		// ROIs in the last row reach into the next image
+
+	background_.resize(pixel_count);
+	for(int i = 0; i < 2; i++) {
+		frames_[i].pixel_no_bg.resize(pixel_count + lookahead);
+		frames_[i].background.resize(pixel_count);
+		frames_[i].threshold.resize(pixel_count);
+		frames_[i].pixels.resize(fit_gaussians_ ? pixel_count : 0);
+		frames_[i].img = -1;
+	}
+	int center_columns = width_ - 2 * roi_radius_ + 1;		// the last ROI wraps into the next row like on the DFE
+	int center_rows = height_ - 2 * roi_radius_ + 1;
+	tile_columns_ = (center_columns + tile_width - 1) / tile_width;
+	tiles_.resize(tile_columns_ * ((center_rows + tile_height - 1) / tile_height));
+
+	update_background_ = select_background_kernel(&background_kernel_name_);
+}
+
+cpu_engine::~cpu_engine()
+{}
+
+/// Process the next image of the stack
+/** @param image The image, must have the size given in the scalars
+    @param results Results are appended here, including the end of image and last pixel indicators
+**/
+void cpu_engine::process(tiff_image16_ref const& image, std::vector<estimator_result>& results)
+{
+	if(image.height() != height_ || image.width() != width_) {
+		throw std::runtime_error("cpu_engine: image.height() != img_height || image.width() != img_width");
+	}
+	process(image.data()[0], results);
+}
+
+/// Process the next image of the stack
+/** @param pixels The pixel values of the image, row after row, with the size given in the scalars
+    @param results Results are appended here, including the end of image and last pixel indicators
+**/
+void cpu_engine::process(int16 const* pixels, std::vector<estimator_result>& results)
+{
+	if(img_ >= scalars_.total_images) {
+		throw std::runtime_error("cpu_engine: img >= total_images");
+	}
+
+	frame& current = frames_[img_ % 2];
+	current.img = img_;
+	subtract_background(pixels, current);
+
+	int pixel_count = width_ * height_;
+	int lookahead = width_ + 1;
+
+	if(img_ > 0) {
+		frame& previous = frames_[(img_ - 1) % 2];
+		std::copy(current.pixel_no_bg.begin(), current.pixel_no_bg.begin() + lookahead,
+				previous.pixel_no_bg.begin() + pixel_count);
+		find_signals(previous, false, results);
+	}
+
+	if(img_ == scalars_.total_images - 1) {
+		std::fill(current.pixel_no_bg.begin() + pixel_count, current.pixel_no_bg.end(), 0);
+		find_signals(current, true, results);
+	}
+
+	img_++;
+}
+
+/// Get the number of threads the engine uses
+int cpu_engine::thread_count() const
+{
+	return pool_.thread_count();
+}
+
+/// Get the distance of the ROI border from its center
+int cpu_engine::roi_radius() const
+{
+	return roi_radius_;
+}
+
+/// Get the ROI radius for a PSF, the ROI holds the PSF out to 2.5 standard deviations
+/** @param psf_sigma Standard deviation of the PSF in pixels
+    @return The radius, from min_roi_radius to max_roi_radius
+**/
+int cpu_engine::roi_radius_for_psf(double psf_sigma)
+{
+	return std::min(std::max((int) std::lround(2.5 * psf_sigma), (int) min_roi_radius), (int) max_roi_radius);
+}
+
+/// Get the name of the SIMD instruction set the background is updated with
+char const *cpu_engine::background_kernel_name() const
+{
+	return background_kernel_name_;
+}
+
+/// Check whether the signals are refined by maximum-likelihood fits of a Gaussian
+bool cpu_engine::fit_gaussians() const
+{
+	return fit_gaussians_;
+}
+
+// private
+/// Subtract the background from an image and update the background, see SignalFinderKernel::subtractBackground
+/** @param pixels The pixel values of the image, stored row after row
+    @param out Pixel values without background, background and threshold of the image
+**/
+void cpu_engine::subtract_background(int16 const* pixels, frame& out)
+{
+	bool first_image = img_ == 0;
+	pixel_frac_t threshold_factor = to_pixel_frac(scalars_.bg_threshold_factor);
+
+	// the update is pixel by pixel and streams whole rows through the SIMD kernel, narrower tiles gain nothing
+	pool_.parallel_for(0, height_, [&](int row) {
+		int begin = row * width_;
+
+		background_arrays arrays;
+		arrays.pixels         = pixels + begin;
+		arrays.background     = &background_[begin];
+		arrays.pixel_no_bg    = &out.pixel_no_bg[begin];
+		arrays.old_background = &out.background[begin];
+		arrays.threshold      = &out.threshold[begin];
+
+		update_background_(arrays, width_, first_image, threshold_factor);
+		if(fit_gaussians_) {		// the fits need the pixels below the background, which pixel_no_bg clamps to zero
+			std::copy(pixels + begin, pixels + begin + width_, &out.pixels[begin]);
+		}
+	});
+}
+
+/// Find and estimate all signals of an image in the order the DFE streams them
+/** @param in The image after background removal
+    @param last_image True iff the image is the last one of the stack
+    @param results Results are appended here
+**/
+void cpu_engine::find_signals(frame const& in, bool last_image, std::vector<estimator_result>& results)
+{
+	int first_row = roi_radius_;
+	int last_row = height_ - roi_radius_;
+	int end_of_image_row = height_ - roi_radius_ - 1;
+	int end_of_image_column = (width_ - 2 * roi_radius_ - 1) / tile_width;		// tile column of the end of image pixel
+
+	pool_.parallel_for(0, tiles_.size(), [&](int tile) {
+		find_signals_in_tile(in, tile, tiles_[tile]);
+	});
+
+	estimator_result indicator = estimator_result();
+	indicator.img = last_image ? last_pixel : end_of_image;
+
+	// every pixel belongs to one tile, so concatenating the rows of the tiles gives each signal once
+	for(int y = first_row; y <= last_row; y++) {
+		int tile_row = (y - first_row) / tile_height;
+		int row = (y - first_row) % tile_height;
+		for(int column = 0; column < tile_columns_; column++) {
+			tile_results const& tile = tiles_[tile_row * tile_columns_ + column];
+			std::vector<estimator_result>::const_iterator begin = tile.results.begin() + (row ? tile.row_ends[row - 1] : 0);
+			std::vector<estimator_result>::const_iterator end = tile.results.begin() + tile.row_ends[row];
+			if(y == end_of_image_row && column == end_of_image_column) {
+				results.insert(results.end(), begin, tile.results.begin() + tile.before_end_of_image);
+				results.push_back(indicator);
+				if(last_image) {
+					return;		// the DFE marks everything after the last pixel as invalid
+				}
+				begin = tile.results.begin() + tile.before_end_of_image;
+			}
+			results.insert(results.end(), begin, end);
+		}
+	}
+}
+
+/// Find and estimate the signals in one tile of an image, see SignalFinderKernel
+/** @param in The image after background removal
+    @param tile Number of the tile, row by row over the ROI centers
+    @param out The results of the tile
+**/
+void cpu_engine::find_signals_in_tile(frame const& in, int tile, tile_results& out) const
+{
+	int end_of_image_x = width_ - roi_radius_ - 1;
+	int end_of_image_y = height_ - roi_radius_ - 1;
+	bool is_past_start_image = in.img >= scalars_.start_image;
+
+	int first_x = roi_radius_ + tile % tile_columns_ * tile_width;
+	int first_y = roi_radius_ + tile / tile_columns_ * tile_height;
+	int last_x = std::min(first_x + tile_width - 1, width_ - roi_radius_);
+	int last_y = std::min(first_y + tile_height - 1, height_ - roi_radius_);
+
+	out.results.clear();
+	out.row_ends.clear();
+	out.before_end_of_image = 0;
+	out.fitter.clear();
+	out.fitted.clear();
+
+	// like on the DFE, the ROI wraps into the next row at the right border
+	for(int y = first_y; y <= last_y; y++) {
+		pixel_frac_t const* pixel_no_bg = &in.pixel_no_bg[y * width_];
+		pixel_frac_t const* threshold = &in.threshold[y * width_];
+		for(int x = first_x; x <= last_x; x++) {
+			if(x == end_of_image_x && y == end_of_image_y) {
+				out.before_end_of_image = out.results.size();		// the indicator replaces a signal at this pixel
+			} else if(is_past_start_image && pixel_no_bg[x] > threshold[x]) {
+				estimate_local_max(in, x, y, out);
+			}
+		}
+		out.row_ends.push_back(out.results.size());
+	}
+
+	if(out.fitter.size()) {
+		apply_fits(out);
+	}
+}
+
+/// Estimate the signal at a pixel above the threshold if it is a local maximum
+/** @param in The image after background removal
+    @param x Column of the pixel
+    @param y Row of the pixel
+    @param out The estimated signal is appended to the results of the tile, its ROI to the fitter if enabled
+**/
+void cpu_engine::estimate_local_max(frame const& in, int x, int y, tile_results& out) const
+{
+	int center_index = y * width_ + x;
+	pixel_frac_t const* center = &in.pixel_no_bg[center_index];
+
+	bool local_max = true;
+	for(int i = -1; i <= 1; i++) {
+		for(int j = -1; j <= 1; j++) {
+			local_max = local_max && center[i * width_ + j] <= *center;
+		}
+	}
+	if(!local_max) {
+		return;
+	}
+
+	int edge = 2 * roi_radius_ + 1;
+	pixel_frac_t roi[max_roi_size];
+	for(int i = 0; i < edge; i++) {
+		for(int j = 0; j < edge; j++) {
+			roi[i * edge + j] = center[(i - roi_radius_) * width_ + j - roi_radius_];
+		}
+	}
+
+	estimator_result result;
+	if(!estimate_signal_(roi, x, y, in.img, in.background[center_index],
+			scalars_.separator_threshold_factor, scalars_.nm_per_px, result)) {
+		return;
+	}
+
+	// ROIs at the right and bottom border wrap into the next row or image and keep the centroid estimate
+	if(fit_gaussians_ && x < width_ - roi_radius_ && y < height_ - roi_radius_) {
+		// pixels the signal separator assigns to neighbouring signals are left out of the fit
+		pixel_frac_t separated[fit_roi_size];
+		std::copy(roi, roi + fit_roi_size, separated);
+		separate_signal<fit_roi_radius>(separated, true);
+		separate_signal<fit_roi_radius>(separated, false);
+		separate_signal<fit_roi_radius>(separated, true);
+		bool excluded[fit_roi_size];
+		for(int i = 0; i < fit_roi_size; i++) {
+			excluded[i] = roi[i] != 0 && separated[i] == 0;
+		}
+
+		int corner = center_index - roi_radius_ * width_ - roi_radius_;
+		fitted_signal signal = {(int) out.results.size(), x, y};
+		out.fitter.add(&in.pixels[corner], &in.background[corner], width_, excluded);
+		out.fitted.push_back(signal);
+	}
+	out.results.push_back(result);
+}
+
+/// Fit the ROIs of the signals of a tile and replace the centroid estimates by the valid fits
+/** @param out The results of the tile
+**/
+void cpu_engine::apply_fits(tile_results& out) const
+{
+	float nm_per_px = scalars_.nm_per_px;
+
+	out.fitter.fit();
+	for(int i = 0; i < out.fitter.size(); i++) {
+		gaussian_fit fit = out.fitter.result(i);
+		if(!fit.valid) {
+			continue;
+		}
+
+		fitted_signal const& signal = out.fitted[i];
+		estimator_result& result = out.results[signal.result];
+		result.Q = fit.N;
+		result.mu_x = (fit.x + (float) signal.x - roi_radius_) * nm_per_px;
+		result.mu_y = (fit.y + (float) signal.y - roi_radius_) * nm_per_px;
+		result.sigma_x = fit.sigma_x * nm_per_px;
+		result.sigma_y = fit.sigma_y * nm_per_px;
+		result.delta_mu_x = std::sqrt(fit.crlb_x) * nm_per_px;
+		result.delta_mu_y = std::sqrt(fit.crlb_y) * nm_per_px;
+	}
+}
+
+
+/********************** signal estimator **********************************/
+
+/// Index of a pixel of a ROI on the row or column through the center of a line, see SignalSeparator
+/** @param line Number of the row or column
+    @param distance Signed distance of the pixel from the center of the line
+    @param horizontal True for a row, false for a column
+**/
+template<int radius>
+constexpr int separator_index(int line, int distance, bool horizontal)
+{
+	return horizontal ? line * (2 * radius + 1) + radius + distance : (radius + distance) * (2 * radius + 1) + line;
+}
+
+/// Remove signals in a ROI that leak into the signal at the center, see SignalSeparator
+/** Scans every row or column from the center to the border and sets all pixels to zero
+    after a local minimum. The pixels next to the center are never set to zero.
+    The loops are unrolled, so every index is a constant.
+    @param roi The ROI, modified in place
+    @param horizontal True to scan rows, false to scan columns
+**/
+template<int radius>
+static inline void separate_signal(pixel_frac_t *roi, bool horizontal)
+{
+	const int edge = 2 * radius + 1;
+
+#pragma GCC unroll 16
+	for(int line = 0; line < edge; line++) {
+#pragma GCC unroll 2
+		for(int direction = -1; direction <= 1; direction += 2) {
+			pixel_frac_t prev = roi[separator_index<radius>(line, direction, horizontal)];
+			bool crossed_minimum = false;
+#pragma GCC unroll 8
+			for(int d = 2; d <= radius; d++) {
+				pixel_frac_t& q = roi[separator_index<radius>(line, d * direction, horizontal)];
+				crossed_minimum = crossed_minimum || q > prev;		// compare unchopped values
+				prev = q;
+				if(crossed_minimum) {
+					q = 0;
+				}
+			}
+		}
+	}
+}
+
+/// Estimate position, width, intensity and error of the signal in a ROI, see SignalEstimatorKernel
+/** @param roi The pixel values of the ROI without background, row after row
+    @param x X position of the ROI center in the image
+    @param y Y position of the ROI center in the image
+    @param img Number of the image
+    @param bg Background at the ROI center
+    @param separator_threshold_factor Fraction of the intensity that must remain after signal separation
+    @param nm_per_px Size of a pixel in nanometers
+    @param result The estimated signal
+    @return True iff the signal is above the separator threshold and would be sent by the DFE
+**/
+template<int roi_radius>
+bool estimate_signal(pixel_frac_t const* roi, int x, int y, int img, pixel_frac_t bg,
+		float separator_threshold_factor, float nm_per_px, estimator_result& result)
+{
+	const int edge = 2 * roi_radius + 1;
+
+	pixel_frac_t separated[edge * edge];
+	std::copy(roi, roi + edge * edge, separated);
+	separate_signal<roi_radius>(separated, true);
+	separate_signal<roi_radius>(separated, false);
+	separate_signal<roi_radius>(separated, true);
+
+	// raw values of the accuType accumulators, wrapped to 20 bits below
+	int32_t q_acc = 0, qx_acc = 0, qy_acc = 0, qx2_acc = 0, qy2_acc = 0;
+	int32_t q_old_acc = 0, qx_old_acc = 0, qy_old_acc = 0, qx2_old_acc = 0, qy2_old_acc = 0;
+	int32_t x_old_acc = 0, y_old_acc = 0, x2_old_acc = 0, y2_old_acc = 0, n_old_acc = 0;
+
+#pragma GCC unroll 16
+	for(int py = 0; py < edge; py++) {
+#pragma GCC unroll 16
+		for(int px = 0; px < edge; px++) {
+			int32_t q = separated[py * edge + px];
+			int32_t q_old = roi[py * edge + px];
+
+			q_acc   += q;
+			qx_acc  += q * px;
+			qy_acc  += q * py;
+			qx2_acc += q * px * px;
+			qy2_acc += q * py * py;
+
+			q_old_acc   += q_old;
+			qx_old_acc  += q_old * px;
+			qy_old_acc  += q_old * py;
+			qx2_old_acc += q_old * px * px;
+			qy2_old_acc += q_old * py * py;
+
+			if(q_old != 0) {
+				x_old_acc  += px << frac_bits;
+				y_old_acc  += py << frac_bits;
+				x2_old_acc += (px * px) << frac_bits;
+				y2_old_acc += (py * py) << frac_bits;
+				n_old_acc  += 1 << frac_bits;
+			}
+		}
+	}
+
+	float Q   = fix_to_float(wrap_accu(q_acc));
+	float qx  = fix_to_float(wrap_accu(qx_acc));
+	float qy  = fix_to_float(wrap_accu(qy_acc));
+	float qx2 = fix_to_float(wrap_accu(qx2_acc));
+	float qy2 = fix_to_float(wrap_accu(qy2_acc));
+
+	float Q_old   = fix_to_float(wrap_accu(q_old_acc));
+	float qx_old  = fix_to_float(wrap_accu(qx_old_acc));
+	float qy_old  = fix_to_float(wrap_accu(qy_old_acc));
+	float qx2_old = fix_to_float(wrap_accu(qx2_old_acc));
+	float qy2_old = fix_to_float(wrap_accu(qy2_old_acc));
+
+	float x_old  = fix_to_float(wrap_accu(x_old_acc));
+	float y_old  = fix_to_float(wrap_accu(y_old_acc));
+	float x2_old = fix_to_float(wrap_accu(x2_old_acc));
+	float y2_old = fix_to_float(wrap_accu(y2_old_acc));
+	float n_old  = fix_to_float(wrap_accu(n_old_acc));
+
+	// single precision in the same order of operations as on the DFE
+	const float one_twelfth = 1.0 / 12.0;
+
+	float mu_x = qx / Q;
+	float mu_y = qy / Q;
+	float sigma_x2 = qx2 / Q - mu_x * mu_x;
+	float sigma_y2 = qy2 / Q - mu_y * mu_y;
+	sigma_x2 = sigma_x2 > one_twelfth ? sigma_x2 : one_twelfth;
+	sigma_y2 = sigma_y2 > one_twelfth ? sigma_y2 : one_twelfth;
+
+	float mu_x_old = qx_old / Q_old;
+	float mu_y_old = qy_old / Q_old;
+	float sigma_x2_old = qx2_old / Q_old - mu_x_old * mu_x_old;
+	float sigma_y2_old = qy2_old / Q_old - mu_y_old * mu_y_old;
+	sigma_x2_old = sigma_x2_old > one_twelfth ? sigma_x2_old : one_twelfth;
+	sigma_y2_old = sigma_y2_old > one_twelfth ? sigma_y2_old : one_twelfth;
+
+	float delta_pixelation2_old = one_twelfth / Q_old;
+	float bg_single = fix_to_float(bg);
+	float Q2_old = Q_old * Q_old;
+	float delta_x2 = delta_pixelation2_old + sigma_x2_old / Q_old + (x2_old - mu_x_old * (2.0f * x_old - n_old * mu_x_old)) * bg_single / Q2_old;
+	float delta_y2 = delta_pixelation2_old + sigma_y2_old / Q_old + (y2_old - mu_y_old * (2.0f * y_old - n_old * mu_y_old)) * bg_single / Q2_old;
+
+	result.img = img;
+	result.Q = Q;
+	result.mu_x = (mu_x + (float) x - roi_radius) * nm_per_px;
+	result.mu_y = (mu_y + (float) y - roi_radius) * nm_per_px;
+	result.sigma_x = std::sqrt(sigma_x2) * nm_per_px;
+	result.sigma_y = std::sqrt(sigma_y2) * nm_per_px;
+	result.delta_mu_x = std::sqrt(delta_x2) * nm_per_px;
+	result.delta_mu_y = std::sqrt(delta_y2) * nm_per_px;
+
+	return Q / Q_old > separator_threshold_factor;
+}
+
+/// Select the estimator for a ROI radius
+/** @param roi_radius Distance of the ROI border from its center, from cpu_engine::min_roi_radius to max_roi_radius
+    @return The estimator
+**/
+signal_estimator select_signal_estimator(int roi_radius)
+{
+	static_assert(cpu_engine::min_roi_radius == 2 && cpu_engine::max_roi_radius == 6, "an estimator for every radius");
+
+	switch(roi_radius) {
+	case 2:
+		return &estimate_signal<2>;
+	case 3:
+		return &estimate_signal<3>;
+	case 4:
+		return &estimate_signal<4>;
+	case 5:
+		return &estimate_signal<5>;
+	case 6:
+		return &estimate_signal<6>;
+	default:
+		throw std::runtime_error("select_signal_estimator: the ROI radius must be from 2 to 6");
+	}
+}
@@ -0,0 +1,118 @@
+/** CPU implementation of the signal finder and signal estimator kernels
+    \file cpu_engine.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef CPU_ENGINE_HPP
+#define CPU_ENGINE_HPP
+
+
+#include <vector>
+
+#include "tiff.hpp"
+#include "background_model.hpp"
+#include "fixed_point.hpp"
+#include "gaussian_fitter.hpp"
+#include "spdm_types.hpp"
+#include "thread_pool.hpp"
+
+
+/// Function that estimates the signal in a ROI, see estimate_signal
+typedef bool (*signal_estimator)(pixel_frac_t const* roi, int x, int y, int img, pixel_frac_t bg,
+		float separator_threshold_factor, float nm_per_px, estimator_result& result);
+
+/// Engine that computes the same results as the DFE on the CPU
+/** Images are processed in the order of the stack. Like on the DFE, the signals of the last rows
+    of an image are only found once the following image is available, so process() returns the
+    results of the previous image and those of the current image only for the last image of the stack.
+    The background of an image is removed row by row, then its signals are found in tiles whose pixels
+    and ROI halo fit the cache; the halo of a tile is read from the finished image of its neighbours.
+    The results of the tiles are merged row by row into the order of the DFE.
+    Optionally, the ROIs of the signals of each tile are refined by maximum-likelihood fits of a Gaussian,
+    which replace intensity, position, width and error of the centroid estimate.
+    The ROI radius is taken from the scalars; the estimator is compiled for every radius the engine supports,
+    so the loops over a ROI have constant bounds. With dfe_roi_radius the results are those of the DFE.
+**/
+class cpu_engine
+{
+public:
+	cpu_engine(dfe_scalars const& scalars, int thread_count, bool fit_gaussians = false);
+	~cpu_engine();
+	void process(tiff_image16_ref const& image, std::vector<estimator_result>& results);
+	void process(int16 const* pixels, std::vector<estimator_result>& results);
+	int thread_count() const;
+	int roi_radius() const;
+	char const *background_kernel_name() const;
+	bool fit_gaussians() const;
+
+	static int roi_radius_for_psf(double psf_sigma);
+
+	static const int min_roi_radius = 2;						///< Smallest distance of the ROI border from its center
+	static const int max_roi_radius = 6;						///< Largest distance of the ROI border from its center
+	static const int max_roi_size = (2 * max_roi_radius + 1) * (2 * max_roi_radius + 1);	///< Number of pixels in the largest ROI
+	static const int tile_width = 64;							///< Width of the tiles an image is processed in
+	static const int tile_height = 64;							///< Height of the tiles an image is processed in
+
+private:
+	cpu_engine(cpu_engine const&);		// no copying
+	cpu_engine& operator=(const cpu_engine&);
+
+	/// Output of the background removal for one image
+	struct frame
+	{
+		std::vector<pixel_frac_t> pixel_no_bg;	///< pixel values above background, followed by the first rows of the next image
+		std::vector<pixel_frac_t> background;	///< background before the update with this image
+		std::vector<pixel_frac_t> threshold;	///< signal threshold derived from the background
+		std::vector<int16> pixels;				///< input pixel values, only kept for the Gaussian fits
+		int img;								///< number of the image in the stack
+	};
+
+	/// Signal whose ROI is fitted
+	struct fitted_signal
+	{
+		int result;		///< index of the signal in the results of its tile
+		int x;			///< column of the ROI center
+		int y;			///< row of the ROI center
+	};
+
+	/// Signals found in one tile of an image
+	struct tile_results
+	{
+		std::vector<estimator_result> results;	///< estimated signals, row by row in the order of the pixels
+		std::vector<int> row_ends;				///< number of results up to the end of each row of the tile
+		int before_end_of_image;				///< number of results before the end of image indicator, if the tile holds it
+		gaussian_fitter fitter;					///< fits of the ROIs of the signals, if enabled
+		std::vector<fitted_signal> fitted;		///< signal of each ROI of the fitter
+	};
+
+	void subtract_background(int16 const* pixels, frame& out);
+	void find_signals(frame const& in, bool last_image, std::vector<estimator_result>& results);
+	void find_signals_in_tile(frame const& in, int tile, tile_results& out) const;
+	void estimate_local_max(frame const& in, int x, int y, tile_results& out) const;
+	void apply_fits(tile_results& out) const;
+
+	dfe_scalars scalars_;
+	thread_pool pool_;
+	int width_;
+	int height_;
+	int img_;
+	std::vector<pixel_frac_t> background_;
+	background_kernel update_background_;
+	char const *background_kernel_name_;
+	bool fit_gaussians_;
+	frame frames_[2];
+	int roi_radius_;
+	signal_estimator estimate_signal_;		///< estimator specialized for the ROI radius
+	int tile_columns_;						///< tiles per row of the ROI centers, which start roi_radius_ from the border
+	std::vector<tile_results> tiles_;
+};
+
+
+template<int roi_radius>
+bool estimate_signal(pixel_frac_t const* roi, int x, int y, int img, pixel_frac_t bg,
+		float separator_threshold_factor, float nm_per_px, estimator_result& result);
+
+signal_estimator select_signal_estimator(int roi_radius);
+
+
+#endif /* CPU_ENGINE_HPP */
@@ -0,0 +1,75 @@
+/** Fixed-point formats of the DFE kernels for the CPU implementation of the engine
+    \file fixed_point.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef FIXED_POINT_HPP
+#define FIXED_POINT_HPP
+
+
+#include <stdint.h>
+#include <cmath>
+
+
+/// Raw value of pixelFracValueType, a two's complement fixed-point number with 12 integer and 4 fractional bits
+typedef int16_t pixel_frac_t;
+
+/// Raw value of accuType, a two's complement fixed-point number with 16 integer and 4 fractional bits
+typedef int32_t accu_t;
+
+const int frac_bits = 4;					///< Fractional bits of pixelFracValueType and accuType
+const int accu_bits = 20;					///< Total bits of accuType
+const float frac_scale = 1 << frac_bits;	///< Value of the raw integer one in both fixed-point types
+
+
+/// Wrap a raw value to the 16 bits of pixelFracValueType, like the DFE does on overflow
+inline pixel_frac_t wrap_pixel_frac(int32_t raw)
+{
+	return (pixel_frac_t) (uint16_t) raw;
+}
+
+/// Wrap a raw value to the 20 bits of accuType, like the DFE does on overflow
+inline accu_t wrap_accu(int32_t raw)
+{
+	const int32_t sign = 1 << (accu_bits - 1);
+	return ((raw & ((1 << accu_bits) - 1)) ^ sign) - sign;
+}
+
+/// Cast a pixel value from pixelValueType to pixelFracValueType
+inline pixel_frac_t to_pixel_frac(int16_t pixel)
+{
+	return wrap_pixel_frac((uint16_t) pixel << frac_bits);
+}
+
+/// Divide by eight with the default rounding mode of the DFE, round to nearest with ties rounded up
+inline pixel_frac_t div8_pixel_frac(pixel_frac_t value)
+{
+	return (value + 4) >> 3;
+}
+
+/// Cast a single-precision float to pixelFracValueType, round to nearest with ties rounded up
+inline pixel_frac_t float_to_pixel_frac(float value)
+{
+	return wrap_pixel_frac((int32_t) std::floor(value * frac_scale + 0.5f));
+}
+
+/// Cast a raw pixelFracValueType or accuType to single precision, this is always exact
+inline float fix_to_float(int32_t raw)
+{
+	return raw / frac_scale;
+}
+
+/// Square root of a background level as computed by SignalFinderKernel::subtractBackground
+/** The square root is taken in single precision, the root of a negative background is not a number
+    and cast to zero.
+**/
+inline pixel_frac_t sqrt_pixel_frac(pixel_frac_t background)
+{
+	if(background < 0) {
+		return 0;
+	}
+	return float_to_pixel_frac(std::sqrt(fix_to_float(background)));
+}
+
+
+#endif /* FIXED_POINT_HPP */
@@ -0,0 +1,120 @@
+/** Recycled, page-aligned pixel buffers for images
+    \file frame_pool.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "frame_pool.hpp"
+
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+
+/// Round up to a multiple of the alignment
+static size_t align_up(size_t size)
+{
+	return (size + frame_pool::alignment - 1) / frame_pool::alignment * frame_pool::alignment;
+}
+
+/// Get the pool for an image size, created on first use
+/** @param height Height of the images in pixels
+    @param width Width of the images in pixels, 0 for buffers with row pointers only, for images in a file mapping
+    @return The pool
+**/
+frame_pool& frame_pool::get(int height, int width)
+{
+	static std::mutex pools_mutex;
+	static std::map<std::pair<int, int>, frame_pool*> pools;		// never deleted, images may outlive static destruction
+
+	std::lock_guard<std::mutex> lock(pools_mutex);
+	frame_pool*& pool = pools[std::make_pair(height, width)];
+	if(!pool) {
+		pool = new frame_pool(height, width);
+	}
+	return *pool;
+}
+
+/// Take a buffer with a reference count of one
+/** @return The buffer, its row pointers point into its pixels
+**/
+frame_buffer* frame_pool::acquire()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(free_.empty()) {
+		grow();
+	}
+	frame_buffer *buffer = free_.back();
+	free_.pop_back();
+	buffer->ref_count.store(1, std::memory_order_relaxed);
+	return buffer;
+}
+
+/// Return a buffer whose last reference was dropped
+/** @param buffer The buffer
+**/
+void frame_pool::recycle(frame_buffer *buffer)
+{
+	buffer->mapping.reset();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_.push_back(buffer);
+}
+
+/// Get the height of the images in pixels
+int frame_pool::height() const
+{
+	return height_;
+}
+
+/// Get the width of the images in pixels, 0 if the buffers have no pixels
+int frame_pool::width() const
+{
+	return width_;
+}
+
+// private
+frame_pool::frame_pool(int height, int width)
+	: height_(height), width_(width)
+{
+	if(height < 0 || width < 0) {
+		throw std::runtime_error("frame_pool: height < 0 || width < 0");
+	}
+	pixel_offset_ = align_up(sizeof(frame_buffer) + height * sizeof(int16*));
+	block_size_ = width ? pixel_offset_ + align_up((size_t) height * width * sizeof(int16)) : pixel_offset_;
+}
+
+frame_pool::~frame_pool()
+{
+	for(size_t i = 0; i < arenas_.size(); i++) {
+		char *arena = static_cast<char*>(arenas_[i]);
+		for(int b = 0; b < arena_length; b++) {
+			reinterpret_cast<frame_buffer*>(arena + b * block_size_)->~frame_buffer();
+		}
+		free(arena);
+	}
+}
+
+/// Allocate an arena and add its buffers to the free list, called with the mutex held
+void frame_pool::grow()
+{
+	void *memory = 0;
+	if(posix_memalign(&memory, alignment, block_size_ * arena_length) != 0) {
+		throw std::bad_alloc();
+	}
+	arenas_.push_back(memory);
+
+	char *arena = static_cast<char*>(memory);
+	for(int b = 0; b < arena_length; b++) {
+		char *block = arena + b * block_size_;
+		frame_buffer *buffer = new(block) frame_buffer;
+		buffer->pool = this;
+		buffer->rows = reinterpret_cast<int16**>(block + sizeof(frame_buffer));
+		buffer->pixels = width_ ? reinterpret_cast<int16*>(block + pixel_offset_) : 0;
+		for(int row = 0; row < height_ && buffer->pixels; row++) {
+			buffer->rows[row] = buffer->pixels + (size_t) row * width_;
+		}
+		free_.push_back(buffer);
+	}
+}
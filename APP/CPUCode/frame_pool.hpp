@@ -0,0 +1,69 @@
+/** Recycled, page-aligned pixel buffers for images
+    \file frame_pool.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef FRAME_POOL_HPP
+#define FRAME_POOL_HPP
+
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <tiffio.h>
+
+
+class frame_pool;
+
+/// Pixels of an image with their row pointers and reference count, recycled by the pool it came from
+struct frame_buffer
+{
+	std::atomic<int> ref_count;		///< number of image references to the buffer
+	frame_pool *pool;				///< pool the buffer returns to when the last reference is dropped
+	int16 **rows;					///< row pointers, into pixels or into a file mapping
+	int16 *pixels;					///< page aligned pixels of the buffer, null for buffers without pixels
+	std::shared_ptr<void> mapping;	///< file mapping the rows point into, null if they point into pixels
+};
+
+/// Buffers of one image size, allocated in arenas of several buffers and recycled
+/** Each buffer holds its control block, the row pointers and, page aligned, the pixels, so an image
+    takes no allocation once the pool has grown to the number of images alive at the same time.
+    The pixels are aligned like the buffers of the low-latency streams. Pools live until the process
+    ends; buffers can be acquired and recycled on any thread.
+**/
+class frame_pool
+{
+public:
+	static frame_pool& get(int height, int width);
+
+	frame_buffer* acquire();
+	void recycle(frame_buffer *buffer);
+
+	int height() const;
+	int width() const;
+
+	static const size_t alignment = 4096;		///< alignment of the pixels in bytes
+	static const int arena_length = 8;			///< number of buffers allocated at once
+
+private:
+	frame_pool(int height, int width);
+	~frame_pool();
+	frame_pool(frame_pool const&);		// no copying
+	frame_pool& operator=(const frame_pool&);
+
+	void grow();
+
+	int height_;
+	int width_;
+	size_t pixel_offset_;
+	size_t block_size_;
+	std::mutex mutex_;
+	std::vector<frame_buffer*> free_;
+	std::vector<void*> arenas_;
+};
+
+
+#endif /* FRAME_POOL_HPP */
@@ -0,0 +1,190 @@
+/** Statistics of the pixel values of a frame
+    \file frame_statistics.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "frame_statistics.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "pixel_arithmetic.hpp"
+#include "thread_pool.hpp"
+
+
+/// Create statistics without pixels
+frame_statistics::frame_statistics()
+	: histogram_(1 << 16, 0), count_(0), min_(32767), max_(-32768)
+{}
+
+/// Remove all pixels, for the next frame
+void frame_statistics::reset()
+{
+	if(count_) {
+		std::fill(histogram_.begin() + min_ + 32768, histogram_.begin() + max_ + 32768 + 1, 0);
+	}
+	count_ = 0;
+	min_ = 32767;
+	max_ = -32768;
+}
+
+/// Add a run of pixels
+/** @param pixels The pixel values
+    @param count Number of pixels
+**/
+void frame_statistics::add(int16 const* pixels, int count)
+{
+	pixel_kernels const& kernels = select_pixel_kernels();
+	uint32_t *bins = histogram_.data() + 32768;
+
+	for(int offset = 0; offset < count; offset += block_length) {
+		int length = std::min(block_length, count - offset);
+		int16 const* block = pixels + offset;
+
+		int16_t low = min_, high = max_;
+		kernels.min_max(block, length, low, high);
+		min_ = low;
+		max_ = high;
+
+		for(int i = 0; i < length; i++) {
+			bins[block[i]]++;
+		}
+	}
+	count_ += count;
+}
+
+/// Add all pixels of an image
+/** @param image The image
+    @param pool Threads to count bands of rows with, null to count on the calling thread
+**/
+void frame_statistics::add(tiff_image16_ref const& image, thread_pool *pool)
+{
+	int height = image.height();
+	int width = image.width();
+	int band_count = pool ? std::min(height, pool->thread_count()) : 1;
+	bool contiguous = image.contiguous();
+
+	// the first band is counted here, the others in histograms of their own
+	if(partials_.size() < (size_t) band_count - 1) {
+		partials_.resize(band_count - 1);
+	}
+	auto count_band = [&](int band) {
+		frame_statistics& statistics = band ? partials_[band - 1] : *this;
+		int first_row = (long) height * band / band_count;
+		int end_row = (long) height * (band + 1) / band_count;
+		if(contiguous) {
+			statistics.add(image.data()[first_row], (end_row - first_row) * width);
+		} else {
+			for(int row = first_row; row < end_row; row++) {
+				statistics.add(image.data()[row], width);
+			}
+		}
+	};
+
+	if(pool) {
+		pool->parallel_for(0, band_count, count_band);
+	} else {
+		count_band(0);
+	}
+	for(int band = 1; band < band_count; band++) {
+		merge(partials_[band - 1]);
+		partials_[band - 1].reset();
+	}
+}
+
+/// Add the pixels counted by other statistics
+void frame_statistics::merge(frame_statistics const& other)
+{
+	for(int value = other.min_; value <= other.max_; value++) {
+		histogram_[value + 32768] += other.histogram_[value + 32768];
+	}
+	count_ += other.count_;
+	min_ = std::min(min_, other.min_);
+	max_ = std::max(max_, other.max_);
+}
+
+/// Get the number of pixels
+int64_t frame_statistics::count() const
+{
+	return count_;
+}
+
+/// Get the smallest pixel value
+/** @return The value, 32767 without pixels
+**/
+int frame_statistics::min() const
+{
+	return min_;
+}
+
+/// Get the largest pixel value
+/** @return The value, -32768 without pixels
+**/
+int frame_statistics::max() const
+{
+	return max_;
+}
+
+/// Get the number of pixels with a value
+/** @param value The value, from -32768 to 32767
+**/
+uint32_t frame_statistics::frequency(int value) const
+{
+	return histogram_[value + 32768];
+}
+
+/// Get the sum of the pixel values
+int64_t frame_statistics::sum() const
+{
+	int64_t sum = 0;
+	for(int value = min_; value <= max_; value++) {
+		sum += (int64_t) histogram_[value + 32768] * value;
+	}
+	return sum;
+}
+
+/// Get the mean pixel value
+/** @return The mean, 0 without pixels
+**/
+double frame_statistics::mean() const
+{
+	return count_ ? (double) sum() / count_ : 0;
+}
+
+/// Get the variance of the pixel values
+/** @return The variance of the population, 0 without pixels
+**/
+double frame_statistics::variance() const
+{
+	if(!count_) {
+		return 0;
+	}
+
+	double mu = mean();
+	double sum_squares = 0;
+	for(int value = min_; value <= max_; value++) {
+		sum_squares += histogram_[value + 32768] * (value - mu) * (value - mu);
+	}
+	return sum_squares / count_;
+}
+
+/// Get the smallest pixel value that at least a fraction of the pixels do not exceed
+/** @param fraction The fraction, e.g. 0.5 for the median or 0.99 for the 99th percentile
+    @return The value, 0 without pixels
+**/
+int frame_statistics::percentile(double fraction) const
+{
+	if(!count_) {
+		return 0;
+	}
+
+	int64_t rank = std::max((int64_t) 1, (int64_t) std::ceil(std::min(1.0, std::max(0.0, fraction)) * count_));
+	int64_t cumulative = 0;
+	for(int value = min_; value < max_; value++) {
+		cumulative += histogram_[value + 32768];
+		if(cumulative >= rank) {
+			return value;
+		}
+	}
+	return max_;
+}
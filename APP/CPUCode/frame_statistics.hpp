@@ -0,0 +1,55 @@
+/** Statistics of the pixel values of a frame
+    \file frame_statistics.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef FRAME_STATISTICS_HPP
+#define FRAME_STATISTICS_HPP
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "tiff.hpp"
+
+
+class thread_pool;
+
+/// Histogram of all 65536 pixel values of a frame and the statistics derived from it
+/** The pixels are read once: every block is scanned for its smallest and largest value with SIMD while it
+    is in the L1 cache, and counted in the histogram. Sum, mean, variance and percentiles are computed from the
+    bins between the smallest and largest value, so they are exact and take no further pass over the pixels.
+    For the next frame, reset() clears only these bins. Bands counted on other threads go to histograms that
+    are kept for the next frame and cleared the same way after they are merged.
+**/
+class frame_statistics
+{
+public:
+	frame_statistics();
+
+	void reset();
+	void add(int16 const* pixels, int count);
+	void add(tiff_image16_ref const& image, thread_pool *pool = 0);
+	void merge(frame_statistics const& other);
+
+	int64_t count() const;
+	int min() const;
+	int max() const;
+	uint32_t frequency(int value) const;
+	int64_t sum() const;
+	double mean() const;
+	double variance() const;
+	int percentile(double fraction) const;
+
+	static const int block_length = 4096;	///< pixels scanned for minimum and maximum at once
+
+private:
+	std::vector<uint32_t> histogram_;		///< number of pixels of each value, at the index value + 32768
+	std::vector<frame_statistics> partials_;	///< empty statistics of the bands counted on other threads
+	int64_t count_;							///< number of pixels
+	int min_;								///< smallest value, 32767 without pixels
+	int max_;								///< largest value, -32768 without pixels
+};
+
+
+#endif /* FRAME_STATISTICS_HPP */
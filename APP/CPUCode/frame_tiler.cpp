@@ -0,0 +1,555 @@
+/** Cropping frames and splitting them into tiles that fit the engine
+    \file frame_tiler.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "frame_tiler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <MaxSLiCInterface.h>
+
+#include "SpdmCpuCode.hpp"
+#include "cpu_engine.hpp"
+#include "result_writer.hpp"
+
+/// Positions of the tiles along one axis of the frame
+struct axis_split
+{
+	int length;					///< length of every tile
+	std::vector<int> starts;	///< first pixel of each tile
+	std::vector<int> bounds;	///< owned part of tile k is [bounds[k], bounds[k + 1])
+};
+
+/// Round up to a multiple
+static int round_up(int value, int multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+/// Split one axis of a region into as few tiles of equal length as fit the engine
+/** The tiles cover the region and margin pixels around it where the frame has them, neighbouring
+    tiles overlap by at least twice the margin. A tile longer than this span takes more pixels around it.
+    @param frame_length Length of the frame
+    @param begin First pixel of the region
+    @param length Length of the region
+    @param max_length Largest length of a tile
+    @param multiple The length of a tile must be a multiple of this
+    @param margin Pixels between the owned part and the border of a tile, see tile_margin()
+    @return The tiles
+**/
+static axis_split split_axis(int frame_length, int begin, int length, int max_length, int multiple, int margin)
+{
+	max_length = max_length / multiple * multiple;
+	if(max_length < round_up(2 * margin + 2, multiple)) {
+		throw std::runtime_error("split_frame: tiles must be longer than twice the margin");
+	}
+
+	int span_begin = std::max(0, begin - margin);
+	int span = std::min(frame_length, begin + length + margin) - span_begin;
+	int count = 1;
+	int tile = round_up(span, multiple);
+	while(tile > max_length) {
+		count++;
+		tile = round_up((span + (count - 1) * 2 * margin + count - 1) / count, multiple);
+	}
+	if(tile > frame_length) {
+		throw std::runtime_error("split_frame: the frame is smaller than a tile the engine accepts");
+	}
+	if(tile > span) {
+		span_begin = std::max(0, std::min(span_begin - (tile - span) / 2, frame_length - tile));
+		span = tile;
+	}
+
+	axis_split split;
+	split.length = tile;
+	split.bounds.push_back(begin);
+	for(int k = 0; k < count; k++) {
+		split.starts.push_back(span_begin + (count > 1 ? (long) k * (span - tile) / (count - 1) : 0));
+		if(k > 0) {		// the middle of the overlap, at least a margin from the border of both tiles
+			int middle = (split.starts[k - 1] + tile + split.starts[k]) / 2;
+			split.bounds.push_back(std::max(begin, std::min(middle, begin + length)));
+		}
+	}
+	split.bounds.push_back(begin + length);
+	return split;
+}
+
+/// Parse a region of the frame given on the command line
+/** @param spec x,y,width,height
+    @return The region
+**/
+frame_window parse_frame_window(std::string const& spec)
+{
+	frame_window window;
+	char end;
+	if(sscanf(spec.c_str(), "%d,%d,%d,%d%c", &window.x, &window.y, &window.width, &window.height, &end) != 4
+			|| window.x < 0 || window.y < 0 || window.width < 1 || window.height < 1) {
+		throw std::runtime_error("Expected a region x,y,width,height, got '" + spec + "'");
+	}
+	return window;
+}
+
+/// Split a region of the frame into tiles of equal size that fit the engine
+/** @param frame_width Width of the frame
+    @param frame_height Height of the frame
+    @param region The region, localizations outside are dropped
+    @param max_width Largest width of a tile
+    @param max_height Largest height of a tile
+    @param width_multiple The width of a tile must be a multiple of this
+    @param height_multiple The height of a tile must be a multiple of this
+    @param margin Pixels between the owned part and the border of a tile, see tile_margin()
+    @return The tiles, row by row
+**/
+std::vector<frame_tile> split_frame(int frame_width, int frame_height, frame_window const& region,
+		int max_width, int max_height, int width_multiple, int height_multiple, int margin)
+{
+	if(region.x < 0 || region.y < 0 || region.width < 1 || region.height < 1
+			|| region.x + region.width > frame_width || region.y + region.height > frame_height) {
+		throw std::runtime_error("split_frame: the region is not inside the frame");
+	}
+
+	axis_split columns = split_axis(frame_width, region.x, region.width, max_width, width_multiple, margin);
+	axis_split rows = split_axis(frame_height, region.y, region.height, max_height, height_multiple, margin);
+
+	std::vector<frame_tile> tiles;
+	for(size_t r = 0; r < rows.starts.size(); r++) {
+		for(size_t c = 0; c < columns.starts.size(); c++) {
+			frame_tile tile;
+			tile.window.x = columns.starts[c];
+			tile.window.y = rows.starts[r];
+			tile.window.width = columns.length;
+			tile.window.height = rows.length;
+			tile.owned.x = columns.bounds[c];
+			tile.owned.y = rows.bounds[r];
+			tile.owned.width = columns.bounds[c + 1] - columns.bounds[c];
+			tile.owned.height = rows.bounds[r + 1] - rows.bounds[r];
+			tiles.push_back(tile);
+		}
+	}
+	return tiles;
+}
+
+/// Copy a window of a frame
+/** @param rows The rows of the frame
+    @param window The window, inside the frame
+    @param pixels Receives the pixels of the window, row after row
+**/
+void copy_window(int16 const *const *rows, frame_window const& window, int16 *pixels)
+{
+	for(int row = 0; row < window.height; row++) {
+		std::memcpy(pixels + (size_t) row * window.width, rows[window.y + row] + window.x, window.width * sizeof(int16));
+	}
+}
+
+/// Decide whether a localization of a tile is kept and move it to the coordinates of the frame
+/** @param tile The tile
+    @param nm_per_px Size of a pixel in nanometers
+    @param result The localization, in coordinates of the tile
+    @return True iff the nearest pixel of its position lies in the owned part of the tile
+**/
+bool keep_tile_result(frame_tile const& tile, float nm_per_px, estimator_result& result)
+{
+	int x = (int) std::floor(result.mu_x / nm_per_px + 0.5f) + tile.window.x;
+	int y = (int) std::floor(result.mu_y / nm_per_px + 0.5f) + tile.window.y;
+	if(x < tile.owned.x || x >= tile.owned.x + tile.owned.width || y < tile.owned.y || y >= tile.owned.y + tile.owned.height) {
+		return false;
+	}
+	result.mu_x += tile.window.x * nm_per_px;
+	result.mu_y += tile.window.y * nm_per_px;
+	return true;
+}
+
+
+/// Frames of a stack decoded once for all tiles cut from them
+/** A frame is decoded by the first tile that needs it and dropped once every tile has copied its window.
+    Tiles that run ahead wait before they take a frame more than a limit ahead of the oldest one a tile
+    still needs, so the frames held stay bounded.
+**/
+class shared_frames
+{
+public:
+	shared_frames(tiff_container& tiff, int tile_count, int max_frames);
+	void copy(int img, frame_window const& window, int16 *pixels);
+	void stop();
+
+private:
+	shared_frames(shared_frames const&);		// no copying
+	shared_frames& operator=(const shared_frames&);
+
+	/// A frame and the tiles that have not copied their window yet
+	struct frame
+	{
+		std::unique_ptr<tiff_image16_ref> image;	///< null while it is decoded
+		std::exception_ptr error;					///< the frame could not be decoded
+		int copies_left;							///< tiles that still copy their window
+	};
+
+	tiff_container& tiff_;
+	int tile_count_;
+	int max_frames_;
+	std::map<int, frame> frames_;		///< frames being decoded or copied, and copied ones newer than oldest_
+	int oldest_;						///< oldest frame that not every tile has copied
+	bool stopped_;
+	std::mutex mutex_;
+	std::condition_variable changed_;
+};
+
+/// Create the frames of a stack for tiles
+/** @param tiff The image stack
+    @param tile_count Number of tiles that copy a window of every frame
+    @param max_frames Largest distance of a frame taken from the oldest one a tile still needs
+**/
+shared_frames::shared_frames(tiff_container& tiff, int tile_count, int max_frames)
+	: tiff_(tiff), tile_count_(tile_count), max_frames_(max_frames), oldest_(0), stopped_(false)
+{}
+
+/// Copy the window of a tile from a frame, decoding the frame if no other tile has
+/** May be called from several threads, each tile calls it once for every frame.
+    @param img Number of the frame
+    @param window The window of the tile, inside the frame
+    @param pixels Receives the pixels of the window, row after row
+**/
+void shared_frames::copy(int img, frame_window const& window, int16 *pixels)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	changed_.wait(lock, [&] { return stopped_ || img < oldest_ + max_frames_; });
+	if(stopped_) {
+		throw std::runtime_error("shared_frames: stopped");
+	}
+
+	std::map<int, frame>::iterator found = frames_.find(img);
+	if(found == frames_.end()) {
+		found = frames_.insert(std::make_pair(img, frame())).first;
+		frame& decoding = found->second;
+		decoding.copies_left = tile_count_;
+		lock.unlock();
+		try {
+			std::unique_ptr<tiff_image16_ref> image(new tiff_image16_ref(tiff_.image(img)));
+			lock.lock();
+			decoding.image = std::move(image);
+		} catch(...) {
+			lock.lock();
+			decoding.error = std::current_exception();
+		}
+		changed_.notify_all();
+	} else {
+		changed_.wait(lock, [&] { return stopped_ || found->second.image || found->second.error; });
+	}
+	frame& source = found->second;
+	if(source.error) {
+		std::rethrow_exception(source.error);
+	}
+	if(stopped_) {
+		throw std::runtime_error("shared_frames: stopped");
+	}
+	if(window.x + window.width > source.image->width() || window.y + window.height > source.image->height()) {
+		throw std::runtime_error("shared_frames: the window is not inside the image");
+	}
+	lock.unlock();
+
+	copy_window(source.image->data(), window, pixels);		// the frame stays until its last copy is done
+
+	lock.lock();
+	if(--source.copies_left == 0) {
+		source.image.reset();
+		while(!frames_.empty() && frames_.begin()->first == oldest_ && frames_.begin()->second.copies_left == 0) {
+			frames_.erase(frames_.begin());
+			oldest_++;
+		}
+		changed_.notify_all();
+	}
+}
+
+/// Wake all tiles waiting for a frame and let them and later calls fail, e.g. when an engine failed
+void shared_frames::stop()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	stopped_ = true;
+	changed_.notify_all();
+}
+
+
+/// Writes the localizations of the tiles image by image, as soon as every tile has passed an image
+/** The results of a tile for an image are complete once a result or an end of image indicator of a
+    later image arrives, or the tile is done. Within an image, the localizations are written tile by tile.
+**/
+class tile_merger
+{
+public:
+	tile_merger(std::vector<frame_tile> const& tiles, float nm_per_px, int image_count, result_writer& writer);
+	void add(size_t tile, estimator_result const* results, int length);
+	void finish(size_t tile);
+
+private:
+	tile_merger(tile_merger const&);		// no copying
+	tile_merger& operator=(const tile_merger&);
+
+	/// Localizations of a tile that are not written yet
+	struct tile_output
+	{
+		std::deque<estimator_result> kept;		///< in the order of the images, in coordinates of the frame
+		int complete_through;					///< last image whose results are complete
+		int end_of_images;						///< end of image indicators received
+	};
+
+	void write_complete_locked();
+
+	std::vector<frame_tile> const& tiles_;
+	float nm_per_px_;
+	int image_count_;
+	result_writer& writer_;
+	std::vector<tile_output> outputs_;
+	std::vector<estimator_result> image_results_;
+	int next_image_;		///< first image not written yet
+	std::mutex mutex_;
+};
+
+/// Create a merger
+/** @param tiles The tiles of the frame
+    @param nm_per_px Size of a pixel in nanometers
+    @param image_count Number of images of the stack
+    @param writer Output backend for the results of the whole frame
+**/
+tile_merger::tile_merger(std::vector<frame_tile> const& tiles, float nm_per_px, int image_count, result_writer& writer)
+	: tiles_(tiles), nm_per_px_(nm_per_px), image_count_(image_count), writer_(writer), outputs_(tiles.size()), next_image_(0)
+{
+	for(size_t t = 0; t < outputs_.size(); t++) {
+		outputs_[t].complete_through = -1;
+		outputs_[t].end_of_images = 0;
+	}
+}
+
+/// Add results of the engine of a tile and write the images every tile has passed
+/** May be called from several threads.
+    @param tile Number of the tile
+    @param results Results of the engine, with indicators, in the order of the output stream
+    @param length Number of results
+**/
+void tile_merger::add(size_t tile, estimator_result const* results, int length)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	tile_output& output = outputs_[tile];
+	for(int i = 0; i < length; i++) {
+		estimator_result result = results[i];
+		if(result.img == end_of_image) {
+			output.end_of_images++;		// the indicator of image n follows all results of image n - 1
+			output.complete_through = std::max(output.complete_through, output.end_of_images - 2);
+		} else if(result.img >= 0) {
+			output.complete_through = std::max(output.complete_through, result.img - 1);
+			if(keep_tile_result(tiles_[tile], nm_per_px_, result)) {
+				output.kept.push_back(result);
+			}
+		}
+	}
+	write_complete_locked();
+}
+
+/// Mark all results of a tile as complete and write the images every tile has passed
+void tile_merger::finish(size_t tile)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	outputs_[tile].complete_through = image_count_ - 1;
+	write_complete_locked();
+}
+
+/// Write the images whose results are complete in every tile
+void tile_merger::write_complete_locked()
+{
+	int complete_through = image_count_ - 1;
+	for(size_t t = 0; t < outputs_.size(); t++) {
+		complete_through = std::min(complete_through, outputs_[t].complete_through);
+	}
+
+	for(; next_image_ <= complete_through; next_image_++) {
+		for(size_t t = 0; t < outputs_.size(); t++) {
+			std::deque<estimator_result>& kept = outputs_[t].kept;
+			for(; !kept.empty() && kept.front().img == next_image_; kept.pop_front()) {
+				image_results_.push_back(kept.front());
+			}
+		}
+		if(!image_results_.empty()) {
+			writer_.write(image_results_.data(), image_results_.size());
+			image_results_.clear();
+		}
+	}
+}
+
+
+/// Get the scalar values of the engine for a tile
+static dfe_scalars tile_scalars(dfe_scalars const& scalars, frame_tile const& tile)
+{
+	dfe_scalars tile_scalars = scalars;
+	tile_scalars.img_width = tile.window.width;
+	tile_scalars.img_height = tile.window.height;
+	return tile_scalars;
+}
+
+/// Poll the engine of a tile until it is done
+/** @param run The stream through the engine
+    @param tile Number of the tile
+    @param merger Receives the results
+    @param stop Set when any engine fails, the others then stop polling
+    @param error Receives the exception of the polling thread
+**/
+static void poll_tile(dfe_stream_run& run, size_t tile, tile_merger& merger, std::atomic<bool>& stop,
+		std::exception_ptr& error)
+{
+	try {
+		while(!run.finished() && !stop) {		// active polling, required by the low-latency interface
+			int length;
+			estimator_result const* results = run.poll(length);
+			if(results) {
+				merger.add(tile, results, length);
+			}
+		}
+		if(!stop) {
+			merger.finish(tile);
+		}
+	} catch(...) {
+		error = std::current_exception();
+		stop = true;
+	}
+}
+
+/// Process all tiles on the CPU, cutting them from each frame decoded once
+static void run_tiled_cpu(tiff_container& tiff, std::vector<frame_tile> const& tiles, dfe_scalars const& scalars,
+		run_options const& options, tile_merger& merger)
+{
+	tiff_image16_ref first = tiff.image(0);
+	int frame_width = first.width();
+	image_prefetcher prefetcher(tiff, 0, scalars.total_images, options.prefetch_depth, options.reader_count);
+
+	std::vector<std::unique_ptr<cpu_engine> > engines;
+	for(size_t t = 0; t < tiles.size(); t++) {
+		engines.push_back(std::unique_ptr<cpu_engine>(new cpu_engine(tile_scalars(scalars, tiles[t]),
+				options.thread_count, options.fit_gaussians)));
+	}
+	std::vector<int16> pixels((size_t) tiles[0].window.width * tiles[0].window.height);
+	std::vector<int16 const*> rows(first.height());
+	std::vector<estimator_result> results;
+
+	for(int img = 0; img < scalars.total_images; img++) {
+		int16 const* frame = prefetcher.acquire();
+		for(size_t row = 0; row < rows.size(); row++) {
+			rows[row] = frame + row * frame_width;
+		}
+		for(size_t t = 0; t < tiles.size(); t++) {
+			copy_window(rows.data(), tiles[t].window, pixels.data());
+			engines[t]->process(pixels.data(), results);
+			merger.add(t, results.data(), results.size());
+			results.clear();
+		}
+		prefetcher.release();
+	}
+	for(size_t t = 0; t < tiles.size(); t++) {
+		merger.finish(t);
+	}
+	print_prefetch_stats(prefetcher.stats());
+}
+
+/// Process tiles on the DFEs, one tile per engine, cutting them from each frame decoded once
+static void run_tiled_dfe(dfe_config const& config, std::vector<dataflow_engine*> const& engines, tiff_container& tiff,
+		std::vector<frame_tile> const& tiles, size_t first, size_t end, dfe_scalars const& scalars,
+		run_options const& options, tile_merger& merger)
+{
+	shared_frames frames(tiff, end - first, 2 * options.prefetch_depth);
+	std::vector<std::unique_ptr<image_prefetcher> > prefetchers;
+	try {
+		std::vector<std::unique_ptr<dfe_stream_run> > runs;
+		for(size_t t = first; t < end; t++) {
+			int k = t - first;
+			frame_window const& window = tiles[t].window;
+			dfe_scalars scalars_of_tile = tile_scalars(scalars, tiles[t]);
+			if(scalars_of_tile.img_width > config.constants().max_img_width
+					|| scalars_of_tile.img_height > config.constants().max_img_height) {
+				throw std::runtime_error("run_tiled: a tile is larger than the engine accepts");
+			}
+			image_reader reader = [&frames, window](int img, int16 *pixels) {
+				frames.copy(img, window, pixels);
+			};
+			prefetchers.push_back(std::unique_ptr<image_prefetcher>(new image_prefetcher(reader,
+					(size_t) window.width * window.height, scalars.total_images, options.prefetch_depth,
+					options.reader_count, !options.copy_slots)));
+
+			engines[k]->configure(scalars_of_tile);
+			runs.push_back(std::unique_ptr<dfe_stream_run>(new dfe_stream_run(*engines[k], *prefetchers[k],
+					scalars_of_tile, options.recv_slot_count)));
+			runs.back()->set_policy(options.policy, k);
+			if(options.instrumentation) {
+				runs.back()->set_counters(&options.instrumentation->engine(k));
+			}
+		}
+
+		std::vector<std::exception_ptr> errors(runs.size());
+		std::vector<std::thread> pollers;
+		std::atomic<bool> stop(false);
+		for(size_t k = 0; k < runs.size(); k++) {
+			pollers.push_back(std::thread(poll_tile, std::ref(*runs[k]), first + k, std::ref(merger), std::ref(stop),
+					std::ref(errors[k])));
+		}
+		for(size_t k = 0; k < pollers.size(); k++) {
+			pollers[k].join();
+		}
+		for(size_t k = 0; k < errors.size(); k++) {
+			if(errors[k]) {
+				std::rethrow_exception(errors[k]);
+			}
+		}
+	} catch(...) {
+		frames.stop();		// readers waiting for a frame would block the prefetchers from shutting down
+		throw;
+	}
+
+	for(size_t t = first; t < end; t++) {
+		std::cerr << "Tile " << t << std::endl;
+		print_prefetch_stats(prefetchers[t - first]->stats());
+	}
+}
+
+/// Process a stack tile by tile and write the results of the whole frame
+/** Each frame is decoded once and the windows of the tiles are cut from it. On the CPU all tiles are
+    processed frame by frame. On the DFEs every tile is a stack of its own streamed through an engine,
+    one tile per engine at a time, so with more tiles than engines the stack is read once for every
+    group of tiles. The localizations a tile owns are written image by image and tile by tile within an
+    image, as soon as every tile has passed the image. Positions are in the coordinates of the frame.
+    @param config The DFE configuration, null for the CPU
+    @param engines The loaded DFEs, configured here for each tile, empty for the CPU
+    @param tiff The image stack
+    @param tiles The tiles, all of the same size
+    @param scalars Scalar values for the whole frame
+    @param options Options of the run
+    @param writer Output backend for the results
+**/
+void run_tiled(dfe_config const* config, std::vector<dataflow_engine*> const& engines, tiff_container& tiff,
+		std::vector<frame_tile> const& tiles, dfe_scalars const& scalars, run_options const& options, result_writer& writer)
+{
+	for(size_t t = 0; t < tiles.size(); t++) {
+		frame_window const& window = tiles[t].window;
+		std::cerr << "Tile " << t << " window                              :  " << window.x << "," << window.y << " "
+				  << window.width << "x" << window.height << std::endl;
+	}
+
+	tile_merger merger(tiles, scalars.nm_per_px, scalars.total_images, writer);
+	if(engines.empty()) {
+		run_tiled_cpu(tiff, tiles, scalars, options, merger);
+	} else {
+		for(size_t first = 0; first < tiles.size(); first += engines.size()) {
+			run_tiled_dfe(*config, engines, tiff, tiles, first, std::min(tiles.size(), first + engines.size()), scalars,
+					options, merger);
+		}
+	}
+}
@@ -0,0 +1,61 @@
+/** Cropping frames and splitting them into tiles that fit the engine
+    \file frame_tiler.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef FRAME_TILER_HPP
+#define FRAME_TILER_HPP
+
+
+#include <string>
+#include <vector>
+
+#include "image_prefetcher.hpp"
+#include "spdm_types.hpp"
+
+
+class dfe_config;
+class dataflow_engine;
+class result_writer;
+class tiff_container;
+struct run_options;
+
+/// Rectangle of the pixels of a frame
+struct frame_window
+{
+	int x;					///< first column
+	int y;					///< first row
+	int width;				///< number of columns, 0 for the whole frame
+	int height;				///< number of rows
+};
+
+/// Part of a frame processed as a stack of its own
+/** Tiles overlap by twice tile_margin(), so every signal whose center lies in the owned part of a tile has
+    its whole ROI inside that tile, away from the border rows and columns the engine does not evaluate.
+    The owned parts partition the region, so a signal on a seam is kept from exactly one tile.
+**/
+struct frame_tile
+{
+	frame_window window;	///< pixels streamed to the engine
+	frame_window owned;		///< localizations whose nearest pixel lies here are kept
+};
+
+const int tile_width_multiple = 16;		///< the width of a tile for the DFE is a multiple, the height one of the slot length / this
+
+/// Pixels between the owned part and the border of a tile, so a ROI around a pixel a ROI away fits
+inline int tile_margin(int roi_radius)
+{
+	return 2 * roi_radius + 1;
+}
+
+frame_window parse_frame_window(std::string const& spec);
+std::vector<frame_tile> split_frame(int frame_width, int frame_height, frame_window const& region,
+		int max_width, int max_height, int width_multiple, int height_multiple, int margin);
+void copy_window(int16 const *const *rows, frame_window const& window, int16 *pixels);
+bool keep_tile_result(frame_tile const& tile, float nm_per_px, estimator_result& result);
+
+void run_tiled(dfe_config const* config, std::vector<dataflow_engine*> const& engines, tiff_container& tiff,
+		std::vector<frame_tile> const& tiles, dfe_scalars const& scalars, run_options const& options, result_writer& writer);
+
+
+#endif /* FRAME_TILER_HPP */
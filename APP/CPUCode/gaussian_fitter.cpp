@@ -0,0 +1,482 @@
+/** Maximum-likelihood fits of a 2D Gaussian to ROIs, batched for SIMD
+    \file gaussian_fitter.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "gaussian_fitter.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+
+/// Create a fitter without ROIs
+gaussian_fitter::gaussian_fitter()
+	: size_(0)
+{}
+
+/// Remove all ROIs, keeping the memory for the next ones
+void gaussian_fitter::clear()
+{
+	size_ = 0;
+}
+
+/// Add a ROI and start its fit from the centroid of the pixels above the background
+/** @param pixels First pixel of the ROI in the input pixel values, not clamped to the background
+    @param background First pixel of the ROI in the background of the pixels
+    @param stride Distance between the rows of the ROI in pixels
+    @param excluded For each pixel of the ROI, row after row, true to leave it out of the fit
+**/
+void gaussian_fitter::add(int16_t const* pixels, pixel_frac_t const* background, int stride, bool const* excluded)
+{
+	if(size_ == (int) batches_.size() * fit_batch_size) {
+		batches_.push_back(fit_batch());
+	}
+	fit_batch& batch = batches_[size_ / fit_batch_size];
+	int lane = size_ % fit_batch_size;
+
+	float sum = 0, sum_x = 0, sum_y = 0, sum_x2 = 0, sum_y2 = 0;
+	for(int row = 0; row < fit_roi_edge_length; row++) {
+		for(int col = 0; col < fit_roi_edge_length; col++) {
+			int pixel = row * stride + col;
+			int index = row * fit_roi_edge_length + col;
+			float value = std::max((float) pixels[pixel], 0.0f);		// counts are not negative
+			float bg = fix_to_float(background[pixel]);
+			float signal = excluded[index] ? 0.0f : std::max(value - bg, 0.0f);
+			batch.data[index][lane] = value;
+			batch.background[index][lane] = bg;
+			batch.weight[index][lane] = excluded[index] ? 0.0f : 1.0f;
+
+			sum    += signal;
+			sum_x  += signal * col;
+			sum_y  += signal * row;
+			sum_x2 += signal * col * col;
+			sum_y2 += signal * row * row;
+		}
+	}
+
+	float center = fit_roi_radius;
+	float x = sum > 0 ? sum_x / sum : center;
+	float y = sum > 0 ? sum_y / sum : center;
+	batch.x[lane] = x;
+	batch.y[lane] = y;
+	batch.N[lane] = std::max(sum, 1.0f);
+	batch.sigma_x[lane] = std::sqrt(std::min(std::max(sum > 0 ? sum_x2 / sum - x * x : 1, 0.25f), 4.0f));
+	batch.sigma_y[lane] = std::sqrt(std::min(std::max(sum > 0 ? sum_y2 / sum - y * y : 1, 0.25f), 4.0f));
+
+	size_++;
+}
+
+/// Fit all ROIs
+void gaussian_fitter::fit()
+{
+	static const fit_kernel kernel = select_fit_kernel();
+
+	int batch_count = (size_ + fit_batch_size - 1) / fit_batch_size;
+	if(size_ % fit_batch_size) {
+		// fill the unused lanes of the last batch with a ROI of it, so they compute only finite values
+		fit_batch& last = batches_[batch_count - 1];
+		for(int lane = size_ % fit_batch_size; lane < fit_batch_size; lane++) {
+			for(int pixel = 0; pixel < fit_roi_size; pixel++) {
+				last.data[pixel][lane] = last.data[pixel][0];
+				last.background[pixel][lane] = last.background[pixel][0];
+				last.weight[pixel][lane] = last.weight[pixel][0];
+			}
+			last.x[lane] = last.x[0];
+			last.y[lane] = last.y[0];
+			last.N[lane] = last.N[0];
+			last.sigma_x[lane] = last.sigma_x[0];
+			last.sigma_y[lane] = last.sigma_y[0];
+		}
+	}
+
+	for(int i = 0; i < batch_count; i++) {
+		kernel(batches_[i]);
+	}
+}
+
+/// Get the number of ROIs
+int gaussian_fitter::size() const
+{
+	return size_;
+}
+
+/// Get the fit of a ROI, after fit()
+/** @param index Number of the ROI in the order they were added
+**/
+gaussian_fit gaussian_fitter::result(int index) const
+{
+	fit_batch const& batch = batches_[index / fit_batch_size];
+	int lane = index % fit_batch_size;
+
+	gaussian_fit fit;
+	fit.x = batch.x[lane];
+	fit.y = batch.y[lane];
+	fit.N = batch.N[lane];
+	fit.sigma_x = batch.sigma_x[lane];
+	fit.sigma_y = batch.sigma_y[lane];
+	fit.crlb_x = batch.crlb_x[lane];
+	fit.crlb_y = batch.crlb_y[lane];
+
+	const float low = -0.5f, high = fit_roi_edge_length - 0.5f;
+	fit.valid = fit.x >= low && fit.x <= high && fit.y >= low && fit.y <= high && fit.N > 0
+			&& std::isfinite(fit.sigma_x) && std::isfinite(fit.sigma_y)
+			&& fit.crlb_x > 0 && fit.crlb_y > 0 && std::isfinite(fit.crlb_x) && std::isfinite(fit.crlb_y);
+	return fit;
+}
+
+/// Get the name of the SIMD instruction set the ROIs are fitted with
+char const *gaussian_fitter::kernel_name()
+{
+	char const *name;
+	select_fit_kernel(&name);
+	return name;
+}
+
+
+/********************** fit kernels **********************************/
+
+// The kernels are written once with the vector extensions of GCC, one vector holds a parameter or pixel of
+// every ROI of a batch. Each kernel compiles the same code for its instruction set, without fused multiply-add,
+// so all kernels compute the same bits. Exponential, logarithm and error function are polynomial
+// approximations in single precision that vectorize, std::exp and friends do not.
+
+typedef float float8 __attribute__((vector_size(fit_batch_size * sizeof(float))));
+typedef int32_t int8v __attribute__((vector_size(fit_batch_size * sizeof(int32_t))));
+
+const int fit_parameters = 5;		///< x, y, N, sigma_x, sigma_y
+
+// The helpers return vectors through references: GCC warns that a vector return value without AVX changes the
+// ABI, and it does so at the end of the file, out of reach of a diagnostic pragma.
+#define FIT_INLINE static inline __attribute__((always_inline))
+
+FIT_INLINE void load8(float8& vector, float const* values)
+{
+	std::memcpy(&vector, values, sizeof(vector));
+}
+
+FIT_INLINE void store8(float *values, float8 const& vector)
+{
+	std::memcpy(values, &vector, sizeof(vector));
+}
+
+FIT_INLINE void broadcast8(float8& vector, float value)
+{
+	float8 zero = {};
+	vector = zero + value;
+}
+
+/// Limit every lane to [low, high], not a number becomes low
+FIT_INLINE void clamp8(float8& vector, float low, float high)
+{
+	vector = vector > low ? vector : low;
+	vector = vector < high ? vector : high;
+}
+
+/// e^x for x > -87, with a relative error of about 2e-7
+FIT_INLINE void exp8(float8 const& power, float8& result)
+{
+	float8 x = power > -87.0f ? power : -87.0f;
+	float8 t = x * 1.44269504f + 0.5f;
+	int8v n = __builtin_convertvector(t, int8v);
+	n += __builtin_convertvector(n, float8) > t;		// floor, true is -1
+	float8 nf = __builtin_convertvector(n, float8);
+	float8 r = x - nf * 0.693359375f + nf * 2.12194440e-4f;
+
+	float8 p = r * 1.9875691500e-4f + 1.3981999507e-3f;
+	p = p * r + 8.3334519073e-3f;
+	p = p * r + 4.1665795894e-2f;
+	p = p * r + 1.6666665459e-1f;
+	p = p * r + 5.0000001201e-1f;
+	p = p * r * r + r + 1.0f;
+
+	int8v scale = (n + 127) << 23;
+	result = p * (float8) scale;
+}
+
+/// Natural logarithm for x > 0, with an absolute error of about 1e-7
+FIT_INLINE void log8(float8 const& x, float8& result)
+{
+	int8v bits = (int8v) x;
+	int8v exponent = (bits >> 23) - 127;
+	float8 m = (float8) ((bits & 0x7fffff) | 0x3f800000);		// in [1, 2)
+	int8v large = m > 1.41421356f;
+	m = large ? m * 0.5f : m;
+	exponent -= large;		// true is -1
+
+	float8 t = (m - 1.0f) / (m + 1.0f);
+	float8 t2 = t * t;
+	float8 p = t2 * (1.0f / 9.0f) + 1.0f / 7.0f;
+	p = p * t2 + 1.0f / 5.0f;
+	p = p * t2 + 1.0f / 3.0f;
+	p = p * t2 + 1.0f;
+	result = __builtin_convertvector(exponent, float8) * 0.693147181f + 2.0f * t * p;
+}
+
+/// Error function of z, given e^(-z^2), with an absolute error of about 1.5e-7 (Abramowitz and Stegun 7.1.26)
+FIT_INLINE void erf8(float8 const& z, float8 const& gauss, float8& result)
+{
+	float8 a = z > -z ? z : -z;
+	float8 t = 1.0f / (a * 0.3275911f + 1.0f);
+	float8 p = t * 1.061405429f - 1.453152027f;
+	p = p * t + 1.421413741f;
+	p = p * t - 0.284496736f;
+	p = p * t + 0.254829592f;
+	result = 1.0f - p * t * gauss;
+	result = z < 0 ? -result : result;
+}
+
+/// Integrals of a 1D Gaussian over the pixels of a ROI and their derivatives
+/** @param center Center of the Gaussian, 0 is the center of the first pixel
+    @param sigma Standard deviation
+    @param integral Integral of the normalized Gaussian over each pixel
+    @param d_center Derivative of the integral by the center
+    @param d_sigma Derivative of the integral by the standard deviation
+**/
+FIT_INLINE void pixel_integrals(float8 const& center, float8 const& sigma, float8 *integral, float8 *d_center, float8 *d_sigma)
+{
+	float8 scale = 0.707106781f / sigma;
+	float8 norm = 0.398942280f / sigma;
+
+	float8 prev_erf = {}, prev_gauss = {}, prev_ug = {};
+	for(int border = 0; border <= fit_roi_edge_length; border++) {
+		float8 u = (border - 0.5f) - center;
+		float8 z = u * scale;
+		float8 gauss, erf;
+		exp8(-z * z, gauss);
+		erf8(z, gauss, erf);
+		float8 ug = u * gauss;
+		if(border > 0) {
+			integral[border - 1] = 0.5f * (erf - prev_erf);
+			d_center[border - 1] = norm * (prev_gauss - gauss);
+			d_sigma[border - 1] = norm / sigma * (prev_ug - ug);
+		}
+		prev_erf = erf;
+		prev_gauss = gauss;
+		prev_ug = ug;
+	}
+}
+
+/// Log-likelihood, its gradient and the Fisher information of the parameters of a batch
+/** @param batch The ROIs
+    @param param x, y, N, sigma_x and sigma_y
+    @param likelihood Poisson log-likelihood of the pixel values in the fit, without the terms of the factorials
+    @param gradient Gradient of the log-likelihood
+    @param fisher Fisher information matrix
+**/
+FIT_INLINE void evaluate(fit_batch const& batch, float8 const* param, float8& likelihood,
+		float8 *gradient, float8 (*fisher)[fit_parameters])
+{
+	const int edge = fit_roi_edge_length;
+
+	float8 ex[edge], dex_dx[edge], dex_ds[edge];
+	float8 ey[edge], dey_dy[edge], dey_ds[edge];
+	pixel_integrals(param[0], param[3], ex, dex_dx, dex_ds);
+	pixel_integrals(param[1], param[4], ey, dey_dy, dey_ds);
+
+	float8 N = param[2];
+	for(int i = 0; i < edge; i++) {
+		dex_dx[i] *= N;
+		dex_ds[i] *= N;
+	}
+
+	broadcast8(likelihood, 0);
+	for(int a = 0; a < fit_parameters; a++) {
+		broadcast8(gradient[a], 0);
+		for(int b = 0; b <= a; b++) {
+			broadcast8(fisher[a][b], 0);
+		}
+	}
+
+	for(int row = 0; row < edge; row++) {
+		for(int col = 0; col < edge; col++) {
+			float8 data, bg, w;
+			load8(data, batch.data[row * edge + col]);
+			load8(bg, batch.background[row * edge + col]);
+			load8(w, batch.weight[row * edge + col]);
+
+			float8 shape = ex[col] * ey[row];
+			float8 lambda = bg + N * shape;
+			lambda = lambda > 1e-6f ? lambda : 1e-6f;
+			float8 log_lambda;
+			log8(lambda, log_lambda);
+			float8 derivative[fit_parameters] = {
+				dex_dx[col] * ey[row], ex[col] * N * dey_dy[row], shape, dex_ds[col] * ey[row], ex[col] * N * dey_ds[row]
+			};
+
+			float8 inverse = w / lambda;
+			float8 weight = data * inverse - w;
+			likelihood += w * (data * log_lambda - lambda);
+			for(int a = 0; a < fit_parameters; a++) {
+				gradient[a] += weight * derivative[a];
+				float8 scaled = derivative[a] * inverse;
+				for(int b = 0; b <= a; b++) {
+					fisher[a][b] += scaled * derivative[b];
+				}
+			}
+		}
+	}
+
+	for(int a = 0; a < fit_parameters; a++) {
+		for(int b = a + 1; b < fit_parameters; b++) {
+			fisher[a][b] = fisher[b][a];
+		}
+	}
+}
+
+/// Solve a symmetric positive definite system in every lane by LDL^T decomposition
+/** @param matrix The matrix
+    @param rhs The right-hand side
+    @param solution The solution, not finite if the matrix is singular
+**/
+FIT_INLINE void solve(float8 const (*matrix)[fit_parameters], float8 const* rhs, float8 *solution)
+{
+	const int n = fit_parameters;
+	float8 lower[n][n], diagonal[n];
+
+	for(int j = 0; j < n; j++) {
+		float8 d = matrix[j][j];
+		for(int k = 0; k < j; k++) {
+			d -= lower[j][k] * lower[j][k] * diagonal[k];
+		}
+		diagonal[j] = d;
+		for(int i = j + 1; i < n; i++) {
+			float8 l = matrix[i][j];
+			for(int k = 0; k < j; k++) {
+				l -= lower[i][k] * lower[j][k] * diagonal[k];
+			}
+			lower[i][j] = l / d;
+		}
+	}
+
+	for(int i = 0; i < n; i++) {
+		float8 z = rhs[i];
+		for(int k = 0; k < i; k++) {
+			z -= lower[i][k] * solution[k];
+		}
+		solution[i] = z;
+	}
+	for(int i = 0; i < n; i++) {
+		solution[i] /= diagonal[i];
+	}
+	for(int i = n - 1; i >= 0; i--) {
+		for(int k = i + 1; k < n; k++) {
+			solution[i] -= lower[k][i] * solution[k];
+		}
+	}
+}
+
+/// Fit all ROIs of a batch, see gaussian_fitter
+FIT_INLINE void fit_batch_lanes(fit_batch& batch)
+{
+	const int n = fit_parameters;
+	const float low[n] = {-1.0f, -1.0f, 1.0f, 0.3f, 0.3f};
+	const float high[n] = {fit_roi_edge_length, fit_roi_edge_length, 1e7f, fit_roi_edge_length, fit_roi_edge_length};
+
+	float8 param[n], best[n], best_gradient[n], best_fisher[n][n], best_likelihood, damping;
+	load8(param[0], batch.x);
+	load8(param[1], batch.y);
+	load8(param[2], batch.N);
+	load8(param[3], batch.sigma_x);
+	load8(param[4], batch.sigma_y);
+	broadcast8(best_likelihood, -INFINITY);
+	broadcast8(damping, 0.1f);
+	for(int a = 0; a < n; a++) {
+		best[a] = param[a];
+		broadcast8(best_gradient[a], 0);
+		for(int b = 0; b < n; b++) {
+			broadcast8(best_fisher[a][b], 0);
+		}
+	}
+
+	for(int iteration = 0; ; iteration++) {
+		float8 likelihood, gradient[n], fisher[n][n];
+		evaluate(batch, param, likelihood, gradient, fisher);
+
+		// not a number is never accepted
+		int8v accept = likelihood > best_likelihood;
+		best_likelihood = accept ? likelihood : best_likelihood;
+		for(int a = 0; a < n; a++) {
+			best[a] = accept ? param[a] : best[a];
+			best_gradient[a] = accept ? gradient[a] : best_gradient[a];
+			for(int b = 0; b < n; b++) {
+				best_fisher[a][b] = accept ? fisher[a][b] : best_fisher[a][b];
+			}
+		}
+		damping = accept ? damping * 0.1f : damping * 10.0f;
+		clamp8(damping, 1e-6f, 1e6f);
+
+		if(iteration == gaussian_fitter::iterations) {
+			break;
+		}
+
+		float8 damped[n][n], step[n];
+		for(int a = 0; a < n; a++) {
+			for(int b = 0; b < n; b++) {
+				damped[a][b] = best_fisher[a][b];
+			}
+			damped[a][a] += damping * best_fisher[a][a];
+		}
+		solve(damped, best_gradient, step);
+		for(int a = 0; a < n; a++) {
+			param[a] = best[a] + step[a];
+			clamp8(param[a], low[a], high[a]);
+		}
+	}
+
+	// the inverse of the Fisher information bounds the covariance of the parameters
+	float8 unit_x[n] = {}, unit_y[n] = {}, column_x[n], column_y[n];
+	broadcast8(unit_x[0], 1);
+	broadcast8(unit_y[1], 1);
+	solve(best_fisher, unit_x, column_x);
+	solve(best_fisher, unit_y, column_y);
+
+	store8(batch.x, best[0]);
+	store8(batch.y, best[1]);
+	store8(batch.N, best[2]);
+	store8(batch.sigma_x, best[3]);
+	store8(batch.sigma_y, best[4]);
+	store8(batch.crlb_x, column_x[0]);
+	store8(batch.crlb_y, column_y[1]);
+}
+
+/// Fit all ROIs of a batch with the instructions every processor of the architecture supports
+void fit_gaussians_generic(fit_batch& batch)
+{
+	fit_batch_lanes(batch);
+}
+
+#ifdef __x86_64__
+
+/// Fit all ROIs of a batch with AVX2
+__attribute__((target("avx2")))
+void fit_gaussians_avx2(fit_batch& batch)
+{
+	fit_batch_lanes(batch);
+}
+
+#endif
+
+
+/// Select the fastest fit kernel the processor supports
+/** @param name Set to the name of the selected kernel if not null
+    @return The kernel
+**/
+fit_kernel select_fit_kernel(char const **name)
+{
+	fit_kernel kernel = &fit_gaussians_generic;
+	char const *kernel_name = "generic";
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		kernel = &fit_gaussians_avx2;
+		kernel_name = "avx2";
+	}
+#endif
+
+	if(name) {
+		*name = kernel_name;
+	}
+	return kernel;
+}
@@ -0,0 +1,86 @@
+/** Maximum-likelihood fits of a 2D Gaussian to ROIs, batched for SIMD
+    \file gaussian_fitter.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef GAUSSIAN_FITTER_HPP
+#define GAUSSIAN_FITTER_HPP
+
+
+#include <vector>
+
+#include "fixed_point.hpp"
+
+
+/// Gaussian fitted to a ROI, in pixels relative to the ROI
+struct gaussian_fit
+{
+	float x;			///< column of the center, 0 is the center of the first column
+	float y;			///< row of the center, 0 is the center of the first row
+	float N;			///< total intensity of the signal above the background
+	float sigma_x;		///< standard deviation in x direction
+	float sigma_y;		///< standard deviation in y direction
+	float crlb_x;		///< Cramér-Rao lower bound of the variance of x
+	float crlb_y;		///< Cramér-Rao lower bound of the variance of y
+	bool valid;			///< false if the fit has no finite result or its center left the ROI
+};
+
+const int fit_roi_radius = 3;										///< Distance of the border of a fitted ROI from its center
+const int fit_roi_edge_length = 2 * fit_roi_radius + 1;				///< Edge length of a fitted ROI in pixels
+const int fit_roi_size = fit_roi_edge_length * fit_roi_edge_length;	///< Number of pixels in a fitted ROI
+const int fit_batch_size = 8;										///< ROIs fitted at once, one per SIMD lane
+
+/// ROIs fitted at once, as a structure of arrays: the same pixel or parameter of all ROIs is contiguous
+struct fit_batch
+{
+	float data[fit_roi_size][fit_batch_size];		///< pixel values including the background
+	float background[fit_roi_size][fit_batch_size];	///< expected background of each pixel
+	float weight[fit_roi_size][fit_batch_size];		///< 1 for the pixels in the fit, 0 for excluded ones
+	float x[fit_batch_size];						///< center, from the centroid before the fit
+	float y[fit_batch_size];
+	float N[fit_batch_size];						///< intensity above the background
+	float sigma_x[fit_batch_size];					///< standard deviations
+	float sigma_y[fit_batch_size];
+	float crlb_x[fit_batch_size];					///< variance bounds of the center after the fit
+	float crlb_y[fit_batch_size];
+};
+
+/// Function that fits all ROIs of a batch in place
+typedef void (*fit_kernel)(fit_batch& batch);
+
+/// Levenberg-Marquardt fits of a pixelated 2D Gaussian with Poisson noise on the background of the signal finder
+/** The model of a pixel is its background plus N times the integral of an elliptic Gaussian over the pixel.
+    The fits maximize the Poisson likelihood of the pixel values in a fixed number of iterations, starting
+    from the centroid, and damp every step with the Fisher information, which also gives the Cramér-Rao bounds.
+    Pixels of a ROI that belong to neighbouring signals are excluded from the likelihood.
+    All lanes of a batch iterate together and accept or reject their steps independently.
+**/
+class gaussian_fitter
+{
+public:
+	gaussian_fitter();
+
+	void clear();
+	void add(int16_t const* pixels, pixel_frac_t const* background, int stride, bool const* excluded);
+	void fit();
+	int size() const;
+	gaussian_fit result(int index) const;
+
+	static char const *kernel_name();
+
+	static const int iterations = 10;	///< Levenberg-Marquardt steps of every fit
+
+private:
+	std::vector<fit_batch> batches_;
+	int size_;
+};
+
+void fit_gaussians_generic(fit_batch& batch);
+#ifdef __x86_64__
+void fit_gaussians_avx2(fit_batch& batch);
+#endif
+
+fit_kernel select_fit_kernel(char const **name = 0);
+
+
+#endif /* GAUSSIAN_FITTER_HPP */
@@ -0,0 +1,292 @@
+/** Reading images of a stack ahead on separate threads
+    \file image_prefetcher.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "image_prefetcher.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/mman.h>
+
+#include "poll_policy.hpp"
+
+
+const int image_prefetcher::alignment = 4096;
+
+/// Make a reader that decodes or copies images of a stack straight into the buffers, e.g. lent DFE slots
+/** @param tiff The image stack
+    @param first_image Image of the stack that is read for image 0 of the range
+    @param height Height every image must have
+    @param width Width every image must have
+**/
+static image_reader tiff_reader(tiff_container& tiff, int first_image, int height, int width)
+{
+	return [&tiff, first_image, height, width](int img, int16 *pixels) {
+		tiff.read_image(first_image + img, pixels, height, width);
+	};
+}
+
+/// Allocate the buffers and start reading a range of a stack
+/** @param tiff The image stack, all images must have the size of the first one
+    @param first_image First image to read
+    @param image_count Number of images to read
+    @param depth Number of buffers, the readers are at most this many images ahead of the consumer
+    @param reader_count Number of reader threads
+    @param lent_buffers Read into buffers lent by the consumer instead of allocating them
+**/
+image_prefetcher::image_prefetcher(tiff_container& tiff, int first_image, int image_count, int depth, int reader_count,
+		bool lent_buffers)
+	: image_prefetcher(tiff, first_image, tiff.image(first_image), image_count, depth, reader_count, lent_buffers)
+{}
+
+/// Allocate the buffers and start reading a range of a stack, see above
+/** @param first The first image of the range, read once for the size all images must have
+**/
+image_prefetcher::image_prefetcher(tiff_container& tiff, int first_image, tiff_image16_ref const& first,
+		int image_count, int depth, int reader_count, bool lent_buffers)
+	: image_prefetcher(tiff_reader(tiff, first_image, first.height(), first.width()),
+			(size_t) first.height() * first.width(), image_count, depth, reader_count, lent_buffers)
+{}
+
+/// Allocate the buffers and start reading with a reader function
+/** @param reader Function that reads an image, called on the reader threads
+    @param image_size Number of pixels of an image
+    @param image_count Number of images to read
+    @param depth Number of buffers, the readers are at most this many images ahead of the consumer
+    @param reader_count Number of reader threads
+    @param lent_buffers Read into buffers lent by the consumer instead of allocating them
+**/
+image_prefetcher::image_prefetcher(image_reader const& reader, size_t image_size, int image_count, int depth, int reader_count,
+		bool lent_buffers)
+	: reader_(reader), image_count_(image_count), image_size_(image_size), next_to_read_(0), next_to_consume_(0),
+	  next_to_lend_(0), lent_buffers_(lent_buffers), ready_count_(0), acquired_(false), shutdown_(false), ready_word_(0)
+{
+	if(depth < 1 || reader_count < 1) {
+		throw std::runtime_error("image_prefetcher: depth < 1 || reader_count < 1");
+	}
+
+	std::memset(&stats_, 0, sizeof(stats_));
+
+	slots_.resize(depth);
+	for(int i = 0; i < depth; i++) {
+		slots_[i].state = slot_free;
+		slots_[i].img = -1;
+		slots_[i].pixels = 0;
+		if(lent_buffers_) {
+			continue;
+		}
+
+		void *buffer = 0;
+		int ret = posix_memalign(&buffer, alignment, image_size_ * sizeof(int16));
+		if(ret) {
+			for(int j = 0; j < i; j++) {
+				free(slots_[j].pixels);
+			}
+			throw std::runtime_error(std::string("posix_memalign: ") + strerror(ret));
+		}
+		mlock(buffer, image_size_ * sizeof(int16));		// keep the buffers resident if the limits allow it
+
+		slots_[i].pixels = static_cast<int16*>(buffer);
+	}
+
+	for(int i = 0; i < reader_count; i++) {
+		readers_.push_back(std::thread(&image_prefetcher::read_images, this));
+	}
+}
+
+/// Stop the readers and free the buffers
+image_prefetcher::~image_prefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		shutdown_ = true;
+	}
+	slot_freed_.notify_all();
+
+	for(size_t i = 0; i < readers_.size(); i++) {
+		readers_[i].join();
+	}
+
+	for(size_t i = 0; i < slots_.size() && !lent_buffers_; i++) {
+		munlock(slots_[i].pixels, image_size_ * sizeof(int16));
+		free(slots_[i].pixels);
+	}
+}
+
+/// Take the next image of the range if it has already been read
+/** Does not block, for use in a polling loop.
+    @return The pixel values of the image, row after row, or null if the image is not read yet.
+            The pointer is valid until release() is called.
+**/
+int16 const* image_prefetcher::try_acquire()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(error_) {
+		std::rethrow_exception(error_);
+	}
+
+	slot& next = slots_[next_to_consume_ % slots_.size()];
+	if(next.state != slot_ready || next.img != next_to_consume_) {
+		stats_.consumer_stalls++;
+		return 0;
+	}
+	return take_locked();
+}
+
+/// Take the next image of the range, wait until it has been read
+/** @return The pixel values of the image, row after row, valid until release() is called
+**/
+int16 const* image_prefetcher::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	slot& next = slots_[next_to_consume_ % slots_.size()];
+	if(!error_ && (next.state != slot_ready || next.img != next_to_consume_)) {
+		stats_.consumer_stalls++;
+		slot_ready_.wait(lock, [&] { return error_ || (next.state == slot_ready && next.img == next_to_consume_); });
+	}
+	if(error_) {
+		std::rethrow_exception(error_);
+	}
+	return take_locked();
+}
+
+/// Hand the buffer of the acquired image back to the readers, or to the consumer if it was lent
+void image_prefetcher::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(!acquired_) {
+			throw std::runtime_error("image_prefetcher: release() without acquire()");
+		}
+		slots_[next_to_consume_ % slots_.size()].state = slot_free;
+		next_to_consume_++;
+		acquired_ = false;
+		stats_.images_consumed++;
+	}
+	slot_freed_.notify_all();
+}
+
+/// Lend a buffer for the next image that has none
+/** At most depth() buffers can be lent ahead of the consumer.
+    @param pixels Buffer for image_size pixels, owned by the prefetcher until the image is released
+**/
+void image_prefetcher::lend(int16 *pixels)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(!lent_buffers_) {
+			throw std::runtime_error("image_prefetcher: lend() with own buffers");
+		}
+		if(next_to_lend_ - next_to_consume_ >= (int) slots_.size()) {
+			throw std::runtime_error("image_prefetcher: more than depth() buffers lent");
+		}
+		slots_[next_to_lend_ % slots_.size()].pixels = pixels;
+		next_to_lend_++;
+	}
+	slot_freed_.notify_all();
+}
+
+/// Get a snapshot of the counters
+prefetch_stats image_prefetcher::stats()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+/// Get the number of buffers
+int image_prefetcher::depth() const
+{
+	return slots_.size();
+}
+
+/// Check whether the images are read into buffers lent by the consumer
+bool image_prefetcher::lent_buffers() const
+{
+	return lent_buffers_;
+}
+
+/// Get the futex word a polling consumer can sleep on until the next image is ready
+std::atomic<uint32_t>& image_prefetcher::ready_word()
+{
+	return ready_word_;
+}
+
+// private
+/// Reader thread: claim the next image, wait until its buffer is free and read the image into it
+void image_prefetcher::read_images()
+{
+	int depth = slots_.size();
+
+	while(true) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		if(shutdown_ || error_ || next_to_read_ >= image_count_) {
+			return;
+		}
+
+		int img = next_to_read_++;
+		slot& target = slots_[img % depth];
+		if(img >= readable_locked()) {		// the image that used the buffer before has not been released yet
+			stats_.reader_stalls++;
+			slot_freed_.wait(lock, [&] { return shutdown_ || img < readable_locked(); });
+			if(shutdown_) {
+				return;
+			}
+		}
+		target.state = slot_reading;
+		target.img = img;
+		lock.unlock();
+
+		try {
+			reader_(img, target.pixels);
+		} catch(...) {
+			lock.lock();
+			if(!error_) {
+				error_ = std::current_exception();
+			}
+			lock.unlock();
+			slot_ready_.notify_all();
+			ready_word_++;
+			futex_wake_all(ready_word_);
+			return;
+		}
+
+		lock.lock();
+		target.state = slot_ready;
+		ready_count_++;
+		if(ready_count_ > stats_.max_depth) {
+			stats_.max_depth = ready_count_;
+		}
+		stats_.images_read++;
+		lock.unlock();
+		slot_ready_.notify_all();
+		ready_word_++;
+		futex_wake_all(ready_word_);
+	}
+}
+
+/// Mark the next image as acquired, the mutex must be held
+int16 const* image_prefetcher::take_locked()
+{
+	if(acquired_) {
+		throw std::runtime_error("image_prefetcher: acquire() without release()");
+	}
+	if(next_to_consume_ >= image_count_) {
+		throw std::runtime_error("image_prefetcher: all images have been consumed");
+	}
+
+	stats_.depth_sum += ready_count_;
+	ready_count_--;
+	acquired_ = true;
+	return slots_[next_to_consume_ % slots_.size()].pixels;
+}
+
+/// Get the first image that has no buffer to be read into yet, the mutex must be held
+int image_prefetcher::readable_locked() const
+{
+	return lent_buffers_ ? next_to_lend_ : next_to_consume_ + (int) slots_.size();
+}
@@ -0,0 +1,108 @@
+/** Reading images of a stack ahead on separate threads
+    \file image_prefetcher.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef IMAGE_PREFETCHER_HPP
+#define IMAGE_PREFETCHER_HPP
+
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "tiff.hpp"
+
+
+/// Counters of an image prefetcher
+struct prefetch_stats
+{
+	long images_read;			///< images copied into a buffer by the readers
+	long images_consumed;		///< images released by the consumer
+	long consumer_stalls;		///< polls of the consumer that found the next image not read yet, high if I/O-bound
+	long reader_stalls;			///< times a reader waited for a free buffer, high if engine-bound
+	long depth_sum;				///< sum of the number of ready images, sampled whenever the consumer takes an image
+	int max_depth;				///< maximum number of ready images
+};
+
+/// Function that reads an image into a buffer, called with the number of the image in the range
+typedef std::function<void(int img, int16 *pixels)> image_reader;
+
+/// Ring of image buffers that reader threads fill in advance for a consumer that takes the images in order
+/** The buffers are page aligned and locked in memory if the process is allowed to. The readers run in
+    parallel: the tiff container gives each one its own libtiff handle to decode with, or copies uncompressed
+    images from its memory map, straight into the buffer. With a single reader thread, the images are read in order.
+
+    With lent buffers, the prefetcher allocates none. The consumer lends a buffer for every image with
+    lend() and gets it back with release(), e.g. the slots of a low-latency stream, which the images
+    are then read into directly. The readers wait for a buffer as they would wait for a free one.
+**/
+class image_prefetcher
+{
+public:
+	image_prefetcher(tiff_container& tiff, int first_image, int image_count, int depth, int reader_count,
+			bool lent_buffers = false);
+	image_prefetcher(image_reader const& reader, size_t image_size, int image_count, int depth, int reader_count,
+			bool lent_buffers = false);
+	~image_prefetcher();
+
+	int16 const* try_acquire();
+	int16 const* acquire();
+	void release();
+	void lend(int16 *pixels);
+
+	prefetch_stats stats();
+	int depth() const;
+	bool lent_buffers() const;
+	std::atomic<uint32_t>& ready_word();
+
+	static const int alignment;
+
+private:
+	image_prefetcher(image_prefetcher const&);		// no copying
+	image_prefetcher& operator=(const image_prefetcher&);
+	image_prefetcher(tiff_container& tiff, int first_image, tiff_image16_ref const& first, int image_count, int depth,
+			int reader_count, bool lent_buffers);
+
+	/// State of a buffer in the ring
+	enum slot_state { slot_free, slot_reading, slot_ready };
+
+	/// A buffer in the ring with the image it holds
+	struct slot
+	{
+		int16 *pixels;			///< pixel values, row after row
+		slot_state state;		///< whether the buffer is free, being filled or holds an image
+		int img;				///< number of the image in the buffer
+	};
+
+	void read_images();
+	int16 const* take_locked();
+	int readable_locked() const;
+
+	image_reader reader_;
+	int image_count_;
+	size_t image_size_;
+	std::vector<slot> slots_;
+	std::vector<std::thread> readers_;
+	std::mutex mutex_;
+	std::condition_variable slot_freed_;
+	std::condition_variable slot_ready_;
+	int next_to_read_;
+	int next_to_consume_;
+	int next_to_lend_;			///< first image without a lent buffer, unused with own buffers
+	bool lent_buffers_;
+	int ready_count_;
+	bool acquired_;
+	bool shutdown_;
+	std::exception_ptr error_;
+	prefetch_stats stats_;
+	std::atomic<uint32_t> ready_word_;		///< futex word, incremented and woken whenever an image is ready or reading failed
+};
+
+
+#endif /* IMAGE_PREFETCHER_HPP */
@@ -0,0 +1,257 @@
+/** Processing frames as they arrive and publishing the results of each frame
+    \file live_pipeline.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "live_pipeline.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <MaxSLiCInterface.h>
+
+#include "SpdmCpuCode.hpp"
+#include "cpu_engine.hpp"
+#include "frame_tiler.hpp"
+#include "live_source.hpp"
+#include "result_writer.hpp"
+
+
+/// Create a publisher
+/** @param writer Output backend, flushed after every frame
+    @param frame_count Number of frames of the acquisition
+    @param latency_log Receives a line with frame number, number of results and latency per frame, may be null
+**/
+frame_publisher::frame_publisher(result_writer& writer, int frame_count, std::ostream *latency_log)
+	: writer_(writer), latency_log_(latency_log), timestamps_(frame_count, 0), next_frame_(0), end_of_images_(0)
+{
+	latencies_us_.reserve(frame_count);
+}
+
+/// Set the time a frame was taken, the latency of the frame is measured from here
+/** May be called on another thread, as long as the call happens before the frame is processed.
+**/
+void frame_publisher::set_timestamp(int frame, uint64_t timestamp_ns)
+{
+	timestamps_.at(frame) = timestamp_ns;
+}
+
+/// Add results in the order of the output stream and publish the frames they complete
+/** @param results Array with results, including end of image and last pixel indicators
+    @param length Length of the array
+**/
+void frame_publisher::add(estimator_result const* results, int length)
+{
+	for(int i = 0; i < length; i++) {
+		estimator_result const& result = results[i];
+		if(result.img == last_pixel) {
+			complete_through(timestamps_.size() - 1);
+			return;
+		} else if(result.img == end_of_image) {
+			end_of_images_++;		// the indicator of frame n follows all results of frame n - 1
+			complete_through(end_of_images_ - 2);
+		} else {
+			complete_through(result.img - 1);
+			if(result.img >= next_frame_) {
+				pending_.push_back(result);
+			}
+		}
+	}
+}
+
+/// Publish all frames up to a frame whose results are known to be complete
+/** @param frame The last complete frame
+**/
+void frame_publisher::complete_through(int frame)
+{
+	frame = std::min(frame, (int) timestamps_.size() - 1);
+	for(; next_frame_ <= frame; next_frame_++) {
+		size_t count = 0;
+		while(count < pending_.size() && pending_[count].img == next_frame_) {
+			count++;
+		}
+		if(count) {
+			writer_.write(pending_.data(), count);
+			pending_.erase(pending_.begin(), pending_.begin() + count);
+		}
+		writer_.flush();
+
+		double latency_us = (monotonic_ns() - timestamps_[next_frame_]) * 1e-3;
+		latencies_us_.push_back(latency_us);
+		if(latency_log_) {
+			*latency_log_ << next_frame_ << '\t' << count << '\t' << latency_us << '\n';
+		}
+	}
+}
+
+/// Print the distribution of the latencies
+void frame_publisher::print_stats() const
+{
+	if(latencies_us_.empty()) {
+		return;
+	}
+
+	std::vector<double> sorted(latencies_us_);
+	std::sort(sorted.begin(), sorted.end());
+	double sum = 0;
+	for(size_t i = 0; i < sorted.size(); i++) {
+		sum += sorted[i];
+	}
+
+	std::cerr << "Frames published                           :  " << sorted.size() << std::endl;
+	std::cerr << "Latency mean / p50 / p99 / max in us       :  " << sum / sorted.size()
+			  << " / " << percentile(sorted, 0.5)
+			  << " / " << percentile(sorted, 0.99)
+			  << " / " << sorted.back() << std::endl;
+}
+
+/// Get the latency of every published frame
+/** @return Latencies in microseconds, in the order of the frames
+**/
+std::vector<double> const& frame_publisher::latencies_us() const
+{
+	return latencies_us_;
+}
+
+/// Get a percentile of sorted values
+/** @param sorted Values in ascending order, not empty
+    @param fraction Fraction of the values that are at most the percentile, e.g. 0.99 for p99
+    @return The percentile
+**/
+double frame_publisher::percentile(std::vector<double> const& sorted, double fraction)
+{
+	return sorted[std::min(sorted.size() - 1, (size_t) (sorted.size() * fraction))];
+}
+
+
+/// Keep the localizations a tile owns in the coordinates of the frame, and all indicators
+/** @param tile The tile, null to keep all results as they are
+    @param nm_per_px Size of a pixel in nanometers
+    @param results Results of the engine
+    @param length Number of results, set to the number of results kept
+    @param kept Holds the kept results if they are not the given ones
+    @return The kept results
+**/
+static estimator_result const* crop_results(frame_tile const* tile, float nm_per_px, estimator_result const* results,
+		int& length, std::vector<estimator_result>& kept)
+{
+	if(!tile) {
+		return results;
+	}
+	kept.clear();
+	for(int i = 0; i < length; i++) {
+		estimator_result result = results[i];
+		if(result.img < 0 || keep_tile_result(*tile, nm_per_px, result)) {
+			kept.push_back(result);
+		}
+	}
+	length = kept.size();
+	return kept.data();
+}
+
+/// Process frames as they arrive and publish the results of each frame as soon as it is complete
+/** Frames are read on a separate thread. If the source ends before the announced number of frames,
+    the remaining frames are sent as dark frames so the engine finishes. With a region in the options,
+    only the window around it is streamed to the engine.
+    @param source Source of the frames
+    @param scalars Scalar values for the acquisition, with the size of the whole frame
+    @param options Options of the run
+    @param config The DFE configuration, null for the CPU
+    @param dfe The loaded DFE, null for the CPU
+    @param writer Output backend for the results
+    @param latency_log Receives the latency of every frame, may be null
+**/
+void run_live(live_source& source, dfe_scalars const& scalars, run_options const& options, dfe_config const* config,
+		dataflow_engine *dfe, result_writer& writer, std::ostream *latency_log)
+{
+	frame_publisher publisher(writer, scalars.total_images, latency_log);
+	size_t frame_size = (size_t) scalars.img_width * scalars.img_height;
+
+	// a region is cut from every frame as a single tile, which must fit the engine
+	std::unique_ptr<frame_tile> tile;
+	dfe_scalars engine_scalars = scalars;
+	std::vector<int16> frame;
+	std::vector<int16 const*> frame_rows;
+	if(options.region.width) {
+		std::vector<frame_tile> tiles = split_frame(scalars.img_width, scalars.img_height, options.region,
+				dfe ? config->constants().max_img_width : scalars.img_width,
+				dfe ? config->constants().max_img_height : scalars.img_height,
+				dfe ? tile_width_multiple : 1, dfe ? dfe_stream_run::slot_send_length / tile_width_multiple : 1,
+				tile_margin(scalars.roi_radius));
+		if(tiles.size() != 1) {
+			throw std::runtime_error("run_live: the region must fit the engine");
+		}
+		tile.reset(new frame_tile(tiles[0]));
+		engine_scalars.img_width = tile->window.width;
+		engine_scalars.img_height = tile->window.height;
+		frame.resize(frame_size);
+		for(int row = 0; row < scalars.img_height; row++) {
+			frame_rows.push_back(frame.data() + (size_t) row * scalars.img_width);
+		}
+		std::cerr << "Live window                                :  " << tile->window.x << "," << tile->window.y << " "
+				  << tile->window.width << "x" << tile->window.height << std::endl;
+	}
+	size_t image_size = (size_t) engine_scalars.img_width * engine_scalars.img_height;
+
+	std::atomic<int> dark_frames(0);
+	image_reader reader = [&](int img, int16 *pixels) {		// a single reader, so the frame buffer is not shared
+		uint64_t timestamp_ns;
+		int16 *target = tile ? frame.data() : pixels;
+		if(!source.read_frame(target, timestamp_ns)) {
+			std::memset(target, 0, frame_size * sizeof(int16));
+			timestamp_ns = monotonic_ns();
+			dark_frames++;
+		}
+		if(tile) {
+			copy_window(frame_rows.data(), tile->window, pixels);
+		}
+		publisher.set_timestamp(img, timestamp_ns);
+	};
+	image_prefetcher prefetcher(reader, image_size, scalars.total_images, options.prefetch_depth, 1,
+			dfe && !options.copy_slots);
+
+	std::vector<estimator_result> kept;
+	if(dfe) {
+		if(engine_scalars.img_width > config->constants().max_img_width
+				|| engine_scalars.img_height > config->constants().max_img_height) {
+			throw std::runtime_error("scalars.img_width > config.constants().max_img_width || scalars.img_height > config.constants().max_img_height");
+		}
+		dfe->configure(engine_scalars);
+		dfe_stream_run run(*dfe, prefetcher, engine_scalars, options.recv_slot_count);
+		run.set_policy(options.policy, 0);
+		if(options.instrumentation) {
+			run.set_counters(&options.instrumentation->engine(0));
+		}
+
+		while(!run.finished()) {		// active polling, required by the low-latency interface
+			int length;
+			estimator_result const* results = run.poll(length);
+			if(results) {
+				results = crop_results(tile.get(), scalars.nm_per_px, results, length, kept);
+				publisher.add(results, length);
+			}
+		}
+	} else {
+		cpu_engine engine(engine_scalars, options.thread_count, options.fit_gaussians);
+		std::vector<estimator_result> results;
+		for(int img = 0; img < scalars.total_images; img++) {
+			engine.process(prefetcher.acquire(), results);
+			prefetcher.release();
+			int length = results.size();
+			estimator_result const* published = crop_results(tile.get(), scalars.nm_per_px, results.data(), length, kept);
+			publisher.add(published, length);
+			publisher.complete_through(img - 1);		// the engine returns all results of the previous frame
+			results.clear();
+		}
+	}
+
+	if(dark_frames) {
+		std::cerr << "Dark frames after the end of the source    :  " << dark_frames << std::endl;
+	}
+	publisher.print_stats();
+	print_prefetch_stats(prefetcher.stats());
+}
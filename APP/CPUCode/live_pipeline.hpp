@@ -0,0 +1,56 @@
+/** Processing frames as they arrive and publishing the results of each frame
+    \file live_pipeline.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef LIVE_PIPELINE_HPP
+#define LIVE_PIPELINE_HPP
+
+
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+
+#include "spdm_types.hpp"
+
+
+class dfe_config;
+class dataflow_engine;
+class live_source;
+class result_writer;
+struct run_options;
+
+/// Writes the results of each frame as soon as the frame is complete and measures the latency
+/** The results of a frame are complete once a result or an end of image indicator of a later frame
+    arrives, so a frame is published while the next one is processed.
+**/
+class frame_publisher
+{
+public:
+	frame_publisher(result_writer& writer, int frame_count, std::ostream *latency_log = 0);
+	void set_timestamp(int frame, uint64_t timestamp_ns);
+	void add(estimator_result const* results, int length);
+	void complete_through(int frame);
+	void print_stats() const;
+	std::vector<double> const& latencies_us() const;
+
+	static double percentile(std::vector<double> const& sorted, double fraction);
+
+private:
+	frame_publisher(frame_publisher const&);		// no copying
+	frame_publisher& operator=(const frame_publisher&);
+
+	result_writer& writer_;
+	std::ostream *latency_log_;
+	std::vector<uint64_t> timestamps_;
+	std::vector<estimator_result> pending_;
+	std::vector<double> latencies_us_;
+	int next_frame_;
+	int end_of_images_;
+};
+
+void run_live(live_source& source, dfe_scalars const& scalars, run_options const& options, dfe_config const* config,
+		dataflow_engine *dfe, result_writer& writer, std::ostream *latency_log);
+
+
+#endif /* LIVE_PIPELINE_HPP */
@@ -0,0 +1,183 @@
+/** Sources of images that arrive while they are processed
+    \file live_source.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "live_source.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/// Get the time of CLOCK_MONOTONIC, which is the same for all processes of a machine
+/** @return Time in nanoseconds
+**/
+uint64_t monotonic_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+live_source::live_source()
+	: width_(0), height_(0), frame_count_(0)
+{}
+
+live_source::~live_source()
+{}
+
+/// Get the width of the frames in pixels
+int live_source::width() const
+{
+	return width_;
+}
+
+/// Get the height of the frames in pixels
+int live_source::height() const
+{
+	return height_;
+}
+
+/// Get the number of frames the source announced
+int live_source::frame_count() const
+{
+	return frame_count_;
+}
+
+
+/// Open a stream and read its header, blocks until the writer of a pipe has opened it
+/** @param path Path of the pipe or file, "-" for stdin
+**/
+pipe_source::pipe_source(std::string const& path)
+	: fd_(-1)
+{
+	fd_ = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+	if(fd_ < 0) {
+		throw std::runtime_error("open: " + path + ": " + strerror(errno));
+	}
+
+	live_stream_header header;
+	if(!read_fully(&header, sizeof(header)) || std::memcmp(header.magic, "SPDMLIV1", sizeof(header.magic)) != 0
+			|| header.header_size < sizeof(header)) {
+		throw std::runtime_error("pipe_source: " + path + " does not start with a live stream header");
+	}
+
+	char skipped[64];
+	for(size_t remaining = header.header_size - sizeof(header); remaining; ) {		// fields added in later versions
+		size_t n = std::min(remaining, sizeof(skipped));
+		if(!read_fully(skipped, n)) {
+			throw std::runtime_error("pipe_source: truncated header");
+		}
+		remaining -= n;
+	}
+
+	width_ = header.img_width;
+	height_ = header.img_height;
+	frame_count_ = header.frame_count;
+}
+
+pipe_source::~pipe_source()
+{
+	if(fd_ > STDIN_FILENO) {
+		close(fd_);
+	}
+}
+
+/// Wait for the next frame and read it
+/** @param pixels Receives the pixels of the frame
+    @param timestamp_ns Receives the time the frame was taken
+    @return False if the stream has ended
+**/
+bool pipe_source::read_frame(int16 *pixels, uint64_t& timestamp_ns)
+{
+	live_frame_header header;
+	if(!read_fully(&header, sizeof(header))) {
+		return false;
+	}
+	if(!read_fully(pixels, (size_t) width_ * height_ * sizeof(int16))) {
+		throw std::runtime_error("pipe_source: stream ended within a frame");
+	}
+
+	timestamp_ns = header.timestamp_ns ? header.timestamp_ns : monotonic_ns();
+	return true;
+}
+
+// private
+/// Read until a buffer is full
+/** @return False if the stream ended before the first byte
+**/
+bool pipe_source::read_fully(void *buffer, size_t size)
+{
+	char *p = static_cast<char*>(buffer);
+	size_t done = 0;
+	while(done < size) {
+		ssize_t n = read(fd_, p + done, size - done);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0) {
+			throw std::runtime_error(std::string("pipe_source: read: ") + strerror(errno));
+		}
+		if(n == 0) {
+			if(done == 0) {
+				return false;
+			}
+			throw std::runtime_error("pipe_source: stream ended within a header or frame");
+		}
+		done += n;
+	}
+	return true;
+}
+
+
+/// Replay a stack, the first frame is taken when it is first read
+/** @param tiff The image stack
+    @param frames_per_second Frame rate of the replay
+**/
+replay_source::replay_source(tiff_container& tiff, double frames_per_second)
+	: tiff_(tiff), frame_interval_ns_(1e9 / frames_per_second), start_ns_(0), next_frame_(0)
+{
+	tiff_image16_ref first = tiff_.image(0);
+	width_ = first.width();
+	height_ = first.height();
+	frame_count_ = tiff_.total_img_count();
+}
+
+/// Wait until the next frame is due and read it
+/** @param pixels Receives the pixels of the frame
+    @param timestamp_ns Receives the time the frame was due
+    @return False after the last frame of the stack
+**/
+bool replay_source::read_frame(int16 *pixels, uint64_t& timestamp_ns)
+{
+	if(next_frame_ >= frame_count_) {
+		return false;
+	}
+	if(next_frame_ == 0) {
+		start_ns_ = monotonic_ns();
+	}
+
+	uint64_t due_ns = start_ns_ + next_frame_ * frame_interval_ns_;
+	struct timespec due;
+	due.tv_sec = due_ns / 1000000000;
+	due.tv_nsec = due_ns % 1000000000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR) {
+	}
+
+	tiff_image16_ref image = tiff_.image(next_frame_);
+	if(image.width() != width_ || image.height() != height_) {
+		throw std::runtime_error("replay_source: image size differs from the first image");
+	}
+	std::memcpy(pixels, image.data()[0], (size_t) width_ * height_ * sizeof(int16));
+
+	timestamp_ns = due_ns;
+	next_frame_++;
+	return true;
+}
@@ -0,0 +1,92 @@
+/** Sources of images that arrive while they are processed
+    \file live_source.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef LIVE_SOURCE_HPP
+#define LIVE_SOURCE_HPP
+
+
+#include <stdint.h>
+#include <string>
+
+#include "tiff.hpp"
+
+
+/// Header at the start of a live stream, all values in host byte order
+struct live_stream_header
+{
+	char magic[8];				///< "SPDMLIV1"
+	uint32_t header_size;		///< size of this header in bytes
+	uint32_t img_width;			///< width in pixels of each image frame
+	uint32_t img_height;		///< height in pixels of each image frame
+	uint32_t frame_count;		///< number of frames of the acquisition
+};
+
+/// Header before the pixels of each frame of a live stream
+struct live_frame_header
+{
+	uint64_t frame;				///< number of the frame, counting from zero
+	uint64_t timestamp_ns;		///< CLOCK_MONOTONIC time the frame was taken, 0 for the time it is read
+};
+
+uint64_t monotonic_ns();
+
+/// Source of frames that are processed as they arrive
+class live_source
+{
+public:
+	virtual ~live_source();
+	virtual bool read_frame(int16 *pixels, uint64_t& timestamp_ns) = 0;
+
+	int width() const;
+	int height() const;
+	int frame_count() const;
+
+protected:
+	live_source();
+
+	int width_;					///< width in pixels of each frame
+	int height_;				///< height in pixels of each frame
+	int frame_count_;			///< number of frames the source announced
+};
+
+/// Frames from a named pipe, a file or stdin
+/** The stream starts with a live_stream_header, followed by a live_frame_header and the 16 bit pixels,
+    row after row, of each frame. A camera driver writes into a pipe created with mkfifo.
+**/
+class pipe_source : public live_source
+{
+public:
+	explicit pipe_source(std::string const& path);
+	~pipe_source();
+	bool read_frame(int16 *pixels, uint64_t& timestamp_ns);
+
+private:
+	pipe_source(pipe_source const&);		// no copying
+	pipe_source& operator=(const pipe_source&);
+
+	bool read_fully(void *buffer, size_t size);
+
+	int fd_;
+};
+
+/// Frames of an image stack, replayed at a fixed frame rate like a camera
+class replay_source : public live_source
+{
+public:
+	replay_source(tiff_container& tiff, double frames_per_second);
+	bool read_frame(int16 *pixels, uint64_t& timestamp_ns);
+
+private:
+	replay_source(replay_source const&);		// no copying
+	replay_source& operator=(const replay_source&);
+
+	tiff_container& tiff_;
+	uint64_t frame_interval_ns_;
+	uint64_t start_ns_;
+	int next_frame_;
+};
+
+
+#endif /* LIVE_SOURCE_HPP */
@@ -0,0 +1,321 @@
+/** Ground truth of synthetic stacks and scoring of localizations against it
+    \file localization_scorer.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "localization_scorer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <MaxSLiCInterface.h>
+
+#include "SpdmCpuCode.hpp"
+#include "live_source.hpp"
+
+
+/// Write the emitters of a synthetic stack as text, one line per emitter
+/** The columns are img, id, x_nm, y_nm and photons, preceded by a header line starting with '#'. The id
+    tells which localizations of different images belong to the same emitter.
+    @param out Stream to write to
+    @param emitters The emitters in the order of the images
+    @param nm_per_px Edge length of a pixel in nanometers
+**/
+void write_ground_truth(std::ostream& out, std::vector<synthetic_emitter> const& emitters, double nm_per_px)
+{
+	out << "# img\tid\tx_nm\ty_nm\tphotons\n";
+	for(size_t i = 0; i < emitters.size(); i++) {
+		synthetic_emitter const& emitter = emitters[i];
+		out << emitter.img << '\t' << emitter.id << '\t' << (float) (emitter.x * nm_per_px) << '\t' << (float) (emitter.y * nm_per_px)
+			<< '\t' << (float) emitter.photons << '\n';
+	}
+}
+
+/// Read a ground truth written by write_ground_truth
+/** @param in Stream to read from
+    @return The true positions
+**/
+std::vector<truth_position> read_ground_truth(std::istream& in)
+{
+	std::vector<truth_position> truth;
+	std::string line;
+	while(std::getline(in, line)) {
+		if(line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields(line);
+		truth_position position;
+		if(!(fields >> position.img >> position.id >> position.x_nm >> position.y_nm >> position.photons)) {
+			throw std::runtime_error("read_ground_truth: malformed line '" + line + "'");
+		}
+		truth.push_back(position);
+	}
+	return truth;
+}
+
+/// Order positions by image and then from left to right
+static bool truth_before(truth_position const& a, truth_position const& b)
+{
+	return a.img < b.img || (a.img == b.img && a.x_nm < b.x_nm);
+}
+
+/// Order results by image and then from left to right
+static bool result_before(estimator_result const& a, estimator_result const& b)
+{
+	return a.img < b.img || (a.img == b.img && a.mu_x < b.mu_x);
+}
+
+/// Candidate match of a localization and an emitter of the same image
+struct candidate_match
+{
+	float distance2;			///< squared distance in nm^2
+	int truth;					///< index of the emitter
+	int result;					///< index of the localization
+};
+
+/// Order candidates from the closest to the farthest
+static bool closer(candidate_match const& a, candidate_match const& b)
+{
+	return a.distance2 < b.distance2;
+}
+
+/// Match localizations to the ground truth and compute their quality
+/** In every image, localizations and emitters are matched one to one within the tolerance, closest pairs
+    first. End of image and last pixel indicators are ignored.
+    @param truth True positions of all emitters
+    @param results Results of the engine
+    @param tolerance_nm Largest distance of a localization from its emitter
+    @return The quality of the localizations
+**/
+accuracy_report score_localizations(std::vector<truth_position> truth, std::vector<estimator_result> results,
+		double tolerance_nm)
+{
+	results.erase(std::remove_if(results.begin(), results.end(),
+			[](estimator_result const& result) { return result.img < 0; }), results.end());
+	std::sort(truth.begin(), truth.end(), truth_before);
+	std::sort(results.begin(), results.end(), result_before);
+
+	accuracy_report report;
+	report.true_positives = 0;
+	report.uncalibrated = 0;
+	double error_x2 = 0, error_y2 = 0, z_x2 = 0, z_y2 = 0;
+	long within = 0;
+	float tolerance2 = tolerance_nm * tolerance_nm;
+
+	std::vector<candidate_match> candidates;
+	std::vector<bool> truth_matched, result_matched;
+	size_t t_begin = 0, r_begin = 0;
+	while(t_begin < truth.size() || r_begin < results.size()) {
+		int img = t_begin == truth.size() ? results[r_begin].img
+				: r_begin == results.size() ? truth[t_begin].img : std::min(truth[t_begin].img, results[r_begin].img);
+		size_t t_end = t_begin, r_end = r_begin;
+		while(t_end < truth.size() && truth[t_end].img == img) {
+			t_end++;
+		}
+		while(r_end < results.size() && results[r_end].img == img) {
+			r_end++;
+		}
+
+		candidates.clear();
+		size_t first = t_begin;
+		for(size_t r = r_begin; r < r_end; r++) {
+			while(first < t_end && truth[first].x_nm < results[r].mu_x - tolerance_nm) {
+				first++;		// results are sorted by x, so emitters left of this window are left of all later ones
+			}
+			for(size_t t = first; t < t_end && truth[t].x_nm <= results[r].mu_x + tolerance_nm; t++) {
+				float dx = results[r].mu_x - truth[t].x_nm;
+				float dy = results[r].mu_y - truth[t].y_nm;
+				candidate_match match = {dx * dx + dy * dy, (int) t, (int) r};
+				if(match.distance2 <= tolerance2) {
+					candidates.push_back(match);
+				}
+			}
+		}
+		std::sort(candidates.begin(), candidates.end(), closer);
+
+		truth_matched.assign(t_end - t_begin, false);
+		result_matched.assign(r_end - r_begin, false);
+		for(size_t i = 0; i < candidates.size(); i++) {
+			candidate_match const& match = candidates[i];
+			if(truth_matched[match.truth - t_begin] || result_matched[match.result - r_begin]) {
+				continue;
+			}
+			truth_matched[match.truth - t_begin] = true;
+			result_matched[match.result - r_begin] = true;
+			report.true_positives++;
+
+			estimator_result const& result = results[match.result];
+			double dx = result.mu_x - truth[match.truth].x_nm;
+			double dy = result.mu_y - truth[match.truth].y_nm;
+			error_x2 += dx * dx;
+			error_y2 += dy * dy;
+			if(!(result.delta_mu_x > 0 && result.delta_mu_y > 0 && std::isfinite(result.delta_mu_x) && std::isfinite(result.delta_mu_y))) {
+				report.uncalibrated++;
+				continue;
+			}
+			z_x2 += dx * dx / (result.delta_mu_x * result.delta_mu_x);
+			z_y2 += dy * dy / (result.delta_mu_y * result.delta_mu_y);
+			within += std::fabs(dx) <= result.delta_mu_x && std::fabs(dy) <= result.delta_mu_y;
+		}
+
+		t_begin = t_end;
+		r_begin = r_end;
+	}
+
+	long matched = report.true_positives;
+	report.false_positives = results.size() - matched;
+	report.false_negatives = truth.size() - matched;
+	report.recall = truth.empty() ? 0 : (double) matched / truth.size();
+	report.precision = results.empty() ? 0 : (double) matched / results.size();
+	long all = matched + report.false_positives + report.false_negatives;
+	report.jaccard = all ? (double) matched / all : 0;
+	report.rmse_x_nm = matched ? std::sqrt(error_x2 / matched) : 0;
+	report.rmse_y_nm = matched ? std::sqrt(error_y2 / matched) : 0;
+	report.rmse_nm = matched ? std::sqrt((error_x2 + error_y2) / matched) : 0;
+	long calibrated = matched - report.uncalibrated;
+	report.delta_mu_x_ratio = calibrated ? std::sqrt(z_x2 / calibrated) : 0;
+	report.delta_mu_y_ratio = calibrated ? std::sqrt(z_y2 / calibrated) : 0;
+	report.within_delta_mu = calibrated ? (double) within / calibrated : 0;
+	return report;
+}
+
+/// Write the members of a report as JSON fields, without the enclosing braces
+/** @param out Stream to write to
+    @param report The report
+    @param tolerance_nm Tolerance the report was computed with
+**/
+void print_accuracy_json(std::ostream& out, accuracy_report const& report, double tolerance_nm)
+{
+	out << "  \"tolerance_nm\": " << tolerance_nm << ",\n"
+		<< "  \"true_positives\": " << report.true_positives << ",\n"
+		<< "  \"false_positives\": " << report.false_positives << ",\n"
+		<< "  \"false_negatives\": " << report.false_negatives << ",\n"
+		<< "  \"recall\": " << report.recall << ",\n"
+		<< "  \"precision\": " << report.precision << ",\n"
+		<< "  \"jaccard\": " << report.jaccard << ",\n"
+		<< "  \"rmse_nm\": {\"x\": " << report.rmse_x_nm << ", \"y\": " << report.rmse_y_nm
+		<< ", \"lateral\": " << report.rmse_nm << "},\n"
+		<< "  \"delta_mu\": {\"x_ratio\": " << report.delta_mu_x_ratio << ", \"y_ratio\": " << report.delta_mu_y_ratio
+		<< ", \"within\": " << report.within_delta_mu << ", \"uncalibrated\": " << report.uncalibrated << "}";
+}
+
+
+/// Get the path of the ground truth of a stack, the stack path with the extension .truth.tsv
+/** @param stack Path of the stack
+    @return The path of the ground truth
+**/
+std::string ground_truth_path(std::string const& stack)
+{
+	std::string base = stack;
+	size_t dot = base.rfind('.');
+	if(dot != std::string::npos && base.find('/', dot) == std::string::npos) {
+		base.erase(dot);
+	}
+	return base + ".truth.tsv";
+}
+
+/// Render a synthetic stack into a TIFF file and write its ground truth next to it
+/** @param path Path of the stack
+    @param params Parameters of the stack
+    @param thread_count Number of threads rendering images
+**/
+void generate_stack(std::string const& path, synthetic_params const& params, int thread_count)
+{
+	synthetic_stack stack(params);
+	std::vector<synthetic_emitter> emitters;
+	{
+		tiff_container tiff(path, "w");
+		if(!tiff.good()) {
+			throw std::runtime_error("Could not create tiff file '" + path + "'");
+		}
+		std::cerr << "Writing synthetic stack to '" << path << "'" << std::endl;
+		stack.write(tiff, thread_count, &emitters);
+	}
+
+	std::string truth_path = ground_truth_path(path);
+	std::ofstream truth(truth_path.c_str(), std::ios::out | std::ios::trunc);
+	if(!truth) {
+		throw std::runtime_error("Could not open ground truth file '" + truth_path + "'");
+	}
+	std::cerr << "Writing ground truth to '" << truth_path << "'" << std::endl;
+	write_ground_truth(truth, emitters, params.nm_per_px);
+	std::cerr << "Emitters                                   :  " << emitters.size() << std::endl;
+}
+
+/// Process a stack and score its results against the ground truth
+/** Writes a JSON report with the engine parameters, the runtime and the quality of the localizations.
+    @param path Path of the stack
+    @param truth_path Path of the ground truth
+    @param tolerance_nm Largest distance of a localization from its emitter
+    @param options Options of the run, with the engine parameters
+    @param config The DFE configuration, null for the CPU
+    @param engines The loaded DFEs, empty for the CPU
+    @param json Receives the report
+    @return False if the stack could not be opened
+**/
+bool score_stack(std::string const& path, std::string const& truth_path, double tolerance_nm, run_options const& options,
+		dfe_config const* config, std::vector<dataflow_engine*> const& engines, std::ostream& json)
+{
+	std::ifstream truth_file(truth_path.c_str());
+	if(!truth_file) {
+		throw std::runtime_error("Could not open ground truth file '" + truth_path + "'");
+	}
+	std::vector<truth_position> truth = read_ground_truth(truth_file);
+
+	collecting_writer writer;
+	uint64_t start_ns = monotonic_ns();
+	if(!process_stack(path, options, config, engines, &writer)) {
+		return false;
+	}
+	double wall_s = (monotonic_ns() - start_ns) * 1e-9;
+
+	double nm_per_px = options.nm_per_px;
+	if(!(nm_per_px > 0)) {		// as process_stack() chose it
+		tiff_container tiff(path, "r", options.use_index_file);
+		nm_per_px = tiff.nm_per_px() > 0 ? tiff.nm_per_px() : default_nm_per_px;
+	}
+
+	accuracy_report report = score_localizations(truth, writer.results(), tolerance_nm);
+	json << "{\n"
+		 << "  \"stack\": \"" << path << "\",\n"
+		 << "  \"backend\": \"" << (engines.empty() ? "cpu" : "dfe") << "\",\n"
+		 << "  \"bg_threshold_factor\": " << options.bg_threshold_factor << ",\n"
+		 << "  \"separator_threshold_factor\": " << options.separator_threshold_factor << ",\n"
+		 << "  \"nm_per_px\": " << nm_per_px << ",\n"
+		 << "  \"wall_s\": " << wall_s << ",\n"
+		 << "  \"localizations\": " << writer.results().size() << ",\n"
+		 << "  \"emitters\": " << truth.size() << ",\n";
+	print_accuracy_json(json, report, tolerance_nm);
+	json << "\n}" << std::endl;
+	return true;
+}
+
+
+/// Keep results
+/** @param results Array with results
+    @param length Length of the array
+**/
+void collecting_writer::write(estimator_result const* results, int length)
+{
+	for(int i = 0; i < length; i++) {
+		if(results[i].img >= 0) {
+			results_.push_back(results[i]);
+		}
+	}
+}
+
+void collecting_writer::flush()
+{}
+
+void collecting_writer::finish()
+{}
+
+/// Get the results written so far
+std::vector<estimator_result> const& collecting_writer::results() const
+{
+	return results_;
+}
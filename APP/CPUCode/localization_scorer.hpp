@@ -0,0 +1,80 @@
+/** Ground truth of synthetic stacks and scoring of localizations against it
+    \file localization_scorer.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef LOCALIZATION_SCORER_HPP
+#define LOCALIZATION_SCORER_HPP
+
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "result_writer.hpp"
+#include "spdm_types.hpp"
+#include "synthetic_stack.hpp"
+
+
+class dfe_config;
+class dataflow_engine;
+struct run_options;
+
+/// True position of an emitter in nanometers, in the coordinates of the estimator results
+struct truth_position
+{
+	int img;					///< number of the image
+	int id;						///< number of the emitter, the same in every image it is on
+	float x_nm;					///< horizontal position, 0 is the center of the first column
+	float y_nm;					///< vertical position, 0 is the center of the first row
+	float photons;				///< number of photons emitted during the image
+};
+
+void write_ground_truth(std::ostream& out, std::vector<synthetic_emitter> const& emitters, double nm_per_px);
+std::vector<truth_position> read_ground_truth(std::istream& in);
+
+/// Quality of localizations compared to the ground truth
+struct accuracy_report
+{
+	long true_positives;		///< localizations matched to an emitter
+	long false_positives;		///< localizations without an emitter
+	long false_negatives;		///< emitters without a localization
+	double recall;				///< fraction of the emitters that were found
+	double precision;			///< fraction of the localizations that are real
+	double jaccard;				///< true positives divided by the sum of all three counts
+	double rmse_x_nm;			///< root mean square error of the matched localizations in x
+	double rmse_y_nm;			///< root mean square error of the matched localizations in y
+	double rmse_nm;				///< root mean square of the lateral distance of the matched localizations
+	double delta_mu_x_ratio;	///< RMS of the error in x divided by the reported delta_mu_x, 1 if calibrated
+	double delta_mu_y_ratio;	///< RMS of the error in y divided by the reported delta_mu_y, 1 if calibrated
+	double within_delta_mu;		///< fraction of the matched errors within delta_mu in both axes, 0.47 if calibrated
+	long uncalibrated;			///< matched localizations without a finite positive delta_mu, left out of the three values above
+};
+
+std::string ground_truth_path(std::string const& stack);
+void generate_stack(std::string const& path, synthetic_params const& params, int thread_count);
+
+accuracy_report score_localizations(std::vector<truth_position> truth, std::vector<estimator_result> results,
+		double tolerance_nm);
+void print_accuracy_json(std::ostream& out, accuracy_report const& report, double tolerance_nm);
+
+bool score_stack(std::string const& path, std::string const& truth_path, double tolerance_nm, run_options const& options,
+		dfe_config const* config, std::vector<dataflow_engine*> const& engines, std::ostream& json);
+
+/// Writer that keeps the results in memory for scoring
+class collecting_writer : public result_writer
+{
+public:
+	void write(estimator_result const* results, int length);
+	void flush();
+	void finish();
+
+	std::vector<estimator_result> const& results() const;
+
+private:
+	std::vector<estimator_result> results_;
+};
+
+
+#endif /* LOCALIZATION_SCORER_HPP */
@@ -0,0 +1,285 @@
+/** Metadata of OME-TIFF image series
+    \file ome_metadata.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "ome_metadata.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+
+/// A tag of an XML document
+struct xml_tag
+{
+	std::string name;				///< name without namespace prefix
+	std::string attributes;			///< text between the name and the end of the tag
+	bool closing;					///< true for </name>
+	bool empty;						///< true for <name/>
+};
+
+/// Find the next tag, skipping comments, declarations and processing instructions
+/** @param xml The document
+    @param pos Position to search from, set behind the tag
+    @param tag Receives the tag
+    @return False at the end of the document
+**/
+static bool next_tag(std::string const& xml, size_t& pos, xml_tag& tag)
+{
+	while((pos = xml.find('<', pos)) != std::string::npos) {
+		if(xml.compare(pos, 4, "<!--") == 0) {
+			pos = xml.find("-->", pos);
+			if(pos == std::string::npos) {
+				return false;
+			}
+			continue;
+		}
+
+		// '>' may appear in attribute values
+		size_t end = pos + 1;
+		char quote = 0;
+		for(; end < xml.size() && (quote || xml[end] != '>'); end++) {
+			if(quote ? xml[end] == quote : xml[end] == '"' || xml[end] == '\'') {
+				quote = quote ? 0 : xml[end];
+			}
+		}
+		if(end >= xml.size()) {
+			return false;
+		}
+
+		size_t begin = pos + 1;
+		pos = end + 1;
+		if(xml[begin] == '?' || xml[begin] == '!') {
+			continue;
+		}
+		tag.closing = xml[begin] == '/';
+		tag.empty = xml[end - 1] == '/';
+		begin += tag.closing;
+		size_t name_end = begin;
+		while(name_end < end && !strchr(" \t\r\n/", xml[name_end])) {
+			name_end++;
+		}
+		size_t name_begin = begin;
+		for(size_t i = begin; i < name_end; i++) {
+			if(xml[i] == ':') {
+				name_begin = i + 1;
+			}
+		}
+		tag.name = xml.substr(name_begin, name_end - name_begin);
+		tag.attributes = xml.substr(name_end, end - tag.empty - name_end);
+		return true;
+	}
+	return false;
+}
+
+/// Replace the predefined entities of XML
+static std::string decode_entities(std::string const& text)
+{
+	static char const* const entities[][2] = {
+		{"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}
+	};
+	std::string decoded;
+	for(size_t i = 0; i < text.size(); i++) {
+		size_t e = 0;
+		while(e < sizeof(entities) / sizeof(entities[0]) && text.compare(i, strlen(entities[e][0]), entities[e][0]) != 0) {
+			e++;
+		}
+		if(e < sizeof(entities) / sizeof(entities[0])) {
+			decoded += entities[e][1];
+			i += strlen(entities[e][0]) - 1;
+		} else {
+			decoded += text[i];
+		}
+	}
+	return decoded;
+}
+
+/// Get the value of an attribute of a tag
+/** @param tag The tag
+    @param name Name of the attribute
+    @param value Receives the value
+    @return False if the tag has no such attribute
+**/
+static bool attribute(xml_tag const& tag, char const* name, std::string& value)
+{
+	std::string const& text = tag.attributes;
+	size_t pos = 0;
+	while(pos < text.size()) {
+		while(pos < text.size() && strchr(" \t\r\n", text[pos])) {
+			pos++;
+		}
+		size_t equals = text.find('=', pos);
+		if(equals == std::string::npos) {
+			return false;
+		}
+		size_t name_end = equals;
+		while(name_end > pos && strchr(" \t\r\n", text[name_end - 1])) {
+			name_end--;
+		}
+		size_t quote = text.find_first_of("\"'", equals);
+		if(quote == std::string::npos) {
+			return false;
+		}
+		size_t value_end = text.find(text[quote], quote + 1);
+		if(value_end == std::string::npos) {
+			return false;
+		}
+		if(text.compare(pos, name_end - pos, name) == 0 && strlen(name) == name_end - pos) {
+			value = decode_entities(text.substr(quote + 1, value_end - quote - 1));
+			return true;
+		}
+		pos = value_end + 1;
+	}
+	return false;
+}
+
+/// Get an integer attribute of a tag
+/** @return The value, or fallback if the tag has no such attribute
+**/
+static int int_attribute(xml_tag const& tag, char const* name, int fallback)
+{
+	std::string value;
+	return attribute(tag, name, value) ? atoi(value.c_str()) : fallback;
+}
+
+/// Get the number of nanometers in a unit of length of OME
+/** @return The factor, 0 for an unknown unit
+**/
+static double nm_per_unit(std::string const& unit)
+{
+	if(unit == "nm") {
+		return 1;
+	} else if(unit == "\xC2\xB5m" || unit == "\xCE\xBCm" || unit == "um") {		// micro sign or Greek mu
+		return 1e3;
+	} else if(unit == "mm") {
+		return 1e6;
+	} else if(unit == "cm") {
+		return 1e7;
+	} else if(unit == "m") {
+		return 1e9;
+	} else if(unit == "\xC3\x85" || unit == "\xE2\x84\xAB") {		// Angstrom
+		return 0.1;
+	} else if(unit == "pm") {
+		return 1e-3;
+	}
+	return 0;
+}
+
+
+/// Create empty metadata
+ome_metadata::ome_metadata()
+	: image_count(0), nm_per_px(0)
+{}
+
+/// Read the metadata from OME-XML
+/** If the XML refers to a companion file with the metadata, only metadata_file is set.
+    @param xml The description of the first image of an OME-TIFF file
+    @return False if the description is no OME-XML or lists no images
+**/
+bool ome_metadata::parse(std::string const& xml)
+{
+	*this = ome_metadata();
+
+	bool ome = false;
+	bool pixels = false;
+	bool tiff_data = false;			// inside a TiffData element, whose UUID names the file
+	int remaining_run = -1;			// run without IFD and PlaneCount, it holds all images not listed otherwise
+	int uncounted_runs = 0;
+	size_t pos = 0;
+	xml_tag tag;
+	while(next_tag(xml, pos, tag)) {
+		if(tag.name == "OME") {
+			if(tag.closing) {
+				break;
+			}
+			ome = true;
+		} else if(!ome) {
+			continue;
+		} else if(tag.name == "BinaryOnly" && !tag.closing) {
+			attribute(tag, "MetadataFile", metadata_file);
+		} else if(tag.name == "Pixels") {
+			if(tag.closing) {
+				break;				// only the first image series
+			}
+			pixels = true;
+			image_count = int_attribute(tag, "SizeZ", 1) * int_attribute(tag, "SizeC", 1) * int_attribute(tag, "SizeT", 1);
+			std::string size, unit = "\xC2\xB5m";
+			if(attribute(tag, "PhysicalSizeX", size)) {
+				attribute(tag, "PhysicalSizeXUnit", unit);
+				nm_per_px = atof(size.c_str()) * nm_per_unit(unit);
+			}
+		} else if(pixels && tag.name == "TiffData") {
+			if(tag.closing) {
+				tiff_data = false;
+				continue;
+			}
+			plane_run run;
+			run.first_ifd = int_attribute(tag, "IFD", -1);
+			run.count = int_attribute(tag, "PlaneCount", run.first_ifd < 0 ? -1 : 1);
+			if(run.count < 0) {
+				remaining_run = planes.size();
+				uncounted_runs++;
+			}
+			run.first_ifd = std::max(run.first_ifd, 0);
+			planes.push_back(run);
+			tiff_data = !tag.empty;
+		} else if(tiff_data && tag.name == "UUID" && !tag.closing) {
+			attribute(tag, "FileName", planes.back().file);
+		}
+	}
+	if(!ome || uncounted_runs > 1) {
+		return false;
+	}
+	if(!metadata_file.empty()) {
+		return true;
+	}
+
+	if(planes.empty()) {
+		plane_run run;
+		run.first_ifd = 0;
+		run.count = image_count;
+		planes.push_back(run);
+	} else if(remaining_run >= 0) {
+		int listed = 0;
+		for(size_t i = 0; i < planes.size(); i++) {
+			listed += (int) i == remaining_run ? 0 : planes[i].count;
+		}
+		planes[remaining_run].count = image_count - listed;
+	}
+
+	// join runs that continue each other, writers often list every image on its own
+	std::vector<plane_run> runs;
+	image_count = 0;
+	for(size_t i = 0; i < planes.size(); i++) {
+		plane_run const& run = planes[i];
+		if(run.count <= 0) {
+			continue;
+		}
+		image_count += run.count;
+		if(!runs.empty() && runs.back().file == run.file && runs.back().first_ifd + runs.back().count == run.first_ifd) {
+			runs.back().count += run.count;
+		} else {
+			runs.push_back(run);
+		}
+	}
+	planes.swap(runs);
+	return image_count > 0;
+}
+
+/// Read the metadata from a companion file with OME-XML
+/** @param path Path of the file
+    @return False if the file cannot be read, is no OME-XML or lists no images
+**/
+bool ome_metadata::parse_file(std::string const& path)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if(!file) {
+		return false;
+	}
+	std::ostringstream xml;
+	xml << file.rdbuf();
+	return parse(xml.str()) && metadata_file.empty();
+}
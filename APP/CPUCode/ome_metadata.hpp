@@ -0,0 +1,40 @@
+/** Metadata of OME-TIFF image series
+    \file ome_metadata.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef OME_METADATA_HPP
+#define OME_METADATA_HPP
+
+
+#include <string>
+#include <vector>
+
+
+/// What the OME-XML in the description of the first image says about the first image series
+/** The OME-XML lists the number of images and where each one is stored, possibly in several files,
+    so a series can be opened without walking the image file directories. Only the attributes needed
+    for that and the pixel size are read, the XML is not validated.
+**/
+struct ome_metadata
+{
+	/// Images of the series that are stored in consecutive image file directories of one file
+	struct plane_run
+	{
+		std::string file;			///< name of the file relative to the directory of the metadata, empty for the file of the metadata
+		int first_ifd;				///< directory of the first image in the file
+		int count;					///< number of images
+	};
+
+	int image_count;				///< number of images of the series
+	double nm_per_px;				///< edge length of a pixel in nanometers, 0 if not given
+	std::string metadata_file;		///< companion file with the metadata if the file only holds pixels, empty otherwise
+	std::vector<plane_run> planes;	///< where the images of the series are stored, in the order of the series
+
+	ome_metadata();
+	bool parse(std::string const& xml);
+	bool parse_file(std::string const& path);
+};
+
+
+#endif /* OME_METADATA_HPP */
@@ -0,0 +1,347 @@
+/** Saturating arithmetic on runs of 16 bit pixels with SIMD implementations
+    \file pixel_arithmetic.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "pixel_arithmetic.hpp"
+
+#include <algorithm>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+
+/// Clamp a value to the range of int16
+static inline int16_t saturate(int32_t value)
+{
+	return (int16_t) std::max(-32768, std::min(32767, value));
+}
+
+static void subtract_scalar(int16_t *pixels, int16_t const *subtrahend, int count)
+{
+	for(int i = 0; i < count; i++) {
+		pixels[i] = std::max(saturate(pixels[i] - subtrahend[i]), (int16_t) 0);
+	}
+}
+
+static void add_scalar(int16_t *pixels, int16_t const *summand, int count)
+{
+	for(int i = 0; i < count; i++) {
+		pixels[i] = saturate(pixels[i] + summand[i]);
+	}
+}
+
+static void subtract_value_scalar(int16_t *pixels, int16_t value, int count)
+{
+	for(int i = 0; i < count; i++) {
+		pixels[i] = std::max(saturate(pixels[i] - value), (int16_t) 0);
+	}
+}
+
+static void multiply_scalar(int16_t *pixels, double factor, int count)
+{
+	for(int i = 0; i < count; i++) {
+		double product = std::max(-32768.0, std::min(32767.0, pixels[i] * factor));		// NaN becomes 32767
+		pixels[i] = (int16_t) (int32_t) product;
+	}
+}
+
+static void shift_left_scalar(int16_t *pixels, int shift, int count)
+{
+	shift = std::min(shift, 16);		// saturates any value but zero, and fits into 32 bits
+	for(int i = 0; i < count; i++) {
+		pixels[i] = saturate(pixels[i] * (1 << shift));
+	}
+}
+
+static void shift_right_scalar(int16_t *pixels, int shift, int count)
+{
+	shift = std::min(shift, 15);
+	for(int i = 0; i < count; i++) {
+		pixels[i] = pixels[i] >> shift;
+	}
+}
+
+static int64_t sum_scalar(int16_t const *pixels, int count)
+{
+	int64_t sum = 0;
+	for(int i = 0; i < count; i++) {
+		sum += pixels[i];
+	}
+	return sum;
+}
+
+static int64_t subtract_update_background_scalar(int16_t *pixels, int16_t *background, float img_weight, float bg_weight,
+		int count)
+{
+	int64_t sum = 0;
+	for(int i = 0; i < count; i++) {
+		int16_t img = pixels[i];
+		int16_t bg = background[i];
+		pixels[i] = std::max(saturate(img - bg), (int16_t) 0);
+		background[i] = saturate((int32_t) (bg * bg_weight + img * img_weight));
+		sum += img;
+	}
+	return sum;
+}
+
+static void min_max_scalar(int16_t const *pixels, int count, int16_t& min, int16_t& max)
+{
+	for(int i = 0; i < count; i++) {
+		min = std::min(min, pixels[i]);
+		max = std::max(max, pixels[i]);
+	}
+}
+
+
+#ifdef __x86_64__
+
+// The AVX2 kernels process 16 pixels per instruction and leave the rest of a run to the scalar ones.
+// Products and shifts are computed with 32 bit lanes and packed with saturation.
+
+/// Pack two vectors of 8 int32 to 16 int16 with saturation, keeping the order
+__attribute__((target("avx2")))
+static inline __m256i pack_saturate_avx2(__m256i low, __m256i high)
+{
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/// Widen the lower 8 of 16 int16 to int32
+__attribute__((target("avx2")))
+static inline __m256i widen_low_avx2(__m256i pixels)
+{
+	return _mm256_cvtepi16_epi32(_mm256_castsi256_si128(pixels));
+}
+
+/// Widen the upper 8 of 16 int16 to int32
+__attribute__((target("avx2")))
+static inline __m256i widen_high_avx2(__m256i pixels)
+{
+	return _mm256_cvtepi16_epi32(_mm256_extracti128_si256(pixels, 1));
+}
+
+/// Add the sum of 16 int16 to 4 int64 accumulators
+__attribute__((target("avx2")))
+static inline __m256i accumulate_avx2(__m256i sum, __m256i pixels)
+{
+	__m256i pairs = _mm256_madd_epi16(pixels, _mm256_set1_epi16(1));
+	sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(pairs)));
+	return _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(pairs, 1)));
+}
+
+/// Add up 4 int64 accumulators
+__attribute__((target("avx2")))
+static inline int64_t horizontal_sum_avx2(__m256i sum)
+{
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i*) lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+/// Multiply 8 int32 in double precision and clamp and round them toward zero like multiply_scalar
+__attribute__((target("avx2")))
+static inline __m256i multiply8_avx2(__m256i values, __m256d factor)
+{
+	const __m256d low_limit = _mm256_set1_pd(-32768.0);
+	const __m256d high_limit = _mm256_set1_pd(32767.0);
+
+	__m256d low = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(values)), factor);
+	__m256d high = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(values, 1)), factor);
+	low = _mm256_max_pd(_mm256_min_pd(low, high_limit), low_limit);		// min_pd returns the limit for NaN
+	high = _mm256_max_pd(_mm256_min_pd(high, high_limit), low_limit);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_cvttpd_epi32(low)), _mm256_cvttpd_epi32(high), 1);
+}
+
+__attribute__((target("avx2")))
+static void subtract_avx2(int16_t *pixels, int16_t const *subtrahend, int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		__m256i b = _mm256_loadu_si256((__m256i const*) (subtrahend + i));
+		_mm256_storeu_si256((__m256i*) (pixels + i), _mm256_max_epi16(_mm256_subs_epi16(a, b), zero));
+	}
+	subtract_scalar(pixels + i, subtrahend + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(int16_t *pixels, int16_t const *summand, int count)
+{
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		__m256i b = _mm256_loadu_si256((__m256i const*) (summand + i));
+		_mm256_storeu_si256((__m256i*) (pixels + i), _mm256_adds_epi16(a, b));
+	}
+	add_scalar(pixels + i, summand + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void subtract_value_avx2(int16_t *pixels, int16_t value, int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i b = _mm256_set1_epi16(value);
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		_mm256_storeu_si256((__m256i*) (pixels + i), _mm256_max_epi16(_mm256_subs_epi16(a, b), zero));
+	}
+	subtract_value_scalar(pixels + i, value, count - i);
+}
+
+__attribute__((target("avx2")))
+static void multiply_avx2(int16_t *pixels, double factor, int count)
+{
+	const __m256d f = _mm256_set1_pd(factor);
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		__m256i low = multiply8_avx2(widen_low_avx2(a), f);
+		__m256i high = multiply8_avx2(widen_high_avx2(a), f);
+		_mm256_storeu_si256((__m256i*) (pixels + i), pack_saturate_avx2(low, high));
+	}
+	multiply_scalar(pixels + i, factor, count - i);
+}
+
+__attribute__((target("avx2")))
+static void shift_left_avx2(int16_t *pixels, int shift, int count)
+{
+	const __m128i s = _mm_cvtsi32_si128(std::min(shift, 16));
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		__m256i low = _mm256_sll_epi32(widen_low_avx2(a), s);
+		__m256i high = _mm256_sll_epi32(widen_high_avx2(a), s);
+		_mm256_storeu_si256((__m256i*) (pixels + i), pack_saturate_avx2(low, high));
+	}
+	shift_left_scalar(pixels + i, shift, count - i);
+}
+
+__attribute__((target("avx2")))
+static void shift_right_avx2(int16_t *pixels, int shift, int count)
+{
+	const __m128i s = _mm_cvtsi32_si128(std::min(shift, 15));
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		_mm256_storeu_si256((__m256i*) (pixels + i), _mm256_sra_epi16(a, s));
+	}
+	shift_right_scalar(pixels + i, shift, count - i);
+}
+
+__attribute__((target("avx2")))
+static int64_t sum_avx2(int16_t const *pixels, int count)
+{
+	__m256i sum = _mm256_setzero_si256();
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		sum = accumulate_avx2(sum, _mm256_loadu_si256((__m256i const*) (pixels + i)));
+	}
+	return horizontal_sum_avx2(sum) + sum_scalar(pixels + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static int64_t subtract_update_background_avx2(int16_t *pixels, int16_t *background, float img_weight, float bg_weight,
+		int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256 img_w = _mm256_set1_ps(img_weight);
+	const __m256 bg_w = _mm256_set1_ps(bg_weight);
+	__m256i sum = _mm256_setzero_si256();
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i img = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		__m256i bg = _mm256_loadu_si256((__m256i const*) (background + i));
+
+		// same order of operations as the scalar kernel
+		__m256 low = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(widen_low_avx2(bg)), bg_w),
+				_mm256_mul_ps(_mm256_cvtepi32_ps(widen_low_avx2(img)), img_w));
+		__m256 high = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(widen_high_avx2(bg)), bg_w),
+				_mm256_mul_ps(_mm256_cvtepi32_ps(widen_high_avx2(img)), img_w));
+
+		_mm256_storeu_si256((__m256i*) (pixels + i), _mm256_max_epi16(_mm256_subs_epi16(img, bg), zero));
+		_mm256_storeu_si256((__m256i*) (background + i),
+				pack_saturate_avx2(_mm256_cvttps_epi32(low), _mm256_cvttps_epi32(high)));
+		sum = accumulate_avx2(sum, img);
+	}
+	return horizontal_sum_avx2(sum)
+			+ subtract_update_background_scalar(pixels + i, background + i, img_weight, bg_weight, count - i);
+}
+
+__attribute__((target("avx2")))
+static void min_max_avx2(int16_t const *pixels, int count, int16_t& min, int16_t& max)
+{
+	__m256i low = _mm256_set1_epi16(min);
+	__m256i high = _mm256_set1_epi16(max);
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((__m256i const*) (pixels + i));
+		low = _mm256_min_epi16(low, a);
+		high = _mm256_max_epi16(high, a);
+	}
+
+	int16_t lows[16], highs[16];
+	_mm256_storeu_si256((__m256i*) lows, low);
+	_mm256_storeu_si256((__m256i*) highs, high);
+	for(int lane = 0; lane < 16; lane++) {
+		min = std::min(min, lows[lane]);
+		max = std::max(max, highs[lane]);
+	}
+	min_max_scalar(pixels + i, count - i, min, max);
+}
+
+#endif
+
+
+/// Fill the table with the fastest kernels the processor supports
+static pixel_kernels make_pixel_kernels()
+{
+	pixel_kernels kernels;
+	kernels.subtract = &subtract_scalar;
+	kernels.add = &add_scalar;
+	kernels.subtract_value = &subtract_value_scalar;
+	kernels.multiply = &multiply_scalar;
+	kernels.shift_left = &shift_left_scalar;
+	kernels.shift_right = &shift_right_scalar;
+	kernels.sum = &sum_scalar;
+	kernels.subtract_update_background = &subtract_update_background_scalar;
+	kernels.min_max = &min_max_scalar;
+	kernels.name = "scalar";
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		kernels.subtract = &subtract_avx2;
+		kernels.add = &add_avx2;
+		kernels.subtract_value = &subtract_value_avx2;
+		kernels.multiply = &multiply_avx2;
+		kernels.shift_left = &shift_left_avx2;
+		kernels.shift_right = &shift_right_avx2;
+		kernels.sum = &sum_avx2;
+		kernels.subtract_update_background = &subtract_update_background_avx2;
+		kernels.min_max = &min_max_avx2;
+		kernels.name = "avx2";
+	}
+#endif
+
+	return kernels;
+}
+
+/// Get the fastest pixel kernels the processor supports
+/** @return The kernels, selected on the first call
+**/
+pixel_kernels const& select_pixel_kernels()
+{
+	static const pixel_kernels kernels = make_pixel_kernels();
+	return kernels;
+}
@@ -0,0 +1,44 @@
+/** Saturating arithmetic on runs of 16 bit pixels with SIMD implementations
+    \file pixel_arithmetic.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef PIXEL_ARITHMETIC_HPP
+#define PIXEL_ARITHMETIC_HPP
+
+
+#include <stdint.h>
+
+
+/// Operations on a run of pixels, in place
+/** Results saturate to the range of int16 instead of wrapping. Every implementation computes the same bits.
+**/
+struct pixel_kernels
+{
+	/// pixels = max(pixels - subtrahend, 0)
+	void (*subtract)(int16_t *pixels, int16_t const *subtrahend, int count);
+	/// pixels = pixels + summand
+	void (*add)(int16_t *pixels, int16_t const *summand, int count);
+	/// pixels = max(pixels - value, 0)
+	void (*subtract_value)(int16_t *pixels, int16_t value, int count);
+	/// pixels = pixels * factor in double precision, rounded toward zero
+	void (*multiply)(int16_t *pixels, double factor, int count);
+	/// pixels = pixels * 2^shift, shift >= 0
+	void (*shift_left)(int16_t *pixels, int shift, int count);
+	/// pixels = pixels / 2^shift rounded toward minus infinity, shift >= 0
+	void (*shift_right)(int16_t *pixels, int shift, int count);
+	/// Sum of the pixels
+	int64_t (*sum)(int16_t const *pixels, int count);
+	/// pixels = max(pixels - background, 0) and background = background * bg_weight + pixels * img_weight in single
+	/// precision rounded toward zero, returns the sum of the pixels before the subtraction
+	int64_t (*subtract_update_background)(int16_t *pixels, int16_t *background, float img_weight, float bg_weight, int count);
+	/// min = min(min, pixels) and max = max(max, pixels)
+	void (*min_max)(int16_t const *pixels, int count, int16_t& min, int16_t& max);
+
+	char const *name;	///< name of the instruction set
+};
+
+pixel_kernels const& select_pixel_kernels();
+
+
+#endif /* PIXEL_ARITHMETIC_HPP */
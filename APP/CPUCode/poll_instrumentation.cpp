@@ -0,0 +1,292 @@
+/** Counters and histograms of the polling loops that drive the DFEs
+    \file poll_instrumentation.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "poll_instrumentation.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "live_source.hpp"
+
+
+/// Create an empty histogram
+/** @param bucket_count Number of buckets
+    @param bucket_scale Mapping of values to buckets
+**/
+poll_histogram::poll_histogram(int bucket_count, scale bucket_scale)
+	: buckets_(bucket_count), scale_(bucket_scale)
+{}
+
+/// Write the buckets as a JSON array, up to the last bucket that is not empty
+/** @param out Stream to write to
+**/
+void poll_histogram::print_json(std::ostream& out) const
+{
+	size_t used = buckets_.size();
+	while(used > 1 && buckets_[used - 1].value() == 0) {
+		used--;
+	}
+	out << '[';
+	for(size_t i = 0; i < used; i++) {
+		out << (i ? ", " : "") << buckets_[i].value();
+	}
+	out << ']';
+}
+
+
+/// Create counters for an engine
+/** @param slot_recv_length Number of results in a slot of the output stream
+**/
+poll_counters::poll_counters(int slot_recv_length)
+	: recv_empty_runs(32, poll_histogram::log2), recv_batch(16, poll_histogram::log2), slot_fill(slot_recv_length + 1, poll_histogram::linear),
+	  frames_in_flight(16, poll_histogram::linear), localizations_per_frame(24, poll_histogram::log2),
+	  poll_cycles(40, poll_histogram::log2), slot_recv_length_(slot_recv_length), empty_run_(0), frame_localizations_(0),
+	  calibration_cycles_(cycle_clock::now()), calibration_ns_(monotonic_ns()), cpu_mark_ns_(0)
+{}
+
+/// Get the CPU time of the calling thread
+static uint64_t thread_cpu_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// Start measuring the CPU time of the polling thread, called by it before the first poll
+void poll_counters::start_cpu_time()
+{
+	cpu_mark_ns_ = thread_cpu_ns();
+}
+
+/// Add the CPU time of the polling thread since the last call or start_cpu_time(), called by it
+void poll_counters::add_cpu_time()
+{
+	uint64_t now = thread_cpu_ns();
+	cpu_ns.add(now - cpu_mark_ns_);
+	cpu_mark_ns_ = now;
+}
+
+/// Convert cycles of cycle_clock to nanoseconds
+/** @param cycles Number of cycles
+    @return Nanoseconds at the rate of the clock since the counters were created
+**/
+uint64_t poll_counters::cycles_to_ns(uint64_t cycles) const
+{
+	uint64_t elapsed_cycles = cycle_clock::now() - calibration_cycles_;
+	uint64_t elapsed_ns = monotonic_ns() - calibration_ns_;
+	return elapsed_cycles ? (uint64_t) ((double) cycles * elapsed_ns / elapsed_cycles) : 0;
+}
+
+/// Write the counters as a JSON object
+/** @param out Stream to write to
+**/
+void poll_counters::print_json(std::ostream& out) const
+{
+	out << "{\"polls\": " << polls.value()
+		<< ", \"send_slots\": " << send_slots.value()
+		<< ", \"send_stalls\": " << send_stalls.value()
+		<< ", \"send_starved\": " << send_starved.value()
+		<< ", \"images_sent\": " << images_sent.value()
+		<< ", \"recv_slots\": " << recv_slots.value()
+		<< ", \"recv_empty\": " << recv_empty.value()
+		<< ", \"end_of_images\": " << end_of_images.value()
+		<< ", \"localizations\": " << localizations.value()
+		<< ", \"send_ns\": " << cycles_to_ns(send_cycles.value())
+		<< ", \"recv_ns\": " << cycles_to_ns(recv_cycles.value())
+		<< ", \"pauses\": " << pauses.value()
+		<< ", \"sleeps\": " << sleeps.value()
+		<< ", \"sleep_ns\": " << sleep_ns.value()
+		<< ", \"cpu_ns\": " << cpu_ns.value()
+		<< ", \"ns_per_cycle\": " << (double) cycles_to_ns(1000000) / 1000000;
+	out << ", \"recv_empty_runs_log2\": ";
+	recv_empty_runs.print_json(out);
+	out << ", \"recv_batch_log2\": ";
+	recv_batch.print_json(out);
+	out << ", \"slot_fill\": ";
+	slot_fill.print_json(out);
+	out << ", \"frames_in_flight\": ";
+	frames_in_flight.print_json(out);
+	out << ", \"localizations_per_frame_log2\": ";
+	localizations_per_frame.print_json(out);
+	out << ", \"poll_cycles_log2\": ";
+	poll_cycles.print_json(out);
+	out << '}';
+}
+
+
+/// Start reporting
+/** @param target Path of a file, or "unix:" followed by the path of a Unix socket
+    @param interval_ms Interval between two lines written to a file
+    @param slot_recv_length Number of results in a slot of the output stream
+**/
+poll_instrumentation::poll_instrumentation(std::string const& target, int interval_ms, int slot_recv_length)
+	: listen_fd_(-1), interval_ms_(interval_ms), slot_recv_length_(slot_recv_length), start_ns_(monotonic_ns()),
+	  shutdown_(false)
+{
+	if(target.compare(0, 5, "unix:") == 0) {
+		path_ = target.substr(5);
+		struct sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if(path_.empty() || path_.size() >= sizeof(address.sun_path)) {
+			throw std::runtime_error("poll_instrumentation: invalid socket path '" + path_ + "'");
+		}
+		std::strcpy(address.sun_path, path_.c_str());
+
+		listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		unlink(path_.c_str());		// left over from an earlier run
+		if(listen_fd_ < 0 || bind(listen_fd_, (struct sockaddr*) &address, sizeof(address)) != 0
+				|| listen(listen_fd_, 4) != 0) {
+			std::string error = strerror(errno);
+			if(listen_fd_ >= 0) {
+				close(listen_fd_);
+			}
+			throw std::runtime_error("poll_instrumentation: " + path_ + ": " + error);
+		}
+	} else {
+		path_ = target;
+		std::ofstream file(path_.c_str(), std::ios::out | std::ios::trunc);
+		if(!file) {
+			throw std::runtime_error("poll_instrumentation: could not open '" + path_ + "'");
+		}
+	}
+
+	reporter_ = std::thread(&poll_instrumentation::report, this);
+}
+
+/// Stop reporting, a file receives the final counters
+poll_instrumentation::~poll_instrumentation()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		shutdown_ = true;
+	}
+	stop_.notify_all();
+	reporter_.join();
+
+	if(listen_fd_ >= 0) {
+		close(listen_fd_);
+		unlink(path_.c_str());
+	} else {
+		publish();
+	}
+}
+
+/// Get the counters of an engine, created on first use
+/** @param k Number of the engine
+    @return The counters, valid until the instrumentation is destroyed
+**/
+poll_counters& poll_instrumentation::engine(int k)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	while((int) engines_.size() <= k) {
+		engines_.push_back(std::unique_ptr<poll_counters>(new poll_counters(slot_recv_length_)));
+	}
+	return *engines_[k];
+}
+
+/// Write the counters of all engines as one line of JSON
+/** @param out Stream to write to
+**/
+void poll_instrumentation::print_json(std::ostream& out) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	out << "{\"time_s\": " << (monotonic_ns() - start_ns_) * 1e-9;
+	if(!policy_.empty()) {
+		out << ", \"policy\": \"" << policy_ << '"';
+	}
+	out << ", \"engines\": [";
+	for(size_t k = 0; k < engines_.size(); k++) {
+		out << (k ? ", " : "");
+		engines_[k]->print_json(out);
+	}
+	out << "]}\n";
+}
+
+/// Name the polling policy of the engines in the reports
+/** @param description Policy in the syntax of poll_policy::parse()
+**/
+void poll_instrumentation::set_policy(std::string const& description)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	policy_ = description;
+}
+
+/// Create the instrumentation for a specification given on the command line
+/** @param spec Target as for the constructor, optionally followed by a comma and the interval in milliseconds
+    @param slot_recv_length Number of results in a slot of the output stream
+    @return The instrumentation
+**/
+std::unique_ptr<poll_instrumentation> poll_instrumentation::create(std::string const& spec, int slot_recv_length)
+{
+	std::string target = spec;
+	int interval_ms = 1000;
+	size_t comma = spec.rfind(',');
+	if(comma != std::string::npos) {
+		target = spec.substr(0, comma);
+		interval_ms = atoi(spec.c_str() + comma + 1);
+		if(interval_ms < 1) {
+			throw std::runtime_error("poll_instrumentation: interval must be at least 1 ms");
+		}
+	}
+	return std::unique_ptr<poll_instrumentation>(new poll_instrumentation(target, interval_ms, slot_recv_length));
+}
+
+// private
+/// Reporter thread, writes the counters to the file in intervals or serves clients of the socket
+void poll_instrumentation::report()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while(!shutdown_) {
+		if(listen_fd_ < 0) {
+			stop_.wait_for(lock, std::chrono::milliseconds(interval_ms_));
+			if(!shutdown_) {
+				lock.unlock();
+				publish();
+				lock.lock();
+			}
+			continue;
+		}
+
+		lock.unlock();
+		struct pollfd listener = {listen_fd_, POLLIN, 0};
+		if(::poll(&listener, 1, 100) > 0) {		// wakes up regularly to check for shutdown
+			int client = accept(listen_fd_, 0, 0);
+			if(client >= 0) {
+				std::ostringstream json;
+				print_json(json);
+				std::string text = json.str();
+				for(size_t done = 0; done < text.size(); ) {
+					ssize_t n = send(client, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+					if(n <= 0) {
+						break;		// the client went away
+					}
+					done += n;
+				}
+				close(client);
+			}
+		}
+		lock.lock();
+	}
+}
+
+/// Append the counters to the file
+void poll_instrumentation::publish()
+{
+	std::ostringstream json;
+	print_json(json);
+	std::ofstream file(path_.c_str(), std::ios::out | std::ios::app);
+	file << json.str();
+}
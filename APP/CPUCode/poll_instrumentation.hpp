@@ -0,0 +1,248 @@
+/** Counters and histograms of the polling loops that drive the DFEs
+    \file poll_instrumentation.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef POLL_INSTRUMENTATION_HPP
+#define POLL_INSTRUMENTATION_HPP
+
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spdm_types.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/// Cheapest monotonic time stamp of the platform, the time stamp counter on x86
+namespace cycle_clock
+{
+	/// Read the clock
+	/** @return Cycles on x86, nanoseconds otherwise
+	**/
+	inline uint64_t now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+}
+
+/// Counter with a single writer thread and any number of reader threads
+/** The writer increments without a locked instruction, readers never see a torn value.
+**/
+class poll_counter
+{
+public:
+	poll_counter() : value_(0) {}
+	void add(uint64_t n) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+	poll_counter(poll_counter const&);		// no copying
+	poll_counter& operator=(const poll_counter&);
+
+	std::atomic<uint64_t> value_;
+};
+
+/// Histogram with a single writer thread, with linear buckets or buckets by powers of two
+class poll_histogram
+{
+public:
+	/// Bucket of a value
+	enum scale {
+		linear,			///< value, the last bucket collects all larger values
+		log2			///< number of significant bits of the value, 0 for 0
+	};
+
+	poll_histogram(int bucket_count, scale bucket_scale);
+	void add(uint64_t value)
+	{
+		int bucket;
+		if(scale_ == linear) {
+			bucket = value < (uint64_t) buckets_.size() ? (int) value : (int) buckets_.size() - 1;
+		} else {
+			bucket = value ? 64 - __builtin_clzll(value) : 0;
+			bucket = bucket < (int) buckets_.size() ? bucket : (int) buckets_.size() - 1;
+		}
+		buckets_[bucket].add(1);
+	}
+	void print_json(std::ostream& out) const;
+
+private:
+	poll_histogram(poll_histogram const&);		// no copying
+	poll_histogram& operator=(const poll_histogram&);
+
+	std::vector<poll_counter> buckets_;
+	scale scale_;
+};
+
+/// Counters of the polling loop of one DFE, updated by its polling thread
+/** Times are measured with cycle_clock and converted to nanoseconds with a rate calibrated against
+    CLOCK_MONOTONIC over the lifetime of the counters.
+**/
+class poll_counters
+{
+public:
+	explicit poll_counters(int slot_recv_length);
+
+	/// Record one iteration of the polling loop
+	/** @param start Cycles at the start of the iteration
+	    @param sent Cycles after sending
+	    @param end Cycles after receiving
+	    @param have_pixels True iff pixels were waiting to be sent
+	    @param slots_sent Number of slots of pixels sent
+	    @param image_sent True iff the slots completed an image
+	    @param results Received slots of results, null if none
+	    @param slots_received Number of slots received
+	**/
+	void record_poll(uint64_t start, uint64_t sent, uint64_t end, bool have_pixels, int slots_sent, bool image_sent,
+			estimator_result const* results, int slots_received)
+	{
+		polls.add(1);
+		send_cycles.add(sent - start);
+		recv_cycles.add(end - sent);
+		poll_cycles.add(end - start);
+
+		if(slots_sent) {
+			send_slots.add(slots_sent);
+			images_sent.add(image_sent);
+		} else {
+			(have_pixels ? send_stalls : send_starved).add(1);
+		}
+
+		if(!results) {
+			recv_empty.add(1);
+			empty_run_++;
+			return;
+		}
+		recv_slots.add(slots_received);
+		recv_batch.add(slots_received);
+		recv_empty_runs.add(empty_run_);
+		empty_run_ = 0;
+
+		for(int slot = 0; slot < slots_received; slot++, results += slot_recv_length_) {
+			int fill = 0;
+			for(int i = 0; i < slot_recv_length_; i++) {
+				if(results[i].img >= 0) {
+					fill++;
+					frame_localizations_++;
+				} else if(results[i].img == end_of_image) {
+					end_of_images.add(1);
+					localizations_per_frame.add(frame_localizations_);
+					frame_localizations_ = 0;
+				}
+			}
+			localizations.add(fill);
+			slot_fill.add(fill);
+		}
+		// the indicator of an image is emitted at the pixel roi_radius before its end, so it can arrive before
+		// the last slots of the image are sent
+		int64_t in_flight = (int64_t) images_sent.value() - (int64_t) end_of_images.value();
+		frames_in_flight.add(in_flight > 0 ? in_flight : 0);
+	}
+
+	/// Record a wait of the polling thread after a poll without progress
+	/** @param slept_ns Time slept, 0 if the thread paused
+	**/
+	void record_wait(uint64_t slept_ns)
+	{
+		if(slept_ns) {
+			sleeps.add(1);
+			sleep_ns.add(slept_ns);
+		} else {
+			pauses.add(1);
+		}
+	}
+
+	void start_cpu_time();
+	void add_cpu_time();
+	uint64_t cycles_to_ns(uint64_t cycles) const;
+	void print_json(std::ostream& out) const;
+
+	poll_counter polls;						///< iterations of the polling loop
+	poll_counter send_slots;				///< slots of pixels sent
+	poll_counter send_stalls;				///< iterations with pixels that found no free slot
+	poll_counter send_starved;				///< iterations without pixels to send, the readers are behind
+	poll_counter images_sent;				///< images sent completely
+	poll_counter recv_slots;				///< slots of results received
+	poll_counter recv_empty;				///< iterations without results
+	poll_counter end_of_images;				///< end of image indicators received
+	poll_counter localizations;				///< results received, without indicators
+	poll_counter send_cycles;				///< cycles spent sending
+	poll_counter recv_cycles;				///< cycles spent receiving
+	poll_counter pauses;					///< waits with pause instructions after polls without progress
+	poll_counter sleeps;					///< sleeps after polls without progress
+	poll_counter sleep_ns;					///< time slept
+	poll_counter cpu_ns;					///< CPU time of the polling thread while polling
+	poll_histogram recv_empty_runs;			///< consecutive iterations without results before a slot, by powers of two
+	poll_histogram recv_batch;				///< slots received together, by powers of two
+	poll_histogram slot_fill;				///< results in a received slot
+	poll_histogram frames_in_flight;		///< images sent whose end of image indicator has not arrived, per slot received
+	poll_histogram localizations_per_frame;	///< results per image, by powers of two
+	poll_histogram poll_cycles;				///< cycles per iteration, by powers of two
+
+private:
+	poll_counters(poll_counters const&);		// no copying
+	poll_counters& operator=(const poll_counters&);
+
+	int slot_recv_length_;
+	uint64_t empty_run_;
+	uint64_t frame_localizations_;
+	uint64_t calibration_cycles_;
+	uint64_t calibration_ns_;
+	uint64_t cpu_mark_ns_;
+};
+
+/// Counters of all engines of a run, reported periodically to a file or a Unix socket
+/** A file receives one JSON object per line and interval, and a final one when reporting stops. A Unix
+    socket sends the latest JSON object to every client that connects, e.g. with socat - UNIX:path.
+**/
+class poll_instrumentation
+{
+public:
+	poll_instrumentation(std::string const& target, int interval_ms, int slot_recv_length);
+	~poll_instrumentation();
+
+	poll_counters& engine(int k);
+	void print_json(std::ostream& out) const;
+	void set_policy(std::string const& description);
+
+	static std::unique_ptr<poll_instrumentation> create(std::string const& spec, int slot_recv_length);
+
+private:
+	poll_instrumentation(poll_instrumentation const&);		// no copying
+	poll_instrumentation& operator=(const poll_instrumentation&);
+
+	void report();
+	void publish();
+
+	std::vector<std::unique_ptr<poll_counters> > engines_;
+	mutable std::mutex mutex_;
+	std::condition_variable stop_;
+	std::thread reporter_;
+	std::string path_;
+	std::string policy_;
+	int listen_fd_;
+	int interval_ms_;
+	int slot_recv_length_;
+	uint64_t start_ns_;
+	bool shutdown_;
+};
+
+
+#endif /* POLL_INSTRUMENTATION_HPP */
@@ -0,0 +1,233 @@
+/** Waiting and CPU affinity of the threads that drive the DFEs
+    \file poll_policy.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "poll_policy.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live_source.hpp"
+
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32 bit integers");
+
+/// Parse a list of cores like "0-3,8", with a separator other than the comma if given
+/** @param list The list
+    @param separator Character between the ranges
+    @return The cores in the order given
+**/
+static std::vector<int> parse_cpu_list(std::string const& list, char separator)
+{
+	std::vector<int> cpus;
+	std::istringstream in(list);
+	std::string range;
+	while(std::getline(in, range, separator)) {
+		if(range.empty() || range == "\n") {
+			continue;
+		}
+		char *end = 0;
+		long first = strtol(range.c_str(), &end, 10);
+		long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+		if(end == range.c_str() || (*end && *end != '\n') || first < 0 || last < first) {
+			throw std::runtime_error("poll_policy: invalid list of cores '" + list + "'");
+		}
+		for(long cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+/// Let the core run a sibling hyperthread for a moment
+static inline void cpu_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+
+/// Create the default policy, spinning on any core
+poll_policy::poll_policy()
+	: wait_mode(spin), spin_polls(1000), max_pauses(64), max_sleep_us(200), numa_node(-1)
+{}
+
+/// Describe the policy in the syntax of parse()
+std::string poll_policy::description() const
+{
+	std::ostringstream out;
+	out << (wait_mode == spin ? "spin" : wait_mode == pause ? "pause" : "sleep");
+	if(wait_mode == pause) {
+		out << ",spin=" << spin_polls << ",max_pauses=" << max_pauses;
+	} else if(wait_mode == sleep) {
+		out << ",spin=" << spin_polls << ",max_us=" << max_sleep_us;
+	}
+	if(!cpus.empty()) {
+		out << ",cpu=";
+		for(size_t i = 0; i < cpus.size(); i++) {
+			out << (i ? "+" : "") << cpus[i];
+		}
+	} else if(numa_node >= 0) {
+		out << ",node=" << numa_node;
+	}
+	return out.str();
+}
+
+/// Parse a policy given on the command line
+/** @param spec spin, pause or sleep, optionally followed by spin=polls, max_pauses=n, max_us=microseconds,
+               cpu=cores with ranges separated by + (e.g. cpu=2+4-6) and node=numa node, separated by commas
+    @return The policy
+**/
+poll_policy poll_policy::parse(std::string const& spec)
+{
+	poll_policy policy;
+	std::istringstream list(spec);
+	std::string item;
+	bool first = true;
+	while(std::getline(list, item, ',')) {
+		if(first) {
+			first = false;
+			if(item == "spin") {
+				policy.wait_mode = spin;
+			} else if(item == "pause") {
+				policy.wait_mode = pause;
+			} else if(item == "sleep") {
+				policy.wait_mode = sleep;
+			} else {
+				throw std::runtime_error("poll_policy: expected spin, pause or sleep, got '" + item + "'");
+			}
+			continue;
+		}
+
+		size_t equals = item.find('=');
+		if(equals == std::string::npos) {
+			throw std::runtime_error("poll_policy: expected key=value, got '" + item + "'");
+		}
+		std::string key = item.substr(0, equals);
+		std::string value = item.substr(equals + 1);
+
+		if(key == "spin") {
+			policy.spin_polls = atoi(value.c_str());
+		} else if(key == "max_pauses") {
+			policy.max_pauses = atoi(value.c_str());
+		} else if(key == "max_us") {
+			policy.max_sleep_us = atoi(value.c_str());
+		} else if(key == "cpu") {
+			policy.cpus = parse_cpu_list(value, '+');
+		} else if(key == "node") {
+			policy.numa_node = atoi(value.c_str());
+		} else {
+			throw std::runtime_error("poll_policy: unknown parameter '" + key + "'");
+		}
+	}
+
+	if(policy.spin_polls < 0 || policy.max_pauses < 1 || policy.max_sleep_us < 1) {
+		throw std::runtime_error("poll_policy: spin < 0 || max_pauses < 1 || max_us < 1");
+	}
+	return policy;
+}
+
+/// Pin the calling thread to the cores of a policy
+/** @param policy The policy
+    @param engine Number of the engine the thread drives, selects the core if several are given
+**/
+void pin_thread(poll_policy const& policy, int engine)
+{
+	std::vector<int> cpus;
+	if(!policy.cpus.empty()) {
+		cpus.push_back(policy.cpus[engine % policy.cpus.size()]);
+	} else if(policy.numa_node >= 0) {
+		std::ostringstream path;
+		path << "/sys/devices/system/node/node" << policy.numa_node << "/cpulist";
+		std::ifstream file(path.str().c_str());
+		std::string list;
+		if(!std::getline(file, list)) {
+			throw std::runtime_error("poll_policy: could not read " + path.str());
+		}
+		cpus = parse_cpu_list(list, ',');
+	} else {
+		return;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(size_t i = 0; i < cpus.size(); i++) {
+		if(cpus[i] >= CPU_SETSIZE) {
+			throw std::runtime_error("poll_policy: core number too large");
+		}
+		CPU_SET(cpus[i], &set);
+	}
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(ret) {
+		throw std::runtime_error(std::string("pthread_setaffinity_np: ") + strerror(ret));
+	}
+}
+
+
+/// Start with a policy
+/** @param policy The policy
+**/
+poll_backoff::poll_backoff(poll_policy const& policy)
+	: policy_(policy), idle_polls_(0), backoff_(1)
+{}
+
+/// Wait after a poll without progress as the policy says
+/** @param wake_word Futex word that changes and is woken when the next image is ready
+    @param seen Value of the word before the poll
+    @param slept_ns Receives the time slept, 0 if the thread did not sleep
+    @return True iff the thread paused or slept
+**/
+bool poll_backoff::idle(std::atomic<uint32_t>& wake_word, uint32_t seen, uint64_t& slept_ns)
+{
+	slept_ns = 0;
+	if(policy_.wait_mode == poll_policy::spin) {
+		return false;
+	}
+	if(idle_polls_ < policy_.spin_polls) {
+		idle_polls_++;
+		return false;
+	}
+	if(idle_polls_ == policy_.spin_polls) {		// first wait after spinning
+		idle_polls_++;
+		backoff_ = 1;
+	}
+
+	if(policy_.wait_mode == poll_policy::pause) {
+		for(int i = 0; i < backoff_; i++) {
+			cpu_pause();
+		}
+		backoff_ = std::min(2 * backoff_, policy_.max_pauses);
+		return true;
+	}
+
+	uint64_t start_ns = monotonic_ns();
+	struct timespec timeout = {backoff_ / 1000000, backoff_ % 1000000 * 1000L};
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&wake_word), FUTEX_WAIT_PRIVATE, seen, &timeout, 0, 0);
+	slept_ns = monotonic_ns() - start_ns;
+	backoff_ = std::min(2 * backoff_, policy_.max_sleep_us);
+	return true;
+}
+
+/// Wake all threads sleeping on a futex word
+/** @param word The word, changed by the caller before
+**/
+void futex_wake_all(std::atomic<uint32_t>& word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+}
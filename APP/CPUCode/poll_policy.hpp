@@ -0,0 +1,69 @@
+/** Waiting and CPU affinity of the threads that drive the DFEs
+    \file poll_policy.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef POLL_POLICY_HPP
+#define POLL_POLICY_HPP
+
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+
+/// How the thread driving a DFE waits while polls make no progress, and where it runs
+/** The low-latency interface has no notification, so the thread polls. After spin_polls polls without
+    progress, it either keeps spinning, executes pause instructions between the polls, or sleeps on a
+    futex that a reader wakes when the next image is ready, at most max_sleep_us at a time. Pauses and
+    sleeps grow exponentially while no progress is made.
+**/
+struct poll_policy
+{
+	/// Behavior after spin_polls polls without progress
+	enum mode {
+		spin,			///< poll at full speed, lowest latency
+		pause,			///< pause instructions between the polls, frees the sibling hyperthread
+		sleep			///< sleep on a futex, frees the core
+	};
+
+	mode wait_mode;				///< behavior after spin_polls polls without progress
+	int spin_polls;				///< polls without progress before pausing or sleeping
+	int max_pauses;				///< largest number of pause instructions between two polls
+	int max_sleep_us;			///< longest sleep between two polls in microseconds
+	std::vector<int> cpus;		///< cores the driver threads are pinned to, engine k to cpus[k % size], empty for any
+	int numa_node;				///< node whose cores the driver threads may run on if no cores are given, -1 for any
+
+	poll_policy();
+	std::string description() const;
+
+	static poll_policy parse(std::string const& spec);
+};
+
+void pin_thread(poll_policy const& policy, int engine);
+
+/// Waiting of one driver thread according to a policy
+class poll_backoff
+{
+public:
+	explicit poll_backoff(poll_policy const& policy);
+
+	/// Reset the backoff after a poll that made progress
+	void progress()
+	{
+		idle_polls_ = 0;
+	}
+
+	bool idle(std::atomic<uint32_t>& wake_word, uint32_t seen, uint64_t& slept_ns);
+
+private:
+	poll_policy policy_;
+	int idle_polls_;
+	int backoff_;				///< pauses or microseconds of the next wait
+};
+
+void futex_wake_all(std::atomic<uint32_t>& word);
+
+
+#endif /* POLL_POLICY_HPP */
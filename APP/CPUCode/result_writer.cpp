@@ -0,0 +1,290 @@
+/** Output backends for the estimator results
+    \file result_writer.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "result_writer.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+
+result_writer::~result_writer()
+{}
+
+/// Create the output backend for a format
+/** @param format "tsv" for text or "bin" for the binary columnar format
+    @param out Stream to write to, opened in binary mode for "bin"
+    @param scalars Scalar values of the run, stored in the header of the binary format
+    @return The writer
+**/
+std::unique_ptr<result_writer> result_writer::create(std::string const& format, std::ostream& out, dfe_scalars const& scalars)
+{
+	if(format == "tsv") {
+		return std::unique_ptr<result_writer>(new tsv_writer(out));
+	} else if(format == "bin") {
+		return std::unique_ptr<result_writer>(new columnar_writer(out, scalars));
+	}
+	throw std::runtime_error("result_writer: unknown output format '" + format + "'");
+}
+
+
+/// Width of a column of the text output
+static const int column_width = 10;
+
+/// Upper bound of the length of a line of the text output
+static const size_t max_line_length = 256;
+
+/// Copy a formatted number right-aligned to column_width characters
+/** @param text The number
+    @param length Length of the number
+    @param out Output position
+    @return Position after the column
+**/
+static char* write_column(char const* text, int length, char* out)
+{
+	for(int i = length; i < column_width; i++) {
+		*out++ = ' ';
+	}
+	std::memcpy(out, text, length);
+	return out + length;
+}
+
+/// Format an unsigned integer
+/** @param value The number
+    @param digits Minimum number of digits, padded with leading zeros
+    @param out Output position
+    @return Position after the number
+**/
+static char* format_unsigned(uint64_t value, int digits, char* out)
+{
+	char reversed[20];
+	int length = 0;
+	do {
+		reversed[length++] = '0' + value % 10;
+		value /= 10;
+	} while(value || length < digits);
+
+	while(length) {
+		*out++ = reversed[--length];
+	}
+	return out;
+}
+
+/// Format a float like std::ostream with default flags and precision, that is like printf("%g")
+/** Values printed without exponent are formatted directly, others with snprintf.
+    @param value The number
+    @param out Output buffer with space for at least 32 characters
+    @return Length of the formatted number
+**/
+static int format_float(float value, char* out)
+{
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10};
+	static const uint64_t pow10_int[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+	const int precision = 6;
+
+	double magnitude = std::fabs((double) value);
+	if(!(magnitude >= 1e-4 && magnitude < 999999.5)) {		// also catches zero, infinity and NaN
+		return snprintf(out, 32, "%g", value);
+	}
+
+	// six significant digits, rounded to nearest even like printf in the default rounding mode
+	int exponent = (int) std::floor(std::log10(magnitude));
+	uint64_t digits = (uint64_t) std::nearbyint(magnitude * pow10[precision - 1 - exponent]);
+	if(digits >= pow10_int[precision]) {
+		exponent++;
+		digits = (uint64_t) std::nearbyint(magnitude * pow10[precision - 1 - exponent]);
+	} else if(digits < pow10_int[precision - 1]) {
+		exponent--;
+		digits = (uint64_t) std::nearbyint(magnitude * pow10[precision - 1 - exponent]);
+	}
+	if(exponent < -4 || exponent >= precision || digits >= pow10_int[precision] || digits < pow10_int[precision - 1]) {
+		return snprintf(out, 32, "%g", value);
+	}
+
+	int decimals = precision - 1 - exponent;
+	uint64_t integer = digits / pow10_int[decimals];
+	uint64_t fraction = digits % pow10_int[decimals];
+	while(decimals > 0 && fraction % 10 == 0) {
+		fraction /= 10;
+		decimals--;
+	}
+
+	char *end = out;
+	if(value < 0) {
+		*end++ = '-';
+	}
+	end = format_unsigned(integer, 1, end);
+	if(decimals > 0) {
+		*end++ = '.';
+		end = format_unsigned(fraction, decimals, end);
+	}
+	return end - out;
+}
+
+/// Create a text writer
+/** @param out Stream to write to
+**/
+tsv_writer::tsv_writer(std::ostream& out)
+	: out_(out), buffer_(buffer_size), used_(0)
+{}
+
+tsv_writer::~tsv_writer()
+{
+	finish();
+}
+
+/// Format results into the buffer, the buffer is written when it is full
+/** @param results Array with results
+    @param length Length of the array
+**/
+void tsv_writer::write(estimator_result const* results, int length)
+{
+	char number[32];
+	for(int i = 0; i < length; i++) {
+		estimator_result const& result = results[i];
+		if(result.img < 0) {
+			continue;
+		}
+
+		if(used_ + max_line_length > buffer_.size()) {
+			out_.write(&buffer_[0], used_);
+			used_ = 0;
+		}
+
+		char *line = &buffer_[used_];
+		char *p = line;
+		*p++ = '0';
+		float const fields[] = {result.mu_y, result.mu_x, result.delta_mu_y, result.delta_mu_x,
+				result.sigma_y, result.sigma_x, result.Q};
+		for(size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+			*p++ = '\t';
+			p = write_column(number, format_float(fields[f], number), p);
+		}
+		*p++ = '\t';
+		p = write_column(number, snprintf(number, sizeof(number), "%d", result.img), p);
+		*p++ = '\n';
+
+		used_ += p - line;
+	}
+}
+
+/// Write the buffered lines, for consumers that read the results while they are produced
+void tsv_writer::flush()
+{
+	if(used_) {
+		out_.write(&buffer_[0], used_);
+		used_ = 0;
+	}
+	out_.flush();
+}
+
+/// Write the buffered lines
+void tsv_writer::finish()
+{
+	flush();
+}
+
+
+/// Create a binary writer and write the header
+/** @param out Stream to write to, must be opened in binary mode
+    @param scalars Scalar values of the run
+**/
+columnar_writer::columnar_writer(std::ostream& out, dfe_scalars const& scalars)
+	: out_(out), finished_(false)
+{
+	columnar_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "SPDMLOC1", sizeof(header.magic));
+	header.header_size = sizeof(header);
+	header.field_count = field_count;
+	header.nm_per_px = scalars.nm_per_px;
+	header.img_width = scalars.img_width;
+	header.img_height = scalars.img_height;
+	header.total_images = scalars.total_images;
+	header.block_length = block_length;
+	out_.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+	for(int f = 0; f < field_count - 1; f++) {
+		columns_[f].reserve(block_length);
+	}
+	img_.reserve(block_length);
+}
+
+columnar_writer::~columnar_writer()
+{
+	finish();
+}
+
+/// Split results into columns, a block is written when it is full
+/** @param results Array with results
+    @param length Length of the array
+**/
+void columnar_writer::write(estimator_result const* results, int length)
+{
+	if(finished_) {
+		throw std::runtime_error("columnar_writer: write() after finish()");
+	}
+
+	for(int i = 0; i < length; i++) {
+		estimator_result const& result = results[i];
+		if(result.img < 0) {
+			continue;
+		}
+
+		columns_[0].push_back(result.mu_y);
+		columns_[1].push_back(result.mu_x);
+		columns_[2].push_back(result.delta_mu_y);
+		columns_[3].push_back(result.delta_mu_x);
+		columns_[4].push_back(result.sigma_y);
+		columns_[5].push_back(result.sigma_x);
+		columns_[6].push_back(result.Q);
+		img_.push_back(result.img);
+
+		if(img_.size() == block_length) {
+			write_block();
+		}
+	}
+}
+
+/// Write the buffered results as a block, which may be shorter than block_length
+void columnar_writer::flush()
+{
+	if(finished_) {
+		return;
+	}
+	if(!img_.empty()) {
+		write_block();
+	}
+	out_.flush();
+}
+
+/// Write the last block and the end of the file
+void columnar_writer::finish()
+{
+	if(finished_) {
+		return;
+	}
+	if(!img_.empty()) {
+		write_block();
+	}
+	write_block();		// empty block terminates the file
+	out_.flush();
+	finished_ = true;
+}
+
+// private
+/// Write the buffered results as one block and clear the columns
+void columnar_writer::write_block()
+{
+	uint32_t count = img_.size();
+	out_.write(reinterpret_cast<char const*>(&count), sizeof(count));
+	for(int f = 0; f < field_count - 1; f++) {
+		out_.write(reinterpret_cast<char const*>(columns_[f].data()), count * sizeof(float));
+		columns_[f].clear();
+	}
+	out_.write(reinterpret_cast<char const*>(img_.data()), count * sizeof(int32_t));
+	img_.clear();
+}
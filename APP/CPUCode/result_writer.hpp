@@ -0,0 +1,97 @@
+/** Output backends for the estimator results
+    \file result_writer.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef RESULT_WRITER_HPP
+#define RESULT_WRITER_HPP
+
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "spdm_types.hpp"
+
+
+/// Writes estimator results, skipping the end of image and last pixel indicators
+class result_writer
+{
+public:
+	virtual ~result_writer();
+	virtual void write(estimator_result const* results, int length) = 0;
+	virtual void flush() = 0;
+	virtual void finish() = 0;
+
+	static std::unique_ptr<result_writer> create(std::string const& format, std::ostream& out, dfe_scalars const& scalars);
+};
+
+/// Text output, one line per result with tab separated columns
+/** The columns are a zero, mu_y, mu_x, delta_mu_y, delta_mu_x, sigma_y, sigma_x, Q and img, each
+    right-aligned to ten characters. Numbers are formatted like std::ostream with default precision.
+**/
+class tsv_writer : public result_writer
+{
+public:
+	explicit tsv_writer(std::ostream& out);
+	~tsv_writer();
+	void write(estimator_result const* results, int length);
+	void flush();
+	void finish();
+
+	static const size_t buffer_size = 1 << 20;
+
+private:
+	tsv_writer(tsv_writer const&);		// no copying
+	tsv_writer& operator=(const tsv_writer&);
+
+	std::ostream& out_;
+	std::vector<char> buffer_;
+	size_t used_;
+};
+
+/// Header of the binary columnar format, all values in host byte order
+struct columnar_header
+{
+	char magic[8];				///< "SPDMLOC1"
+	uint32_t header_size;		///< size of this header in bytes
+	uint32_t field_count;		///< number of columns in each block
+	double nm_per_px;			///< size of an object that covers one pixel in nanometers
+	uint32_t img_width;			///< width in pixels of each image frame
+	uint32_t img_height;		///< height in pixels of each image frame
+	uint32_t total_images;		///< number of images in the stack
+	uint32_t block_length;		///< maximum number of results in a block
+};
+
+/// Binary output in blocks of columns
+/** The header is followed by blocks. Each block starts with the uint32_t number of results n, followed by
+    n values of each field: float mu_y, mu_x, delta_mu_y, delta_mu_x, sigma_y, sigma_x, Q and int32_t img.
+    A block with n = 0 ends the file.
+**/
+class columnar_writer : public result_writer
+{
+public:
+	columnar_writer(std::ostream& out, dfe_scalars const& scalars);
+	~columnar_writer();
+	void write(estimator_result const* results, int length);
+	void flush();
+	void finish();
+
+	static const int field_count = 8;
+	static const uint32_t block_length = 1 << 16;
+
+private:
+	columnar_writer(columnar_writer const&);		// no copying
+	columnar_writer& operator=(const columnar_writer&);
+
+	void write_block();
+
+	std::ostream& out_;
+	std::vector<float> columns_[field_count - 1];
+	std::vector<int32_t> img_;
+	bool finished_;
+};
+
+
+#endif /* RESULT_WRITER_HPP */
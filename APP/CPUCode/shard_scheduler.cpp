@@ -0,0 +1,192 @@
+/** Splitting an image stack across several DFEs
+    \file shard_scheduler.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "shard_scheduler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <MaxSLiCInterface.h>
+
+#include "SpdmCpuCode.hpp"
+#include "result_writer.hpp"
+
+
+/// Split a stack into contiguous ranges of about the same number of images
+/** @param total_images Number of images in the stack
+    @param shard_count Number of ranges, at most one per image
+    @param warmup_images Number of images streamed before each range, if the stack has them
+    @return The ranges in the order of the stack
+**/
+std::vector<stack_shard> split_stack(int total_images, int shard_count, int warmup_images)
+{
+	shard_count = std::max(1, std::min(shard_count, total_images));
+
+	std::vector<stack_shard> shards(shard_count);
+	for(int k = 0; k < shard_count; k++) {
+		stack_shard& shard = shards[k];
+		shard.begin = (long) total_images * k / shard_count;
+		shard.end = (long) total_images * (k + 1) / shard_count;
+		shard.first_image = std::max(0, shard.begin - warmup_images);
+		shard.streamed_images = std::min(total_images, shard.end + 1) - shard.first_image;
+	}
+	return shards;
+}
+
+
+/// Results of one engine, passed from its polling thread to the thread writing the results in order
+struct shard_output
+{
+	std::mutex mutex;							///< protects all members
+	std::condition_variable changed;			///< notified when results are added or the engine is done
+	std::vector<estimator_result> results;		///< results not written yet
+	bool done;									///< true when the engine has sent its last results
+	std::exception_ptr error;					///< exception of the polling thread
+};
+
+/// Poll an engine until it is done and keep the results in the range of its shard
+/** @param run The stream through the engine
+    @param shard The range of the stack
+    @param stop Set when any engine fails, the others then stop polling and are done
+    @param output Receives the results with image numbers of the stack
+**/
+static void poll_shard(dfe_stream_run& run, stack_shard const& shard, std::atomic<bool>& stop, shard_output& output)
+{
+	try {
+		std::vector<estimator_result> kept;
+		while(!run.finished() && !stop) {		// active polling, required by the low-latency interface
+			int length;
+			estimator_result const* results = run.poll(length);
+			if(!results) {
+				continue;
+			}
+
+			for(int i = 0; i < length; i++) {
+				estimator_result result = results[i];
+				if(result.img < 0) {
+					continue;		// indicators of the parts of the stack end elsewhere
+				}
+				result.img += shard.first_image;
+				if(result.img >= shard.begin && result.img < shard.end) {
+					kept.push_back(result);
+				}
+			}
+
+			if(!kept.empty()) {
+				std::lock_guard<std::mutex> lock(output.mutex);
+				output.results.insert(output.results.end(), kept.begin(), kept.end());
+				kept.clear();
+				output.changed.notify_one();
+			}
+		}
+	} catch(...) {
+		std::lock_guard<std::mutex> lock(output.mutex);
+		output.error = std::current_exception();
+		stop = true;
+	}
+
+	std::lock_guard<std::mutex> lock(output.mutex);
+	output.done = true;
+	output.changed.notify_one();
+}
+
+/// Write the results of a shard as the engine sends them, until it is done
+/** @param output The results of the shard
+    @param writer Output backend for the results
+**/
+static void write_shard(shard_output& output, result_writer& writer)
+{
+	std::vector<estimator_result> results;
+	while(true) {
+		bool done;
+		{
+			std::unique_lock<std::mutex> lock(output.mutex);
+			output.changed.wait(lock, [&] { return output.done || !output.results.empty(); });
+			results.swap(output.results);
+			done = output.done;
+		}
+
+		if(!results.empty()) {
+			writer.write(results.data(), results.size());
+			results.clear();
+		} else if(done) {
+			return;
+		}
+	}
+}
+
+/// Stream a stack through several DFEs at once, each processing a contiguous range of images
+/** Each engine is driven by its own polling thread. The results are written in the order of the
+    stack, results of the first range as they arrive and those of later ranges once the earlier
+    ranges are written. Ranges that start at the first image of the stack give the same results as a
+    single engine. After the warm-up images of later ranges the background only differs by the rounding
+    of the moving average, so intensities differ slightly and a few signals at the threshold change.
+    If an engine fails, the others stop, so no results pile up that are never written.
+    @param config The DFE configuration
+    @param engines The loaded DFEs, configured here for the stack
+    @param tiff The image stack
+    @param scalars Scalar values of the DFE configuration for the whole stack
+    @param options Options of the run
+    @param writer Output backend for the results
+**/
+void run_dfe_sharded(dfe_config const& config, std::vector<dataflow_engine*> const& engines, tiff_container& tiff,
+		dfe_scalars const& scalars, run_options const& options, result_writer& writer)
+{
+	check_dfe_limits(config, tiff, scalars);
+
+	std::vector<stack_shard> shards = split_stack(scalars.total_images, engines.size(), options.warmup_images);
+
+	std::vector<std::unique_ptr<image_prefetcher> > prefetchers;
+	std::vector<std::unique_ptr<dfe_stream_run> > runs;
+	for(size_t k = 0; k < shards.size(); k++) {
+		stack_shard const& shard = shards[k];
+		std::cerr << "Engine " << k << " images                            :  " << shard.begin << " - " << shard.end - 1
+				  << ", streamed from " << shard.first_image << std::endl;
+
+		dfe_scalars shard_scalars = scalars;
+		shard_scalars.total_images = shard.streamed_images;
+		shard_scalars.start_image = shard.begin - shard.first_image;		// suppresses the results of the warm-up images
+		engines[k]->configure(shard_scalars);
+		prefetchers.push_back(std::unique_ptr<image_prefetcher>(new image_prefetcher(
+				tiff, shard.first_image, shard.streamed_images, options.prefetch_depth, options.reader_count,
+				!options.copy_slots)));
+		runs.push_back(std::unique_ptr<dfe_stream_run>(new dfe_stream_run(*engines[k], *prefetchers[k], shard_scalars,
+				options.recv_slot_count)));
+		runs.back()->set_policy(options.policy, k);
+		if(options.instrumentation) {
+			runs.back()->set_counters(&options.instrumentation->engine(k));
+		}
+	}
+
+	std::vector<shard_output> outputs(shards.size());
+	std::vector<std::thread> pollers;
+	std::atomic<bool> stop(false);
+	for(size_t k = 0; k < shards.size(); k++) {
+		outputs[k].done = false;
+		pollers.push_back(std::thread(poll_shard, std::ref(*runs[k]), std::cref(shards[k]), std::ref(stop),
+				std::ref(outputs[k])));
+	}
+
+	for(size_t k = 0; k < shards.size() && !stop; k++) {
+		write_shard(outputs[k], writer);
+	}
+
+	for(size_t k = 0; k < pollers.size(); k++) {
+		pollers[k].join();
+	}
+	for(size_t k = 0; k < shards.size(); k++) {
+		if(outputs[k].error) {
+			std::rethrow_exception(outputs[k].error);
+		}
+		std::cerr << "Engine " << k << std::endl;
+		print_prefetch_stats(prefetchers[k]->stats());
+	}
+}
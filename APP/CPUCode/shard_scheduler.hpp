@@ -0,0 +1,40 @@
+/** Splitting an image stack across several DFEs
+    \file shard_scheduler.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef SHARD_SCHEDULER_HPP
+#define SHARD_SCHEDULER_HPP
+
+
+#include <vector>
+
+#include "spdm_types.hpp"
+
+
+class dfe_config;
+class dataflow_engine;
+class result_writer;
+class tiff_container;
+struct run_options;
+
+/// Contiguous range of images of a stack processed by one engine
+/** The engine is fed warm-up images before the range, so the moving-average background has converged,
+    and the image after the range, which completes the signals in the last rows of the range. Only
+    results of images in [begin, end) are kept.
+**/
+struct stack_shard
+{
+	int first_image;		///< first image streamed to the engine
+	int begin;				///< first image whose results are kept
+	int end;				///< image after the last image whose results are kept
+	int streamed_images;	///< number of images streamed to the engine
+};
+
+std::vector<stack_shard> split_stack(int total_images, int shard_count, int warmup_images);
+
+void run_dfe_sharded(dfe_config const& config, std::vector<dataflow_engine*> const& engines, tiff_container& tiff,
+		dfe_scalars const& scalars, run_options const& options, result_writer& writer);
+
+
+#endif /* SHARD_SCHEDULER_HPP */
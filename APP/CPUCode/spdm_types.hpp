@@ -0,0 +1,45 @@
+/** Types shared by the DFE and the CPU implementation of the engine
+    \file spdm_types.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef SPDM_TYPES_HPP
+#define SPDM_TYPES_HPP
+
+
+#include <stdint.h>
+
+
+const int end_of_image = -1;	///< Indicates end of an image in the img field of estimator_result
+const int last_pixel   = -2;	///< Indicates last pixel of input has been processed in the img field of estimator_result
+const int dfe_roi_radius = 3;	///< Distance of the ROI border from its center in the DFE, roiRadius of SpdmKernel
+
+
+/// Scalar values of the DFE configuration
+struct dfe_scalars
+{
+	int total_images;					///< total number of images to process
+	float nm_per_px;					///< size of an object that covers one pixel in nanometers
+	long start_image;					///< first image to process, ignore earlier images
+	long bg_threshold_factor;			///< threshold above image background for signal finder
+	long img_width;						///< width in pixels of each image frame
+	long img_height;					///< height in pixels of each image frame
+	double separator_threshold_factor;	///< threshold for signal separator, signals below are discarded
+	int roi_radius;						///< distance of the ROI border from its center, only dfe_roi_radius on the DFE
+};
+
+/// Result type as streamed from the signal estimator
+struct estimator_result
+{
+	int32_t img;			///< Image (frame) number
+	float Q;				///< Total charge / intensity
+	float mu_x;				///< X position of the signal center with sub-pixel accuracy
+	float mu_y;				///< Y position of the signal center with sub-pixel accuracy
+	float sigma_x;			///< Width of the signal in x direction, squared
+	float sigma_y;			///< Width of the signal in y direction, squared
+	float delta_mu_x;		///< Confidence of the x position, squared
+	float delta_mu_y;		///< Confidence of the y position, squared
+};
+
+
+#endif /* SPDM_TYPES_HPP */
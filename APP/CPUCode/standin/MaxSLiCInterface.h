@@ -0,0 +1,54 @@
+/** Stand-in for the part of the MaxSLiC interface used by the host code
+    \file MaxSLiCInterface.h
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+
+    Declares the same functions as the MaxSLiC header. The implementation in maxslic_standin.cpp
+    emulates the Spdm maxfile with the CPU engine, so the host code can be run and tested on
+    machines without MaxCompiler. Build with "make -f Makefile.rules RUNRULE=Simulation STANDIN=1".
+**/
+
+#ifndef MAXSLICINTERFACE_H
+#define MAXSLICINTERFACE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct max_file max_file_t;
+typedef struct max_engine max_engine_t;
+typedef struct max_actions max_actions_t;
+typedef struct max_llstream max_llstream_t;
+
+uint64_t max_get_constant_uint64t(max_file_t *maxfile, const char *name);
+void max_file_free(max_file_t *maxfile);
+
+max_engine_t* max_load(max_file_t *maxfile, const char *engine_id_pattern);
+void max_unload(max_engine_t *engine);
+
+max_actions_t* max_actions_init(max_file_t *maxfile, const char *interface_name);
+void max_actions_free(max_actions_t *actions);
+void max_set_uint64t(max_actions_t *actions, const char *block_name, const char *name, uint64_t value);
+void max_set_double(max_actions_t *actions, const char *block_name, const char *name, double value);
+void max_set_offset(max_actions_t *actions, const char *block_name, const char *name, int value);
+void max_set_ticks(max_actions_t *actions, const char *kernel_name, int ticks);
+void max_disable_stream_sync(max_actions_t *actions, const char *stream_name);
+void max_run(max_engine_t *engine, max_actions_t *actions);
+
+max_llstream_t* max_llstream_setup(max_engine_t *engine, const char *name, size_t slot_count, size_t slot_size, void *buffer);
+void max_llstream_release(max_llstream_t *stream);
+ssize_t max_llstream_write_acquire(max_llstream_t *stream, size_t max_slots, void **slots);
+void max_llstream_write(max_llstream_t *stream, size_t number_of_slots);
+ssize_t max_llstream_read(max_llstream_t *stream, size_t max_slots, void **slots);
+void max_llstream_read_discard(max_llstream_t *stream, size_t number_of_slots);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* MAXSLICINTERFACE_H */
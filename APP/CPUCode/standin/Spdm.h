@@ -0,0 +1,23 @@
+/** Stand-in for the header that MaxCompiler generates for the Spdm maxfile
+    \file Spdm.h
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef SPDM_H
+#define SPDM_H
+
+
+#include "MaxSLiCInterface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+max_file_t* Spdm_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SPDM_H */
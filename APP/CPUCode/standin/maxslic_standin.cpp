@@ -0,0 +1,292 @@
+/** Stand-in for the MaxSLiC calls that emulates the Spdm maxfile with the CPU engine
+    \file maxslic_standin.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+
+    The engine processes the pixels synchronously when the host writes a slot to from_host and queues
+    the results for to_host. Slots of from_host are handed out in order by max_llstream_write_acquire
+    and stay acquired until written, writing more slots than were acquired is an error. Like the DFE, the output ends with last pixel indicators that fill the
+    slot of the last result.
+**/
+
+#include "MaxSLiCInterface.h"
+#include "Spdm.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu_engine.hpp"
+
+
+/// Maxfile with the constants of SpdmManager
+struct max_file
+{
+	std::map<std::string, uint64_t> constants;		///< maxfile constants by name
+};
+
+/// Scalar values set in an action, by block name and scalar name separated with a dot
+struct max_actions
+{
+	std::map<std::string, uint64_t> uint_values;	///< integer scalars and offsets
+	std::map<std::string, double> double_values;	///< floating point scalars
+};
+
+/// Low-latency stream, a ring of slots in a buffer owned by the host
+struct max_llstream
+{
+	max_engine_t *engine;		///< engine the stream belongs to
+	bool to_host;				///< true for the result stream, false for the pixel stream
+	size_t slot_count;			///< number of slots in the ring
+	size_t slot_size;			///< size of a slot in bytes
+	char *buffer;				///< slots
+	size_t next_slot;			///< next slot handed to the host
+	size_t outstanding;			///< slots read by the host but not discarded yet
+	size_t acquired;			///< slots acquired by the host for writing but not written yet
+};
+
+/// Loaded engine
+struct max_engine
+{
+	max_file_t *maxfile;					///< maxfile the engine was loaded with
+	dfe_scalars scalars;					///< scalars of the last action
+	std::unique_ptr<cpu_engine> engine;		///< emulation of the kernels, created by max_run
+	std::vector<int16> image;				///< pixels received for the current image
+	size_t image_fill;						///< number of pixels in image
+	int images_received;					///< number of complete images
+	std::vector<estimator_result> output;	///< results not read yet
+	size_t output_begin;					///< first result in output not read yet
+	max_llstream_t *from_host;				///< pixel stream
+	max_llstream_t *to_host;				///< result stream
+};
+
+
+/// Get a scalar of an action
+template<class T>
+static T action_value(std::map<std::string, T> const& values, std::string const& name)
+{
+	typename std::map<std::string, T>::const_iterator it = values.find(name);
+	if(it == values.end()) {
+		throw std::runtime_error("max_run: scalar " + name + " not set");
+	}
+	return it->second;
+}
+
+/// Append pixels to the current image and process the image once it is complete
+static void engine_receive(max_engine_t *engine, int16 const* pixels, size_t count)
+{
+	if(!engine->engine) {
+		throw std::runtime_error("max_llstream_write: no action has been run on the engine");
+	}
+
+	while(count && engine->images_received < engine->scalars.total_images) {
+		size_t n = std::min(count, engine->image.size() - engine->image_fill);
+		std::copy(pixels, pixels + n, engine->image.begin() + engine->image_fill);
+		engine->image_fill += n;
+		pixels += n;
+		count -= n;
+
+		if(engine->image_fill == engine->image.size()) {
+			engine->engine->process(engine->image.data(), engine->output);
+			engine->image_fill = 0;
+			engine->images_received++;
+
+			if(engine->images_received == engine->scalars.total_images && engine->to_host) {
+				// the DFE keeps sending last pixel indicators for the rest of the stream
+				size_t slot_length = engine->to_host->slot_size / sizeof(estimator_result);
+				estimator_result indicator = engine->output.back();
+				while((engine->output.size() - engine->output_begin) % slot_length) {
+					engine->output.push_back(indicator);
+				}
+			}
+		}
+	}
+}
+
+
+max_file_t* Spdm_init(void)
+{
+	max_file_t *maxfile = new max_file;
+	maxfile->constants["max_img_width"] = 512;
+	maxfile->constants["max_img_height"] = 512;
+	maxfile->constants["estimator_result_bitsize"] = 8 * sizeof(estimator_result);
+	return maxfile;
+}
+
+uint64_t max_get_constant_uint64t(max_file_t *maxfile, const char *name)
+{
+	return action_value(maxfile->constants, name);
+}
+
+void max_file_free(max_file_t *maxfile)
+{
+	delete maxfile;
+}
+
+max_engine_t* max_load(max_file_t *maxfile, const char *engine_id_pattern)
+{
+	std::cerr << "Stand-in engine loaded for pattern '" << engine_id_pattern << "'" << std::endl;
+	max_engine_t *engine = new max_engine;
+	engine->maxfile = maxfile;
+	engine->image_fill = 0;
+	engine->images_received = 0;
+	engine->output_begin = 0;
+	engine->from_host = 0;
+	engine->to_host = 0;
+	return engine;
+}
+
+void max_unload(max_engine_t *engine)
+{
+	delete engine;
+}
+
+max_actions_t* max_actions_init(max_file_t*, const char*)
+{
+	return new max_actions;
+}
+
+void max_actions_free(max_actions_t *actions)
+{
+	delete actions;
+}
+
+void max_set_uint64t(max_actions_t *actions, const char *block_name, const char *name, uint64_t value)
+{
+	actions->uint_values[std::string(block_name) + "." + name] = value;
+}
+
+void max_set_double(max_actions_t *actions, const char *block_name, const char *name, double value)
+{
+	actions->double_values[std::string(block_name) + "." + name] = value;
+}
+
+void max_set_offset(max_actions_t *actions, const char *block_name, const char *name, int value)
+{
+	actions->uint_values[std::string(block_name) + "." + name] = value;
+}
+
+void max_set_ticks(max_actions_t*, const char*, int)
+{}
+
+void max_disable_stream_sync(max_actions_t*, const char*)
+{}
+
+void max_run(max_engine_t *engine, max_actions_t *actions)
+{
+	dfe_scalars scalars;
+	scalars.total_images = action_value(actions->uint_values, "SignalFinder.total_images");
+	scalars.start_image = action_value(actions->uint_values, "SignalFinder.start_image");
+	scalars.bg_threshold_factor = action_value(actions->uint_values, "SignalFinder.bg_threshold_factor");
+	scalars.img_width = action_value(actions->uint_values, "SignalFinder.img_width");
+	scalars.img_height = action_value(actions->uint_values, "SignalFinder.img_height");
+	scalars.separator_threshold_factor = action_value(actions->double_values, "SignalEstimator.separator_threshold_factor");
+	scalars.nm_per_px = action_value(actions->double_values, "SignalEstimator.nm_per_px");
+	scalars.roi_radius = dfe_roi_radius;
+
+	if((uint64_t) scalars.img_width > engine->maxfile->constants["max_img_width"]
+			|| (uint64_t) scalars.img_height > engine->maxfile->constants["max_img_height"]) {
+		throw std::runtime_error("max_run: image larger than the maximum of the maxfile");
+	}
+
+	engine->scalars = scalars;
+	engine->engine.reset(new cpu_engine(scalars, thread_pool::default_thread_count()));
+	engine->image.assign(scalars.img_width * scalars.img_height, 0);
+	engine->image_fill = 0;
+	engine->images_received = 0;
+	engine->output.clear();
+	engine->output_begin = 0;
+}
+
+max_llstream_t* max_llstream_setup(max_engine_t *engine, const char *name, size_t slot_count, size_t slot_size, void *buffer)
+{
+	max_llstream_t *stream = new max_llstream;
+	stream->engine = engine;
+	stream->slot_count = slot_count;
+	stream->slot_size = slot_size;
+	stream->buffer = static_cast<char*>(buffer);
+	stream->next_slot = 0;
+	stream->outstanding = 0;
+	stream->acquired = 0;
+
+	std::string stream_name(name);
+	if(stream_name == "from_host") {
+		stream->to_host = false;
+		engine->from_host = stream;
+	} else if(stream_name == "to_host") {
+		stream->to_host = true;
+		engine->to_host = stream;
+	} else {
+		delete stream;
+		throw std::runtime_error("max_llstream_setup: unknown stream " + stream_name);
+	}
+	return stream;
+}
+
+void max_llstream_release(max_llstream_t *stream)
+{
+	if(stream->engine->from_host == stream) {
+		stream->engine->from_host = 0;
+	}
+	if(stream->engine->to_host == stream) {
+		stream->engine->to_host = 0;
+	}
+	delete stream;
+}
+
+ssize_t max_llstream_write_acquire(max_llstream_t *stream, size_t max_slots, void **slots)
+{
+	// slots are processed when written, so all slots that are not acquired are free
+	size_t first = (stream->next_slot + stream->acquired) % stream->slot_count;
+	size_t count = std::min(max_slots, std::min(stream->slot_count - stream->acquired, stream->slot_count - first));
+	*slots = stream->buffer + first * stream->slot_size;
+	stream->acquired += count;
+	return count;
+}
+
+void max_llstream_write(max_llstream_t *stream, size_t number_of_slots)
+{
+	if(number_of_slots > stream->acquired) {
+		throw std::runtime_error("max_llstream_write: more slots written than acquired");
+	}
+	stream->acquired -= number_of_slots;
+	for(size_t i = 0; i < number_of_slots; i++) {
+		char const* slot = stream->buffer + (stream->next_slot % stream->slot_count) * stream->slot_size;
+		engine_receive(stream->engine, reinterpret_cast<int16 const*>(slot), stream->slot_size / sizeof(int16));
+		stream->next_slot++;
+	}
+}
+
+ssize_t max_llstream_read(max_llstream_t *stream, size_t max_slots, void **slots)
+{
+	max_engine_t *engine = stream->engine;
+	size_t slot_length = stream->slot_size / sizeof(estimator_result);
+	size_t first = stream->next_slot % stream->slot_count;
+	size_t available = (engine->output.size() - engine->output_begin) / slot_length;
+	size_t count = std::min(std::min(max_slots, available),
+			std::min(stream->slot_count - stream->outstanding, stream->slot_count - first));
+	if(count == 0) {
+		return 0;
+	}
+
+	estimator_result *out = reinterpret_cast<estimator_result*>(stream->buffer + first * stream->slot_size);
+	std::copy(engine->output.begin() + engine->output_begin, engine->output.begin() + engine->output_begin + count * slot_length, out);
+	engine->output_begin += count * slot_length;
+	if(engine->output_begin == engine->output.size()) {
+		engine->output.clear();
+		engine->output_begin = 0;
+	}
+
+	*slots = out;
+	stream->next_slot += count;
+	stream->outstanding += count;
+	return count;
+}
+
+void max_llstream_read_discard(max_llstream_t *stream, size_t number_of_slots)
+{
+	stream->outstanding -= std::min(number_of_slots, stream->outstanding);
+}
@@ -0,0 +1,301 @@
+/** Synthetic image stacks of blinking emitters for benchmarks
+    \file synthetic_stack.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "synthetic_stack.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "thread_pool.hpp"
+
+
+/// Draw a Poisson-distributed number, also for a mean of zero
+/** @param random Random number generator
+    @param mean Mean of the distribution
+    @return The number
+**/
+static int draw_poisson(std::mt19937_64& random, double mean)
+{
+	return mean > 0 ? std::poisson_distribution<int>(mean)(random) : 0;
+}
+
+/// Poisson distribution with a fixed mean, sampled by inversion of a table of the cumulative distribution
+/** Much faster than std::poisson_distribution for the large means of the background, which draws
+    several logarithms per number.
+**/
+class poisson_table
+{
+public:
+	explicit poisson_table(double mean)
+	{
+		double p = std::exp(-mean);
+		double sum = p;
+		int limit = (int) (mean + 12 * std::sqrt(mean) + 12);
+		cdf_.push_back(sum);
+		for(int k = 1; k <= limit; k++) {
+			p *= mean / k;
+			sum += p;
+			cdf_.push_back(sum);
+		}
+		cdf_.back() = 1.0;
+	}
+
+	int operator()(std::mt19937_64& random) const
+	{
+		double u = std::generate_canonical<double, 53>(random);
+		return std::upper_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+	}
+
+private:
+	std::vector<double> cdf_;
+};
+
+/// Create a renderer
+/** @param params Parameters of the stack
+**/
+synthetic_stack::synthetic_stack(synthetic_params const& params)
+	: params_(params)
+{
+	if(params_.img_width <= 0 || params_.img_height <= 0 || params_.frame_count <= 0) {
+		throw std::runtime_error("synthetic_stack: image size and frame count must be positive");
+	}
+	if(params_.density < 0 || params_.photons < 0 || params_.background < 0 || params_.psf_sigma <= 0 || params_.nm_per_px <= 0) {
+		throw std::runtime_error("synthetic_stack: negative density, photons or background, or no psf_sigma or nm_per_px");
+	}
+	if(params_.gain <= 0 || params_.read_noise < 0) {
+		throw std::runtime_error("synthetic_stack: gain must be positive and read_noise not negative");
+	}
+	if(params_.on_frames < 1 || params_.off_frames < 1) {
+		throw std::runtime_error("synthetic_stack: on_frames and off_frames must be at least 1");
+	}
+	draw_population();
+}
+
+/// Draw the positions of the population and the images each emitter is on in
+void synthetic_stack::draw_population()
+{
+	std::seed_seq seed{(uint32_t) params_.seed, (uint32_t) (params_.seed >> 32)};
+	std::mt19937_64 random(seed);
+
+	double um_per_px = params_.nm_per_px * 1e-3;
+	double on_fraction = params_.on_frames / (params_.on_frames + params_.off_frames);
+	double mean_on = params_.density * params_.img_width * params_.img_height * um_per_px * um_per_px;
+	std::uniform_real_distribution<double> position_x(-0.5, params_.img_width - 0.5);
+	std::uniform_real_distribution<double> position_y(-0.5, params_.img_height - 0.5);
+	std::bernoulli_distribution starts_on(on_fraction);
+	std::geometric_distribution<int> on_time(1.0 / params_.on_frames);		// failures before the switch, so + 1
+	std::geometric_distribution<int> off_time(1.0 / params_.off_frames);
+
+	positions_.resize(draw_poisson(random, mean_on / on_fraction));
+	on_.assign(params_.frame_count, std::vector<int>());
+	for(size_t id = 0; id < positions_.size(); id++) {
+		positions_[id].x = position_x(random);
+		positions_[id].y = position_y(random);
+
+		// the times are memoryless, so the first one in equilibrium has the same distribution as all others
+		bool on = starts_on(random);
+		for(int img = 0; img < params_.frame_count; on = !on) {
+			int end = std::min(params_.frame_count, img + 1 + (on ? on_time(random) : off_time(random)));
+			for(; img < end; img++) {
+				if(on) {
+					on_[img].push_back(id);
+				}
+			}
+		}
+	}
+}
+
+/// Render one image
+/** @param img Number of the image
+    @param pixels Receives img_width * img_height pixel values, row after row
+    @param emitters If not null, receives the emitters that are on in the image, appended in the order of their ids
+**/
+void synthetic_stack::render(int img, int16 *pixels, std::vector<synthetic_emitter> *emitters) const
+{
+	int width = params_.img_width;
+	int height = params_.img_height;
+	std::seed_seq seed{(uint32_t) params_.seed, (uint32_t) (params_.seed >> 32), (uint32_t) img};
+	std::mt19937_64 random(seed);
+
+	std::exponential_distribution<double> brightness(params_.photons > 0 ? 1.0 / params_.photons : 1.0);
+
+	std::vector<double> signal((size_t) width * height, 0.0);
+	int radius = (int) std::ceil(3 * params_.psf_sigma) + 1;		// beyond, less than 0.3% of the photons per axis
+	double erf_scale = 1.0 / (std::sqrt(2.0) * params_.psf_sigma);
+	std::vector<double> weight_x(2 * radius + 1), weight_y(2 * radius + 1);
+
+	std::vector<int> const& on = on_[img];
+	for(size_t n = 0; n < on.size(); n++) {
+		synthetic_emitter emitter;
+		emitter.img = img;
+		emitter.id = on[n];
+		emitter.x = positions_[emitter.id].x;
+		emitter.y = positions_[emitter.id].y;
+		emitter.photons = params_.photons > 0 ? brightness(random) : 0;
+		if(emitters) {
+			emitters->push_back(emitter);
+		}
+
+		// fraction of the photons on each pixel of the window, the integral of the Gaussian over the pixel
+		int col0 = (int) std::floor(emitter.x + 0.5) - radius;
+		int row0 = (int) std::floor(emitter.y + 0.5) - radius;
+		for(int i = 0; i <= 2 * radius; i++) {
+			double dx = col0 + i - emitter.x;
+			double dy = row0 + i - emitter.y;
+			weight_x[i] = 0.5 * (std::erf((dx + 0.5) * erf_scale) - std::erf((dx - 0.5) * erf_scale));
+			weight_y[i] = 0.5 * (std::erf((dy + 0.5) * erf_scale) - std::erf((dy - 0.5) * erf_scale));
+		}
+		for(int i = 0; i <= 2 * radius; i++) {
+			int row = row0 + i;
+			if(row < 0 || row >= height) {
+				continue;
+			}
+			for(int j = 0; j <= 2 * radius; j++) {
+				int col = col0 + j;
+				if(col < 0 || col >= width) {
+					continue;
+				}
+				signal[(size_t) row * width + col] += emitter.photons * weight_y[i] * weight_x[j];
+			}
+		}
+	}
+
+	// the sum of Poisson-distributed background and signal photons is Poisson-distributed with the sum of the means
+	poisson_table background(params_.background);
+	std::normal_distribution<double> read_noise(0.0, params_.read_noise > 0 ? params_.read_noise : 1.0);
+	bool camera = params_.offset != 0 || params_.gain != 1 || params_.read_noise > 0;
+	for(size_t i = 0; i < signal.size(); i++) {
+		int value = background(random) + draw_poisson(random, signal[i]);
+		if(camera) {
+			double adu = params_.offset + params_.gain * value + (params_.read_noise > 0 ? read_noise(random) : 0.0);
+			value = (int) std::max(0.0, std::floor(adu + 0.5));
+		}
+		pixels[i] = (int16) std::min(value, (int) max_pixel_value);
+	}
+}
+
+/// Render all images and append them to a tiff container
+/** Batches of images are rendered in parallel and appended in order.
+    @param tiff Container opened for writing
+    @param thread_count Number of threads rendering images
+    @param emitters If not null, receives the emitters of all images in the order of the images
+**/
+void synthetic_stack::write(tiff_container& tiff, int thread_count, std::vector<synthetic_emitter> *emitters) const
+{
+	thread_pool pool(thread_count);
+	size_t image_size = (size_t) params_.img_width * params_.img_height;
+	int batch_length = 2 * thread_count;
+	std::vector<int16> batch(batch_length * image_size);
+	std::vector<std::vector<synthetic_emitter> > batch_emitters(batch_length);
+	tiff_image16_ref image(params_.img_height, params_.img_width, 16, 0);
+
+	for(int first = 0; first < params_.frame_count; first += batch_length) {
+		int count = std::min(batch_length, params_.frame_count - first);
+		pool.parallel_for(0, count, [&](int i) {
+			batch_emitters[i].clear();
+			render(first + i, &batch[i * image_size], emitters ? &batch_emitters[i] : 0);
+		});
+		for(int i = 0; i < count; i++) {
+			if(emitters) {
+				emitters->insert(emitters->end(), batch_emitters[i].begin(), batch_emitters[i].end());
+			}
+			std::copy(&batch[i * image_size], &batch[(i + 1) * image_size], image.data()[0]);
+			tiff.append_image(image);
+		}
+	}
+}
+
+/// Get the parameters of the stack
+synthetic_params const& synthetic_stack::params() const
+{
+	return params_;
+}
+
+/// Get parameters of a stack that resembles a typical acquisition
+/** @return 512x512 pixels, 1000 images, 0.5 emitters on per square micrometer with 1000 photons, on for 3 and
+            off for 300 images on average, 100 background photons per pixel, 1.3 pixels psf_sigma, 102 nm per pixel
+            and an ideal camera
+**/
+synthetic_params synthetic_stack::default_params()
+{
+	synthetic_params params;
+	params.img_width = 512;
+	params.img_height = 512;
+	params.frame_count = 1000;
+	params.density = 0.5;
+	params.on_frames = 3;
+	params.off_frames = 300;
+	params.photons = 1000;
+	params.background = 100;
+	params.psf_sigma = 1.3;
+	params.nm_per_px = 102.0;
+	params.offset = 0;
+	params.gain = 1;
+	params.read_noise = 0;
+	params.seed = 1;
+	return params;
+}
+
+/// Parse parameters given as a comma-separated list of key=value pairs, e.g. "width=256,frames=100"
+/** Keys are width, height, frames, density, on_frames, off_frames, photons, background, sigma, nm_per_px, offset, gain,
+    read_noise and seed.
+    Parameters that are not given keep their default values.
+    @param spec The list
+    @return The parameters
+**/
+synthetic_params synthetic_stack::parse_params(std::string const& spec)
+{
+	synthetic_params params = default_params();
+	std::istringstream list(spec);
+	std::string item;
+	while(std::getline(list, item, ',')) {
+		if(item.empty()) {
+			continue;
+		}
+		size_t equals = item.find('=');
+		if(equals == std::string::npos) {
+			throw std::runtime_error("synthetic_stack: expected key=value, got '" + item + "'");
+		}
+		std::string key = item.substr(0, equals);
+		char const* value = item.c_str() + equals + 1;
+
+		if(key == "width") {
+			params.img_width = atoi(value);
+		} else if(key == "height") {
+			params.img_height = atoi(value);
+		} else if(key == "frames") {
+			params.frame_count = atoi(value);
+		} else if(key == "density") {
+			params.density = atof(value);
+		} else if(key == "on_frames") {
+			params.on_frames = atof(value);
+		} else if(key == "off_frames") {
+			params.off_frames = atof(value);
+		} else if(key == "photons") {
+			params.photons = atof(value);
+		} else if(key == "background") {
+			params.background = atof(value);
+		} else if(key == "sigma") {
+			params.psf_sigma = atof(value);
+		} else if(key == "nm_per_px") {
+			params.nm_per_px = atof(value);
+		} else if(key == "offset") {
+			params.offset = atof(value);
+		} else if(key == "gain") {
+			params.gain = atof(value);
+		} else if(key == "read_noise") {
+			params.read_noise = atof(value);
+		} else if(key == "seed") {
+			params.seed = strtoull(value, 0, 10);
+		} else {
+			throw std::runtime_error("synthetic_stack: unknown parameter '" + key + "'");
+		}
+	}
+	return params;
+}
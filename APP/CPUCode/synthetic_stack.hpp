@@ -0,0 +1,87 @@
+/** Synthetic image stacks of blinking emitters for benchmarks
+    \file synthetic_stack.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef SYNTHETIC_STACK_HPP
+#define SYNTHETIC_STACK_HPP
+
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "tiff.hpp"
+
+
+/// Parameters of a synthetic stack
+struct synthetic_params
+{
+	int img_width;				///< width in pixels of each image
+	int img_height;				///< height in pixels of each image
+	int frame_count;			///< number of images of the stack
+	double density;				///< mean number of emitters that are on per square micrometer in each image
+	double on_frames;			///< mean number of images an emitter stays on
+	double off_frames;			///< mean number of images an emitter stays off
+	double photons;				///< mean number of photons of an emitter in an image it is on
+	double background;			///< mean number of background photons per pixel
+	double psf_sigma;			///< standard deviation of the Gaussian point spread function in pixels
+	double nm_per_px;			///< edge length of a pixel in nanometers
+	double offset;				///< camera baseline added to every pixel
+	double gain;				///< camera counts per photon
+	double read_noise;			///< standard deviation of the Gaussian read noise of the camera in counts
+	uint64_t seed;				///< seed of the random numbers, the same seed gives the same stack
+};
+
+/// An emitter that is on in one image
+struct synthetic_emitter
+{
+	int img;					///< number of the image
+	int id;						///< number of the emitter in the population, the same in every image it is on
+	double x;					///< horizontal position in pixels, 0 is the center of the first column
+	double y;					///< vertical position in pixels, 0 is the center of the first row
+	double photons;				///< number of photons emitted during the image
+};
+
+/// Renders the images of a synthetic stack
+/** A fixed population of emitters at uniformly distributed positions blinks through the stack: each one
+    switches between on and off with geometrically distributed times of on_frames and off_frames images on
+    average, starting in equilibrium, and the population is as large as needed for density emitters to be on
+    on average. An emitter that is on has an exponentially distributed brightness in each image, blurred with
+    a Gaussian point spread function that is integrated over the pixels. Background and shot noise are
+    Poisson-distributed, the camera scales the photons with its gain and adds its offset and Gaussian read
+    noise. Pixel values are clipped to the integer range of the fixed-point pixels of the engine.
+    The population and its switching are drawn once from the seed, every image then only depends on the
+    seed and its number, so images can be rendered in any order and on several threads.
+**/
+class synthetic_stack
+{
+public:
+	explicit synthetic_stack(synthetic_params const& params);
+
+	void render(int img, int16 *pixels, std::vector<synthetic_emitter> *emitters = 0) const;
+	void write(tiff_container& tiff, int thread_count = 1, std::vector<synthetic_emitter> *emitters = 0) const;
+
+	synthetic_params const& params() const;
+	static synthetic_params default_params();
+	static synthetic_params parse_params(std::string const& spec);
+
+	static const int max_pixel_value = 2047;		///< largest value that fits the integer part of the Q12.4 pixels
+
+private:
+	/// Position of an emitter of the population in pixels, 0 is the center of the first column and row
+	struct emitter_position
+	{
+		double x;
+		double y;
+	};
+
+	void draw_population();
+
+	synthetic_params params_;
+	std::vector<emitter_position> positions_;		///< position of every emitter, by its id
+	std::vector<std::vector<int> > on_;				///< ids of the emitters that are on in each image, ascending
+};
+
+
+#endif /* SYNTHETIC_STACK_HPP */
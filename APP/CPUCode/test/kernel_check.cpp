@@ -0,0 +1,345 @@
+/** Deterministic checks of the SIMD kernels and the pixel arithmetic against scalar references
+    \file kernel_check.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "background_model.hpp"
+#include "frame_statistics.hpp"
+#include "pixel_arithmetic.hpp"
+#include "thread_pool.hpp"
+#include "tiff.hpp"
+
+
+static int failures = 0;		///< number of failed checks
+
+/// Count and report a failed check
+/** @param ok Result of the check
+    @param what Description of the check, printed if it failed
+**/
+static void check(bool ok, std::string const& what)
+{
+	if(!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		failures++;
+	}
+}
+
+/// Draw pixel values over the whole range of int16, with the extremes and values around zero more often than uniform
+static int16_t draw_pixel(std::mt19937& random)
+{
+	static const int16_t special[] = {-32768, -32767, -1, 0, 1, 2047, 2048, 4095, 32766, 32767};
+	switch(random() % 4) {
+	case 0:
+		return special[random() % (sizeof(special) / sizeof(special[0]))];
+	case 1:
+		return (int16_t) (random() % 4096);		// the range of the camera
+	default:
+		return (int16_t) random();
+	}
+}
+
+
+/********************** background kernels **********************************/
+
+/// Per-pixel arrays of a background update with room for guard values after the pixels
+struct background_run
+{
+	std::vector<int16_t> pixels;
+	std::vector<pixel_frac_t> background, pixel_no_bg, old_background, threshold;
+
+	background_arrays arrays()
+	{
+		background_arrays arrays = {pixels.data(), background.data(), pixel_no_bg.data(), old_background.data(), threshold.data()};
+		return arrays;
+	}
+
+	bool operator==(background_run const& other) const
+	{
+		return background == other.background && pixel_no_bg == other.pixel_no_bg
+				&& old_background == other.old_background && threshold == other.threshold;
+	}
+};
+
+/// Compare the SIMD background kernels the processor supports with update_background_scalar
+/** Runs of every length up to a few vectors and some longer ones check the remainders, the guard values
+    after each run check that no kernel writes past it.
+**/
+static void check_background_kernels(std::mt19937& random)
+{
+	struct named_kernel { background_kernel kernel; char const *name; };
+	std::vector<named_kernel> kernels;
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		kernels.push_back(named_kernel{&update_background_avx2, "avx2"});
+	}
+	if(__builtin_cpu_supports("avx512bw")) {
+		kernels.push_back(named_kernel{&update_background_avx512, "avx512"});
+	}
+#endif
+	std::cout << "Background kernels checked against scalar :  " << kernels.size() << std::endl;
+
+	const int guard = 64;
+	std::vector<int> counts;
+	for(int count = 0; count <= 100; count++) {
+		counts.push_back(count);
+	}
+	counts.push_back(1000);
+	counts.push_back(4096 + 31);
+
+	for(size_t c = 0; c < counts.size(); c++) {
+		int count = counts[c];
+		background_run input;
+		input.pixels.resize(count + guard);
+		input.background.resize(count + guard);
+		for(int i = 0; i < count + guard; i++) {
+			input.pixels[i] = draw_pixel(random);
+			input.background[i] = draw_pixel(random);
+		}
+		input.pixel_no_bg.assign(count + guard, 0x5a5a);
+		input.old_background.assign(count + guard, 0x5a5a);
+		input.threshold.assign(count + guard, 0x5a5a);
+
+		for(int first_image = 0; first_image < 2; first_image++) {
+			for(int factor = 1; factor <= 16; factor += 5) {
+				pixel_frac_t threshold_factor = factor << frac_bits;
+				background_run expected = input;
+				update_background_scalar(expected.arrays(), count, first_image, threshold_factor);
+
+				for(size_t k = 0; k < kernels.size(); k++) {
+					background_run result = input;
+					kernels[k].kernel(result.arrays(), count, first_image, threshold_factor);
+					std::ostringstream what;
+					what << "update_background_" << kernels[k].name << " of " << count << " pixels, first_image "
+						 << first_image << ", bg_threshold_factor " << factor;
+					check(result == expected, what.str());
+				}
+			}
+		}
+	}
+}
+
+
+/********************** pixel arithmetic **********************************/
+
+/// Clamp a value to the range of int16
+static int16_t saturate(int64_t value)
+{
+	return (int16_t) std::max<int64_t>(-32768, std::min<int64_t>(32767, value));
+}
+
+/// Make an image of random pixel values
+static tiff_image16_ref random_image(std::mt19937& random, int height, int width)
+{
+	tiff_image16_ref image(height, width, 16, 0);
+	for(int row = 0; row < height; row++) {
+		for(int col = 0; col < width; col++) {
+			image.data()[row][col] = draw_pixel(random);
+		}
+	}
+	return image;
+}
+
+/// Compare an evaluated expression with a reference computed pixel by pixel
+/** @param result The evaluated expression
+    @param a First operand
+    @param b Second operand
+    @param reference Expected value of a pixel from the pixels of a and b
+    @param what Description of the expression
+**/
+template<typename Reference>
+static void check_pixels(tiff_image16_ref const& result, tiff_image16_ref const& a, tiff_image16_ref const& b,
+		Reference reference, std::string const& what)
+{
+	for(int row = 0; row < a.height(); row++) {
+		for(int col = 0; col < a.width(); col++) {
+			int16_t expected = reference(a.data()[row][col], b.data()[row][col]);
+			if(result.data()[row][col] != expected) {
+				std::ostringstream where;
+				where << what << " of " << a.height() << "x" << a.width() << " pixels at " << row << "," << col << ": "
+					  << a.data()[row][col] << ", " << b.data()[row][col] << " gives " << result.data()[row][col]
+					  << " instead of " << expected;
+				check(false, where.str());
+				return;
+			}
+		}
+	}
+}
+
+/// Check that pixel_expression saturates every operation and chains of them like the scalar definition
+/** Sizes below and above a vector and a block check the remainders.
+**/
+static void check_pixel_expressions(std::mt19937& random)
+{
+	std::cout << "Pixel kernels                              :  " << select_pixel_kernels().name << std::endl;
+
+	const int sizes[][2] = {{1, 1}, {1, 15}, {3, 17}, {5, 37}, {2, pixel_expression::block_length + 19}, {64, 64}};
+	const double factors[] = {0.5, -0.5, 2.5, 1000.0, -1000.0, std::numeric_limits<double>::quiet_NaN()};
+	const int values[] = {-40000, -32768, -1, 1, 100, 32767, 40000};
+	const int shifts[] = {0, 1, 3, 15, 16, 20};
+
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		tiff_image16_ref a = random_image(random, sizes[s][0], sizes[s][1]);
+		tiff_image16_ref b = random_image(random, sizes[s][0], sizes[s][1]);
+
+		check_pixels((a + b).evaluate(), a, b, [](int16_t x, int16_t y) { return saturate(x + y); }, "a + b");
+		check_pixels((a - b).evaluate(), a, b, [](int16_t x, int16_t y) { return std::max(saturate(x - y), (int16_t) 0); },
+				"a - b");
+		for(size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+			int value = values[v];
+			check_pixels((a - value).evaluate(), a, b,
+					[value](int16_t x, int16_t) { return std::max(saturate(x - saturate(value)), (int16_t) 0); },
+					"a - " + std::to_string(value));
+		}
+		for(size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+			double factor = factors[f];
+			check_pixels((a * factor).evaluate(), a, b,
+					[factor](int16_t x, int16_t) {
+						double product = x * factor;
+						return std::isnan(product) ? (int16_t) 32767 : saturate((int64_t) std::trunc(product));
+					},
+					"a * " + std::to_string(factor));
+		}
+		for(size_t k = 0; k < sizeof(shifts) / sizeof(shifts[0]); k++) {
+			int shift = shifts[k];
+			check_pixels((a << shift).evaluate(), a, b,
+					[shift](int16_t x, int16_t) { return saturate(x * ((int64_t) 1 << shift)); },
+					"a << " + std::to_string(shift));
+			check_pixels((a >> shift).evaluate(), a, b,
+					[shift](int16_t x, int16_t) { return (int16_t) (x >> std::min(shift, 15)); },
+					"a >> " + std::to_string(shift));
+		}
+
+		// a chain saturates after every step, not only at the end
+		check_pixels((((a + b) - a) * 2.5 << 1).evaluate(), a, b,
+				[](int16_t x, int16_t y) {
+					int16_t sum = saturate(x + y);
+					int16_t difference = std::max(saturate(sum - x), (int16_t) 0);
+					int16_t product = saturate((int64_t) std::trunc(difference * 2.5));
+					return saturate(product * 2);
+				},
+				"((a + b) - a) * 2.5 << 1");
+
+		tiff_image16_ref target = a.copy();
+		target += b;
+		check_pixels(target, a, b, [](int16_t x, int16_t y) { return saturate(x + y); }, "a += b");
+	}
+}
+
+
+/********************** high-pass filter **********************************/
+
+/// Check apply_highpass against the mean of the square clipped to the image, summed pixel by pixel
+/** Radii of zero, inside the image and beyond it check the borders, bands on several threads check the
+    rows bands share.
+**/
+static void check_highpass(std::mt19937& random)
+{
+	const int sizes[][2] = {{1, 1}, {1, 17}, {13, 1}, {7, 9}, {50, 64}};
+	const int radii[] = {0, 1, 2, 5, 40};
+	thread_pool pool(3);
+
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int height = sizes[s][0];
+		int width = sizes[s][1];
+		tiff_image16_ref image = random_image(random, height, width);
+		for(size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++) {
+			int radius = radii[r];
+			tiff_image16_ref expected = image.copy();
+			for(int row = 0; row < height; row++) {
+				for(int col = 0; col < width; col++) {
+					int64_t sum = 0, count = 0;
+					for(int y = std::max(0, row - radius); y <= std::min(height - 1, row + radius); y++) {
+						for(int x = std::max(0, col - radius); x <= std::min(width - 1, col + radius); x++) {
+							sum += image.data()[y][x];
+							count++;
+						}
+					}
+					expected.data()[row][col] = saturate(image.data()[row][col] - sum / count);
+				}
+			}
+
+			for(int threads = 0; threads < 2; threads++) {
+				tiff_image16_ref result = image.copy();
+				result.apply_highpass(radius, threads ? &pool : 0);
+				std::ostringstream what;
+				what << "apply_highpass with radius " << radius << (threads ? " on threads" : "");
+				check_pixels(result, image, expected, [](int16_t, int16_t y) { return y; }, what.str());
+			}
+		}
+	}
+}
+
+
+/********************** frame statistics **********************************/
+
+/// Check frame_statistics against counts taken pixel by pixel, for frames added one after another
+/** The same statistics are reset and reused for every frame, so histogram bins left over from an earlier
+    frame, also in the histograms of the bands on other threads, change the counts of a later one.
+**/
+static void check_frame_statistics(std::mt19937& random)
+{
+	const int sizes[][2] = {{1, 1}, {3, 17}, {64, 64}, {37, frame_statistics::block_length + 5}, {5, 100}};
+	thread_pool pool(3);
+	frame_statistics statistics;
+
+	for(int threads = 0; threads < 2; threads++) {
+		for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			tiff_image16_ref image = random_image(random, sizes[s][0], sizes[s][1]);
+			std::vector<uint32_t> frequency(1 << 16, 0);
+			int64_t sum = 0;
+			int min = 32767, max = -32768;
+			for(int row = 0; row < image.height(); row++) {
+				for(int col = 0; col < image.width(); col++) {
+					int value = image.data()[row][col];
+					frequency[value + 32768]++;
+					sum += value;
+					min = std::min(min, value);
+					max = std::max(max, value);
+				}
+			}
+
+			statistics.reset();
+			statistics.add(image, threads ? &pool : 0);
+			std::ostringstream what;
+			what << "frame_statistics of " << image.height() << "x" << image.width() << " pixels" << (threads ? " on threads" : "");
+			check(statistics.count() == (int64_t) image.height() * image.width(), what.str() + ": count");
+			check(statistics.min() == min && statistics.max() == max, what.str() + ": min and max");
+			check(statistics.sum() == sum, what.str() + ": sum");
+			bool same = true;
+			for(int value = -32768; value < 32768; value++) {
+				same = same && statistics.frequency(value) == frequency[value + 32768];
+			}
+			check(same, what.str() + ": histogram");
+		}
+	}
+}
+
+
+int main()
+{
+	std::mt19937 random(12345);
+
+	check_background_kernels(random);
+	check_pixel_expressions(random);
+	check_highpass(random);
+	check_frame_statistics(random);
+
+	if(failures) {
+		std::cerr << failures << " kernel checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All kernel checks passed" << std::endl;
+	return 0;
+}
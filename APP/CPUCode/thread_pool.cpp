@@ -0,0 +1,206 @@
+/** Pool of worker threads for the CPU implementation of the engine
+    \file thread_pool.cpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#include "thread_pool.hpp"
+
+#include <stdexcept>
+
+
+/// Start the worker threads
+/** @param thread_count Total number of threads including the calling thread
+**/
+thread_pool::thread_pool(int thread_count)
+	: body_(0), active_(0), generation_(0), shutdown_(false)
+{
+	if(thread_count < 1) {
+		throw std::runtime_error("thread_pool: thread_count < 1");
+	}
+
+	ranges_.reset(new work_range[thread_count]);
+	for(int i = 0; i < thread_count; i++) {
+		ranges_[i].bounds = pack_range(0, 0);
+	}
+	for(int i = 1; i < thread_count; i++) {
+		threads_.push_back(std::thread(&thread_pool::work, this, i));
+	}
+}
+
+/// Stop and join the worker threads
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		shutdown_ = true;
+	}
+	start_.notify_all();
+
+	for(size_t i = 0; i < threads_.size(); i++) {
+		threads_[i].join();
+	}
+}
+
+/// Get the number of threads working on a loop
+/** @return Number of threads including the calling thread
+**/
+int thread_pool::thread_count() const
+{
+	return threads_.size() + 1;
+}
+
+/// Execute body(i) for all i in [begin, end) and return when all iterations are done
+/** An exception thrown by an iteration is rethrown in the calling thread after the loop finished.
+    @param begin First iteration
+    @param end One past the last iteration
+    @param body The loop body
+**/
+void thread_pool::parallel_for(int begin, int end, std::function<void(int)> const& body)
+{
+	if(end - begin <= 0) {
+		return;
+	}
+
+	if(threads_.empty() || end - begin == 1) {
+		for(int i = begin; i < end; i++) {
+			body(i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		body_ = &body;
+		long count = end - begin;
+		int threads = thread_count();
+		for(int i = 0; i < threads; i++) {
+			ranges_[i].bounds = pack_range(begin + count * i / threads, begin + count * (i + 1) / threads);
+		}
+		active_ = threads_.size();
+		error_ = std::exception_ptr();
+		generation_++;
+	}
+	start_.notify_all();
+
+	run_iterations(0);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while(active_ != 0) {
+		done_.wait(lock);
+	}
+	body_ = 0;
+
+	if(error_) {
+		std::rethrow_exception(error_);
+	}
+}
+
+/// Get the number of threads to use if the user did not specify it
+/** @return The number of hardware threads, at least one
+**/
+int thread_pool::default_thread_count()
+{
+	int count = std::thread::hardware_concurrency();
+	return count > 0 ? count : 1;
+}
+
+/// Main loop of a worker thread
+/** @param index Number of the thread, from 1 on, 0 is the calling thread
+**/
+void thread_pool::work(int index)
+{
+	unsigned long generation = 0;
+
+	while(true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			while(!shutdown_ && generation == generation_) {
+				start_.wait(lock);
+			}
+			if(shutdown_) {
+				return;
+			}
+			generation = generation_;
+		}
+
+		run_iterations(index);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(--active_ == 0) {
+			done_.notify_all();
+		}
+	}
+}
+
+/// Take iterations of the current loop from the own range, and steal more, until all are handed out
+/** @param index Number of the thread
+**/
+void thread_pool::run_iterations(int index)
+{
+	std::atomic<uint64_t>& range = ranges_[index].bounds;
+	while(true) {
+		uint64_t bounds = range.load();
+		int i = range_begin(bounds);
+		if(i >= range_end(bounds)) {
+			if(!steal(index)) {
+				return;
+			}
+			continue;
+		}
+		if(!range.compare_exchange_weak(bounds, pack_range(i + 1, range_end(bounds)))) {
+			continue;		// a thief took the back of the range
+		}
+
+		try {
+			(*body_)(i);
+		} catch(...) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(!error_) {
+				error_ = std::current_exception();
+			}
+		}
+	}
+}
+
+/// Move the back half of the iterations left to another thread into the empty range of a thread
+/** Only the owner of a range moves its begin and only thieves move its end, and a thief only
+    touches ranges that are not empty, so the empty range of the thread can be set without a race.
+    @param index Number of the thread
+    @return False if no thread has iterations left
+**/
+bool thread_pool::steal(int index)
+{
+	int threads = thread_count();
+	for(int k = 1; k < threads; k++) {
+		std::atomic<uint64_t>& victim = ranges_[(index + k) % threads].bounds;
+		uint64_t bounds = victim.load();
+		while(range_begin(bounds) < range_end(bounds)) {
+			int begin = range_begin(bounds);
+			int end = range_end(bounds);
+			int middle = begin + (end - begin) / 2;
+			if(victim.compare_exchange_weak(bounds, pack_range(begin, middle))) {
+				ranges_[index].bounds = pack_range(middle, end);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/// Pack the bounds of a range of iterations into one word
+uint64_t thread_pool::pack_range(int begin, int end)
+{
+	return (uint64_t) (uint32_t) begin << 32 | (uint32_t) end;
+}
+
+/// Get the first iteration of a packed range
+int thread_pool::range_begin(uint64_t bounds)
+{
+	return (int32_t) (uint32_t) (bounds >> 32);
+}
+
+/// Get one past the last iteration of a packed range
+int thread_pool::range_end(uint64_t bounds)
+{
+	return (int32_t) (uint32_t) bounds;
+}
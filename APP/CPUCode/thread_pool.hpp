@@ -0,0 +1,70 @@
+/** Pool of worker threads for the CPU implementation of the engine
+    \file thread_pool.hpp
+ 	\author Frederik Grüll (Frederik.Gruell@iri.uni-frankfurt.de)
+**/
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/// Fixed set of worker threads that execute the iterations of a loop in parallel
+/** The calling thread takes part in the work, so a pool with a thread count of one
+    does not start any additional thread. Every thread starts on a contiguous range of the
+    iterations and takes them one at a time from its front; a thread that runs out steals the
+    back half of the iterations left to another thread. Neighbouring iterations thus mostly run
+    on the same thread, and threads only contend when stealing.
+    parallel_for must not be called from within an iteration.
+**/
+class thread_pool
+{
+public:
+	explicit thread_pool(int thread_count);
+	~thread_pool();
+	int thread_count() const;
+	void parallel_for(int begin, int end, std::function<void(int)> const& body);
+
+	static int default_thread_count();
+
+private:
+	thread_pool(thread_pool const&);		// no copying
+	thread_pool& operator=(const thread_pool&);
+	void work(int index);
+	void run_iterations(int index);
+	bool steal(int index);
+
+	/// Iterations left to a thread, begin and end packed into one word to update both with one compare-and-swap
+	struct work_range
+	{
+		std::atomic<uint64_t> bounds;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];		// one cache line per thread
+	};
+
+	static uint64_t pack_range(int begin, int end);
+	static int range_begin(uint64_t bounds);
+	static int range_end(uint64_t bounds);
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable start_;
+	std::condition_variable done_;
+	std::function<void(int)> const* body_;
+	std::unique_ptr<work_range[]> ranges_;
+	int active_;
+	unsigned long generation_;
+	bool shutdown_;
+	std::exception_ptr error_;
+};
+
+
+#endif /* THREAD_POOL_HPP */
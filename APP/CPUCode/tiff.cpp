@@ -5,13 +5,23 @@
 
 
 #include "tiff.hpp"
+#include "frame_statistics.hpp"
+#include "ome_metadata.hpp"
+#include "pixel_arithmetic.hpp"
+#include "thread_pool.hpp"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>   // memset
+#include <cstdio>
 #include <cassert>
 #include <cmath>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 
 /********************** tiff_image **********************************/
 // public
@@ -24,92 +34,51 @@
 **/
 tiff_image16_ref::tiff_image16_ref(int height, int width, int bits_per_pixel,  int dir_number)
   : height_(height), width_(width), scanline_size_(width * sizeof(uint16)),
-    bits_per_pixel_(bits_per_pixel), ref_count_(new int), dir_number_(dir_number)
+    bits_per_pixel_(bits_per_pixel), buffer_(frame_pool::get(height, width).acquire()), dir_number_(dir_number)
 {
-	/*
-  int16 **data = new int16*[height];
-  for(int row = 0; row < height; row++) {
-    data[row] = new int16[width];
-    memset(data[row], '\0', scanline_size_);
-  }*/
-
-
-  int16 **data = new int16*[height];
-  int16 *data_rows = new int16[height * width];
-
-  for(int row = 0; row < (int) height; row++) {
-    data[row] =  &data_rows[row * width];
-    memset(data[row], '\0', scanline_size_);
-  }
+  data_ = buffer_->rows;
+  memset(buffer_->pixels, '\0', (size_t) height * scanline_size_);
 
   assert(scanline_size_ == width * (int) sizeof(int16));
-
-  data_ = data;
-  *ref_count_ = 1;
 }
 
 /// Copy an image reference without copying the image
 /** @param image The reference to copy
 **/
 tiff_image16_ref::tiff_image16_ref(tiff_image16_ref const& image)
+  : buffer_(0)
 {
-  if(data_ == image.data_) return;
-
-  data_ = image.data_;
-  height_ = image.height_;
-  width_ = image.width_;
-  scanline_size_ = image.scanline_size_;
-  bits_per_pixel_ = image.bits_per_pixel_;
-  dir_number_ = image.dir_number_;
-  ref_count_ = image.ref_count_;
+  assign(image);
+}
 
-  (*ref_count_)++;
+/// Take over an image reference, the moved-from reference must only be destroyed or assigned to
+/** @param image The reference to move
+**/
+tiff_image16_ref::tiff_image16_ref(tiff_image16_ref&& image)
+  : data_(image.data_), height_(image.height_), width_(image.width_), scanline_size_(image.scanline_size_),
+    bits_per_pixel_(image.bits_per_pixel_), buffer_(image.buffer_), dir_number_(image.dir_number_)
+{
+  image.data_ = 0;
+  image.buffer_ = 0;
 }
 
 /// Image destructor, delete data if last reference to it gets destructed
 tiff_image16_ref::~tiff_image16_ref()
 {
-  (*ref_count_)--;
-
-
-  if(*ref_count_ == 0) {
-    delete[] data_[0];
-    delete[] data_;
-    delete ref_count_;
-  }
-
-  /*
-  if(*ref_count_ == 0) {
-    for(int row = 0; row < height_; row++) {
-      delete[] data_[row];
-    }
-    delete[] data_;
-  }*/
-
-
+  release();
 }
 
 /// Copy an image by copying its data
 tiff_image16_ref tiff_image16_ref::copy()
 {
-
-	int16 **data = new int16*[height_];
-	int16 *data_rows = new int16[height_ * width_];
+  frame_buffer *buffer = frame_pool::get(height_, width_).acquire();
 	for(int row = 0; row < height_; row++) {
-		data[row] = &data_rows[row * width_];
-		memcpy(data[row], data_[row], scanline_size_);
+		memcpy(buffer->rows[row], data_[row], scanline_size_);
 	}
 
-	/*
-  int16 **data = new int16*[height_];
-  for(int row = 0; row < height_; row++) {
-    data[row] = new int16[width_];
-    memcpy(data[row], data_[row], scanline_size_);
-  }*/
-
   assert(scanline_size_ == width_ * (int) sizeof(int16));
 
-  return tiff_image16_ref(data, height_, width_, scanline_size_, bits_per_pixel_, dir_number_);
+  return tiff_image16_ref(buffer, height_, width_, scanline_size_, bits_per_pixel_, dir_number_);
 }
 
 /// Return data array of the image
@@ -170,25 +139,36 @@ int tiff_image16_ref::bits_per_pixel() const
   return bits_per_pixel_;
 }
 
+/// Check whether the rows follow each other in memory, so the pixels can be processed as one run
+/** @return True for images from a frame_pool and for mapped images stored in one piece
+**/
+bool tiff_image16_ref::contiguous() const
+{
+  for(int row = 1; row < height_; row++) {
+    if(data_[row] != data_[row - 1] + width_) {
+      return false;
+    }
+  }
+  return true;
+}
+
 /// Assignment operator
 tiff_image16_ref& tiff_image16_ref::operator=(tiff_image16_ref const& image)
 {
-	if(data_ == image.data_) return *this;
+	if(buffer_ == image.buffer_) return *this;
 
-	(*ref_count_)--;
-	if(*ref_count_ == 0) {
-    delete[] data_[0];
-    delete[] data_;
-    delete ref_count_;
-  }
+  release();
+  assign(image);
 
-  /*
-  if(*ref_count_ == 0) {
-    for(int row = 0; row < height_; row++) {
-      delete[] data_[row];
-    }
-    delete[] data_;
-  }*/
+  return *this;
+}
+
+/// Move assignment operator
+tiff_image16_ref& tiff_image16_ref::operator=(tiff_image16_ref&& image)
+{
+  if(this == &image) return *this;
+
+  release();
 
   data_ = image.data_;
   height_ = image.height_;
@@ -196,24 +176,20 @@ tiff_image16_ref& tiff_image16_ref::operator=(tiff_image16_ref const& image)
   scanline_size_ = image.scanline_size_;
   bits_per_pixel_ = image.bits_per_pixel_;
   dir_number_ = image.dir_number_;
-  ref_count_ = image.ref_count_;
+  buffer_ = image.buffer_;
 
-  (*ref_count_)++;
+  image.data_ = 0;
+  image.buffer_ = 0;
 
   return *this;
 }
 
-/// Shift all pixel values to the left
+/// Shift all pixel values to the left, saturating
 /** @param shift shift amount
 **/
 tiff_image16_ref& tiff_image16_ref::operator<<=(int shift)
 {
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] <<= shift;
-    }
-  }
-
+  (pixel_expression(*this) << shift).evaluate_into(*this);
   return *this;
 }
 
@@ -222,61 +198,36 @@ tiff_image16_ref& tiff_image16_ref::operator<<=(int shift)
 **/
 tiff_image16_ref& tiff_image16_ref::operator>>=(int shift)
 {
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] >>= shift;
-    }
-  }
-
+  (pixel_expression(*this) >> shift).evaluate_into(*this);
   return *this;
 }
 
 
-/// Subtract an image from this image
+/// Subtract an image from this image, negative values become zero
 /** @param image The image to subtract
 **/
 tiff_image16_ref& tiff_image16_ref::operator-=(tiff_image16_ref const& image)
 {
-  assert(height_ == image.height_ && width_ == image.width_);
-
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] = std::max(data_[row][col] - image.data_[row][col],0);
-    }
-  }
-
+  (*this - image).evaluate_into(*this);
   return *this;
 }
 
-/// Add an image to this image
+/// Add an image to this image, saturating
 /** @param image The image to add
 **/
 tiff_image16_ref& tiff_image16_ref::operator+=(tiff_image16_ref const& image)
 {
-  assert(height_ == image.height_ && width_ == image.width_);
-
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] = data_[row][col] + image.data_[row][col];
-    }
-  }
-
+  (*this + image).evaluate_into(*this);
   return *this;
 }
 
-/// Multiply every pixel value by a factor
-/** @param d Factor to multiply each pixel value with
+/// Multiply every pixel value by a factor, saturating
+/** @param d Factor to multiply each pixel value with, the product is rounded toward zero
 **/
 
 tiff_image16_ref& tiff_image16_ref::operator*=(double d)
 {
-
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] = (int16) (data_[row][col] * d);
-    }
-  }
-
+  (*this * d).evaluate_into(*this);
   return *this;
 }
 
@@ -291,91 +242,82 @@ int tiff_image16_ref::subtr_and_update_bg(tiff_image16_ref const& bg, float img_
   assert(height_ == bg.height_ && width_ == bg.width_);
   assert(img_weight >= 0 && img_weight <= 1);
 
-  int meanbg = 0;
+  pixel_kernels const& kernels = select_pixel_kernels();
   float bg_weight = 1.0 - img_weight;
+  int64_t sum = 0;
 
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      int16 img_data = data_[row][col];
-      int16 bg_data = bg.data_[row][col];
-
-      data_[row][col] = std::max(img_data - bg_data, 0);                      // subtract background
-      bg.data_[row][col] = (int16) (bg_data * bg_weight  + img_data * img_weight);      // update background
-      meanbg += img_data;
+  if(contiguous() && bg.contiguous()) {
+    sum = kernels.subtract_update_background(data_[0], bg.data_[0], img_weight, bg_weight, height_ * width_);
+  } else {
+    for(int row = 0; row < height_; row++) {
+      sum += kernels.subtract_update_background(data_[row], bg.data_[row], img_weight, bg_weight, width_);
     }
   }
-  meanbg /= (height_ * width_);
 
-  return meanbg;
+  return (int) (sum / ((int64_t) height_ * width_));
 }
 
 
-/// Subtract a value from all pixel values
-/** @param subtrahend The value to subtract from each pixel value
+/// Subtract a value from all pixel values, negative values become zero
+/** @param subtrahend The value to subtract from each pixel value, saturated to int16
 **/
 tiff_image16_ref& tiff_image16_ref::operator-=(int subtrahend)
 {
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] = std::max(data_[row][col] - subtrahend, 0);
-    }
-  }
-
+  (*this - subtrahend).evaluate_into(*this);
   return *this;
 }
 
 
 /// Apply a 2D high-pass filter to the image
-/** @param fir_radius The radius of the square where the average is calculated from
+/** Subtracts from every pixel the mean of the square around it in the original image, rounded toward
+    zero and saturated to int16. At the borders the square is clipped to the image. The sums are kept
+    as running sums, so the cost per pixel does not depend on the radius.
+    @param fir_radius The radius of the square where the average is calculated from
+    @param pool Threads to filter bands of rows with, null to filter on the calling thread
 **/
-tiff_image16_ref& tiff_image16_ref::apply_highpass(int fir_radius)
+tiff_image16_ref& tiff_image16_ref::apply_highpass(int fir_radius, thread_pool *pool)
 {
-  for(int row = 0; row < height_; row++) {
-    for(int col = 0; col < width_; col++) {
-
-      int halo_count = 0;
-      int halo_acc = sum_halo(row, col, fir_radius, halo_count);
-
-      data_[row][col] = data_[row][col] -halo_acc / halo_count;
+  assert(fir_radius >= 0);
+
+  // filter into a separate buffer, bands read the rows of their neighbours
+  frame_buffer *result = frame_pool::get(height_, width_).acquire();
+  int band_count = pool ? std::min(height_, 4 * pool->thread_count()) : 1;
+  auto filter_band = [&](int band) {
+    highpass_band((long) height_ * band / band_count, (long) height_ * (band + 1) / band_count, fir_radius, result->rows);
+  };
+  auto copy_band = [&](int band) {
+    for(int row = (long) height_ * band / band_count; row < (long) height_ * (band + 1) / band_count; row++) {
+      memcpy(data_[row], result->rows[row], width_ * sizeof(int16));
     }
+  };
+
+  if(pool) {
+    pool->parallel_for(0, band_count, filter_band);
+    pool->parallel_for(0, band_count, copy_band);
+  } else {
+    filter_band(0);
+    copy_band(0);
   }
+  result->pool->recycle(result);
 
   return *this;
 }
 
 /// Print a histogram of all pixel values to stdout
+/** @return The largest pixel value
+**/
 int tiff_image16_ref::histogram()
 {
-  const int HISTSIZE = 5000;
-  int *values = new int[HISTSIZE];
-  memset(values, '\0', HISTSIZE );
-  int maxvalue=0;
-
+  frame_statistics statistics;
+  statistics.add(*this);
 
-  for(int i=0;i < height_;i++)
-  {
-    for(int j=0;j < width_;j++)
-    {
-      if(data_[i][j] >= HISTSIZE)
-      {
-        maxvalue=HISTSIZE;
-        values[HISTSIZE-1]++;
-      } else {
-        values[data_[i][j]]++;
-        if(data_[i][j] > maxvalue) {
-          maxvalue = data_[i][j];
-        }
-      }
-    }
-  }
   /* output */
-  for(int i = 0;i <= maxvalue; i++)
+  for(int value = statistics.min(); value <= statistics.max(); value++)
   {
-    std::cout << i << "\t" << values[i] << std::endl;
+    std::cout << value << "\t" << statistics.frequency(value) << std::endl;
   }
-  delete values;
 
-  return maxvalue;
+  return statistics.max();
 }
 
 /// Calculate and subtract the mean pixel value from the image
@@ -383,28 +325,10 @@ int tiff_image16_ref::histogram()
 **/
 int tiff_image16_ref::substract_meanvalue()
 {
+  int meanbg = calc_meanvalue();
+  *this -= meanbg;
 
-  int meanbg = 0;
-
-  for(int i = 0; i<height_; i++)
-  {
-    for(int j = 0; j<width_; j++)
-    {
-      meanbg += data_[i][j];
-    }
-  }
-  meanbg = meanbg / (height_ * width_);
-
-  for(int i = 0; i < height_; i++)
-  {
-    for(int j = 0; j < width_; j++)
-    {
-      data_[i][j] = std::max(data_[i][j] - meanbg, 0);
-      //data_[i][j] -= value;
-    }
-  }
-
-  return (int) meanbg;
+  return meanbg;
 }
 
 
@@ -413,20 +337,18 @@ int tiff_image16_ref::substract_meanvalue()
 **/
 int tiff_image16_ref::calc_meanvalue()
 {
- int value = 0;
+  pixel_kernels const& kernels = select_pixel_kernels();
+  int64_t sum = 0;
 
-  for(int i = 0; i<height_; i++)
-  {
-    for(int j = 0; j<width_; j++)
-    {
-      value += data_[i][j];
+  if(contiguous()) {
+    sum = kernels.sum(data_[0], height_ * width_);
+  } else {
+    for(int row = 0; row < height_; row++) {
+      sum += kernels.sum(data_[row], width_);
     }
   }
-  value = value / (height_ * width_);
 
-  //std::cerr << "tiff_image16_ref::calc_meanvalue(): height is " << height_ << ", width is " << width_ << std::endl;
-
-  return value;
+  return (int) (sum / ((int64_t) height_ * width_));
 }
 
 /// Output the image as CSV
@@ -447,43 +369,350 @@ void tiff_image16_ref::write_as_csv(std::ostream &out)
 
 // private
 /// Create an image reference from a tiff container
-tiff_image16_ref::tiff_image16_ref(int16 *const *data, int height, int width,
+/** @param buffer Acquired buffer with the pixels, the reference takes over its reference count
+**/
+tiff_image16_ref::tiff_image16_ref(frame_buffer *buffer, int height, int width,
                            int scanline_size, int bits_per_pixel, int dir_number)
-  : data_(data), height_(height), width_(width), scanline_size_(scanline_size),
-    bits_per_pixel_(bits_per_pixel), ref_count_(new int), dir_number_(dir_number)
+  : data_(buffer->rows), height_(height), width_(width), scanline_size_(scanline_size),
+    bits_per_pixel_(bits_per_pixel), buffer_(buffer), dir_number_(dir_number)
+{}
+
+/// Refer to the pixels of another image, the reference must not hold a buffer
+void tiff_image16_ref::assign(tiff_image16_ref const& image)
 {
-  *ref_count_ = 1;
+  data_ = image.data_;
+  height_ = image.height_;
+  width_ = image.width_;
+  scanline_size_ = image.scanline_size_;
+  bits_per_pixel_ = image.bits_per_pixel_;
+  dir_number_ = image.dir_number_;
+  buffer_ = image.buffer_;
+
+  if(buffer_) {
+    buffer_->ref_count.fetch_add(1, std::memory_order_relaxed);
+  }
 }
 
-/// Calculate the sum of all pixel values in a halo
-int tiff_image16_ref::sum_halo(int row, int col, int fir_radius, int& halo_count)
+/// Drop this reference, return the pixels to their pool if it was the last one
+void tiff_image16_ref::release()
 {
-  int halo_acc = 0;
-  halo_count = 0;
+  if(buffer_ && buffer_->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    buffer_->pool->recycle(buffer_);
+  }
+  buffer_ = 0;
+  data_ = 0;
+}
+
+/// Apply the high-pass filter to a band of rows
+/** Keeps the sum of the column of the square for every column of the image and slides it down one row
+    at a time, then slides the sum of the square along the row.
+    @param first_row First row of the band
+    @param end_row One past the last row of the band
+    @param fir_radius The radius of the square
+    @param result Rows receiving the filtered pixels
+**/
+void tiff_image16_ref::highpass_band(int first_row, int end_row, int fir_radius, int16 *const *result) const
+{
+  if(first_row >= end_row) {
+    return;
+  }
+
+  std::vector<int64_t> column_sums(width_, 0);
+  for(int row = std::max(0, first_row - fir_radius); row <= std::min(height_ - 1, first_row + fir_radius); row++) {
+    for(int col = 0; col < width_; col++) {
+      column_sums[col] += data_[row][col];
+    }
+  }
 
-  for(int row_halo = row - fir_radius; row_halo < row + fir_radius + 1; row_halo++) {
-    for(int col_halo = col - fir_radius; col_halo < col + fir_radius + 1; col_halo++) {
-      if(row_halo > 0 && row_halo < height_ && col_halo > 0 && col_halo < width_) {
-        halo_acc += data_[row_halo][col_halo];
-        halo_count++;
+  for(int row = first_row; row < end_row; row++) {
+    int rows_in_square = std::min(height_ - 1, row + fir_radius) - std::max(0, row - fir_radius) + 1;
+
+    int64_t sum = 0;
+    for(int col = 0; col <= std::min(width_ - 1, fir_radius); col++) {
+      sum += column_sums[col];
+    }
+    for(int col = 0; col < width_; col++) {
+      int cols_in_square = std::min(width_ - 1, col + fir_radius) - std::max(0, col - fir_radius) + 1;
+      int64_t value = data_[row][col] - sum / ((int64_t) rows_in_square * cols_in_square);
+      result[row][col] = (int16) std::max((int64_t) -32768, std::min((int64_t) 32767, value));
+
+      if(col + fir_radius + 1 < width_) {
+        sum += column_sums[col + fir_radius + 1];
+      }
+      if(col - fir_radius >= 0) {
+        sum -= column_sums[col - fir_radius];
+      }
+    }
+
+    // slide the columns down to the next row
+    if(row + fir_radius + 1 < height_) {
+      int16 const* entering = data_[row + fir_radius + 1];
+      for(int col = 0; col < width_; col++) {
+        column_sums[col] += entering[col];
+      }
+    }
+    if(row - fir_radius >= 0) {
+      int16 const* leaving = data_[row - fir_radius];
+      for(int col = 0; col < width_; col++) {
+        column_sums[col] -= leaving[col];
       }
     }
   }
+}
 
-  return halo_acc;
+
+/********************** pixel_expression **********************************/
+// public
+
+/// Start a chain with the pixels of an image
+pixel_expression::pixel_expression(tiff_image16_ref const& image)
+{
+  operands_.push_back(image);
+}
+
+/// Subtract the pixels of an image, negative values become zero
+pixel_expression pixel_expression::operator-(tiff_image16_ref const& image) const
+{
+  step next = {step::subtract, 0, 0, 0};
+  return then(next, &image);
+}
+
+/// Add the pixels of an image
+pixel_expression pixel_expression::operator+(tiff_image16_ref const& image) const
+{
+  step next = {step::add, 0, 0, 0};
+  return then(next, &image);
+}
+
+/// Subtract a value, saturated to int16, negative values become zero
+pixel_expression pixel_expression::operator-(int subtrahend) const
+{
+  step next = {step::subtract_value, -1, std::max(-32768, std::min(32767, subtrahend)), 0};
+  return then(next);
+}
+
+/// Multiply by a factor in double precision, the product is rounded toward zero
+pixel_expression pixel_expression::operator*(double factor) const
+{
+  step next = {step::multiply, -1, 0, factor};
+  return then(next);
+}
+
+/// Shift to the left
+pixel_expression pixel_expression::operator<<(int shift) const
+{
+  assert(shift >= 0);
+  step next = {step::shift_left, -1, shift, 0};
+  return then(next);
+}
+
+/// Shift to the right, keeping the sign
+pixel_expression pixel_expression::operator>>(int shift) const
+{
+  assert(shift >= 0);
+  step next = {step::shift_right, -1, shift, 0};
+  return then(next);
+}
+
+/// Compute the chain and store the result in the pixels of an image
+/** @param target Image of the size of the operands, may be one of them
+**/
+void pixel_expression::evaluate_into(tiff_image16_ref& target) const
+{
+  tiff_image16_ref const& first = operands_[0];
+  assert(target.height_ == first.height_ && target.width_ == first.width_);
+
+  pixel_kernels const& kernels = select_pixel_kernels();
+
+  // one run over all pixels if no image has gaps between its rows, otherwise one per row
+  bool contiguous = target.contiguous();
+  for(size_t i = 0; i < operands_.size(); i++) {
+    contiguous = contiguous && operands_[i].contiguous();
+  }
+  int run_count = contiguous ? 1 : first.height_;
+  int run_length = contiguous ? first.height_ * first.width_ : first.width_;
+  bool in_place = target.data_ == first.data_;
+
+  int16 block[block_length];
+  for(int run = 0; run < run_count; run++) {
+    for(int offset = 0; offset < run_length; offset += block_length) {
+      int count = std::min(block_length, run_length - offset);
+      int16 *pixels = target.data_[run] + offset;
+      if(!in_place) {
+        memcpy(block, first.data_[run] + offset, count * sizeof(int16));
+        pixels = block;
+      }
+
+      for(size_t s = 0; s < steps_.size(); s++) {
+        step const& op = steps_[s];
+        int16 const* operand = op.operand >= 0 ? operands_[op.operand].data_[run] + offset : 0;
+        switch(op.kind) {
+          case step::subtract:       kernels.subtract(pixels, operand, count); break;
+          case step::add:            kernels.add(pixels, operand, count); break;
+          case step::subtract_value: kernels.subtract_value(pixels, op.value, count); break;
+          case step::multiply:       kernels.multiply(pixels, op.factor, count); break;
+          case step::shift_left:     kernels.shift_left(pixels, op.value, count); break;
+          case step::shift_right:    kernels.shift_right(pixels, op.value, count); break;
+        }
+      }
+
+      if(!in_place) {
+        memcpy(target.data_[run] + offset, block, count * sizeof(int16));
+      }
+    }
+  }
+}
+
+/// Compute the chain into a new image
+/** @return Image with the size and directory number of the first operand
+**/
+tiff_image16_ref pixel_expression::evaluate() const
+{
+  tiff_image16_ref const& first = operands_[0];
+  tiff_image16_ref result(frame_pool::get(first.height_, first.width_).acquire(), first.height_, first.width_,
+                          first.width_ * sizeof(int16), first.bits_per_pixel_, first.dir_number_);
+  evaluate_into(result);
+  return result;
+}
+
+// private
+/// Append an operation to a copy of the chain
+/** @param next The operation
+    @param image Its image operand, null for operations with a value
+**/
+pixel_expression pixel_expression::then(step const& next, tiff_image16_ref const* image) const
+{
+  pixel_expression chain(*this);
+  chain.steps_.push_back(next);
+  if(image) {
+    assert(image->height_ == operands_[0].height_ && image->width_ == operands_[0].width_);
+    chain.steps_.back().operand = chain.operands_.size();
+    chain.operands_.push_back(*image);
+  }
+  return chain;
+}
+
+
+/// Start a chain with the difference of two images, negative values become zero
+pixel_expression operator-(tiff_image16_ref const& image, tiff_image16_ref const& subtrahend)
+{
+  return pixel_expression(image) - subtrahend;
+}
+
+/// Start a chain with the saturated sum of two images
+pixel_expression operator+(tiff_image16_ref const& image, tiff_image16_ref const& summand)
+{
+  return pixel_expression(image) + summand;
+}
+
+/// Start a chain with an image minus a value, negative values become zero
+pixel_expression operator-(tiff_image16_ref const& image, int subtrahend)
+{
+  return pixel_expression(image) - subtrahend;
+}
+
+/// Start a chain with the saturated product of an image with a factor
+pixel_expression operator*(tiff_image16_ref const& image, double factor)
+{
+  return pixel_expression(image) * factor;
+}
+
+/// Start a chain with an image shifted to the left, saturating
+pixel_expression operator<<(tiff_image16_ref const& image, int shift)
+{
+  return pixel_expression(image) << shift;
+}
+
+/// Start a chain with an image shifted to the right
+pixel_expression operator>>(tiff_image16_ref const& image, int shift)
+{
+  return pixel_expression(image) >> shift;
 }
 
 
 /********************** tiff_container **********************************/
 // public
 
+/// Get the directory of a path, with a trailing slash, or an empty string for the working directory
+static std::string parent_directory(std::string const& path)
+{
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+/// Resolve a file name of OME-XML metadata, relative to the directory of the metadata
+static std::string resolve_path(std::string const& directory, std::string const& name)
+{
+  return name[0] == '/' ? name : directory + name;
+}
+
+/// Check whether two paths name the same file
+static bool same_file(std::string const& a, std::string const& b)
+{
+  struct stat a_stat, b_stat;
+  if(a == b) {
+    return true;
+  }
+  return stat(a.c_str(), &a_stat) == 0 && stat(b.c_str(), &b_stat) == 0
+      && a_stat.st_dev == b_stat.st_dev && a_stat.st_ino == b_stat.st_ino;
+}
+
+/// Read the OME-XML of a file, from the description of its first image or from the companion file it refers to
+/** @param tiff Handle of the file at its first image
+    @param path Path of the file
+    @param metadata Receives the metadata
+    @param directory Receives the directory the file names in the metadata are relative to
+    @return true iff the file has OME-XML metadata that lists its images
+**/
+static bool read_ome_metadata(TIFF *tiff, std::string const& path, ome_metadata& metadata, std::string& directory)
+{
+  char *description = 0;
+  if(!TIFFGetField(tiff, TIFFTAG_IMAGEDESCRIPTION, &description) || !description || !strstr(description, "OME")) {
+    return false;
+  }
+  directory = parent_directory(path);
+  if(!metadata.parse(description)) {
+    return false;
+  }
+  if(metadata.metadata_file.empty()) {
+    return true;
+  }
+
+  std::string companion = resolve_path(directory, metadata.metadata_file);
+  directory = parent_directory(companion);
+  return metadata.parse_file(companion);
+}
+
 /// Create a tiff container object from a tiff file
-tiff_container::tiff_container(std::string path, std::string mode)
-  : path_(path), mode_(mode)
+/** A file opened for reading is indexed once, so that the number of images and every image
+    are available without walking the chain of image file directories again. If the file has
+    OME-XML metadata, the number of images is taken from it and the images are located only
+    when they are read, in all files of the series.
+    @param path The path of the tiff file
+    @param mode The opening mode as for TIFFOpen, "w8" writes BigTIFF
+    @param use_index_file Read the index from a file next to the tiff file if it is up to date, write it otherwise
+**/
+tiff_container::tiff_container(std::string path, std::string mode, bool use_index_file)
+  : path_(path), mode_(mode), mapping_size_(0), located_(0), nm_per_px_(0), byte_swapped_(false)
 {
   TIFFSetWarningHandler(&TIFFWarningHandler);
   tiff_ = TIFFOpen(path.c_str(), mode.c_str());
   good_ = (bool) tiff_;
+
+  if(good_ && mode_ == "r") {
+    ome_metadata metadata;
+    std::string directory;
+    if(read_ome_metadata(tiff_, path_, metadata, directory)) {
+      nm_per_px_ = metadata.nm_per_px;
+      open_series(metadata, directory);
+    } else if(!use_index_file || !read_index_file()) {
+      build_index();
+      if(use_index_file) {
+        write_index_file();
+      }
+    }
+    map_file();
+  }
 }
 
 /// Close a tiff container
@@ -492,6 +721,9 @@ tiff_container::~tiff_container()
   if(good_) {
     TIFFClose(tiff_);
   }
+  for(size_t i = 0; i < read_handles_.size(); i++) {
+    TIFFClose(read_handles_[i]);
+  }
 }
 
 /// Indicate wheter the tiff container could be opened
@@ -527,10 +759,17 @@ std::string const& tiff_container::path()
 }
 
 /// Get the number of images in the tiff container
-/** @return the number of images in the tiff container
+/** @return the number of images in the tiff container, in all files of a series
 **/
 int tiff_container::total_img_count()
 {
+  if(!segments_.empty()) {
+    return segments_.back().first_image + segments_.back().count;
+  }
+  if(!images_.empty()) {
+    return images_.size();
+  }
+
   int count = 0;
   TIFFSetDirectory(tiff_, 0);
 
@@ -543,38 +782,44 @@ int tiff_container::total_img_count()
 }
 
 /// Get an image from the tiff container
-/** @param i The number of the image
+/** If the file is mapped, the image points into the mapping. Changes to its pixels
+    are private to the process and seen by all references to the same image.
+    Otherwise the image is decoded with libtiff, strip by strip or tile by tile, so any
+    compression libtiff supports can be read. Images can be read from several threads,
+    each with its own handle of the file, so compressed images are decoded in parallel.
+    @param i The number of the image, in the whole series
     @return a refernce to the requested image
 **/
 tiff_image16_ref tiff_container::image(int i)
 {
-  TIFFSetDirectory(tiff_, i);
-
-  tsize_t scanline_size = TIFFScanlineSize(tiff_);
-
-  uint32 height;
-  TIFFGetField(tiff_,  TIFFTAG_IMAGELENGTH, &height);
-
-  uint32 width;
-  TIFFGetField(tiff_,  TIFFTAG_IMAGEWIDTH, &width);
-
-  uint16 bits_per_pixel;
-  TIFFGetField(tiff_, TIFFTAG_BITSPERSAMPLE, &bits_per_pixel);
-
-  assert(scanline_size == (tsize_t) (sizeof(int16) * width));
+  if(segments_.empty()) {
+    return file_image(i);
+  }
 
-  int16 **data = new int16*[height];
-  int16 *data_rows = new int16[height * width];
+  series_segment const& segment = find_segment(i);
+  tiff_image16_ref image = segment.file->file_image(segment.first_ifd + i - segment.first_image);
+  image.dir_number_ = i;
+  return image;
+}
 
-  for(int row = 0; row < (int) height; row++) {
-    data[row] =  &data_rows[row * width];
-    TIFFReadScanline(tiff_, data[row], row);
+/// Read an image of the container straight into a buffer of the caller
+/** Uncompressed images are copied from the mapping, others are decoded with libtiff strip by strip
+    or tile by tile into the buffer, without a pooled image in between. Images can be read from
+    several threads like with image().
+    @param i The number of the image, in the whole series
+    @param pixels Receives height * width pixel values, row after row
+    @param height Height the image must have
+    @param width Width the image must have
+**/
+void tiff_container::read_image(int i, int16 *pixels, int height, int width)
+{
+  if(segments_.empty()) {
+    read_file_image(i, pixels, height, width);
+    return;
   }
 
-  // rely on return value optimization here,
-  // copy-constructor should not be called
-
-  return tiff_image16_ref(data, height, width, scanline_size, bits_per_pixel, i);
+  series_segment const& segment = find_segment(i);
+  segment.file->read_file_image(segment.first_ifd + i - segment.first_image, pixels, height, width);
 }
 
 /// Append an image to the end of the tiff container
@@ -632,6 +877,580 @@ void tiff_container::append_as_8bit_image(tiff_image16_ref const& image, int shi
 }
 
 
+/// Indicate whether the images are read from a memory mapping of the file instead of with libtiff
+/** @return true iff the file, and every other file of a series, is mapped
+**/
+bool tiff_container::mapped()
+{
+  bool mapped = (bool) mapping_ || images_.empty();
+  for(size_t i = 0; i < parts_.size(); i++) {
+    mapped = mapped && parts_[i]->mapped();
+  }
+  return mapped;
+}
+
+/// Get the edge length of a pixel from the OME-XML metadata
+/** @return The length in nanometers, 0 if the file has no such metadata
+**/
+double tiff_container::nm_per_px()
+{
+  return nm_per_px_;
+}
+
+/// Get the files of the OME-TIFF series a file belongs to
+/** @param path Path of the file
+    @return The paths of the files in the order of the series, empty if the file holds no series of several files
+**/
+std::vector<std::string> tiff_container::series_paths(std::string const& path)
+{
+  std::vector<std::string> paths;
+  TIFFSetWarningHandler(&TIFFWarningHandler);
+  TIFF *tiff = TIFFOpen(path.c_str(), "r");
+  if(!tiff) {
+    return paths;
+  }
+
+  ome_metadata metadata;
+  std::string directory;
+  if(read_ome_metadata(tiff, path, metadata, directory)) {
+    for(size_t i = 0; i < metadata.planes.size(); i++) {
+      std::string file = metadata.planes[i].file.empty() ? path : resolve_path(directory, metadata.planes[i].file);
+      if(std::find(paths.begin(), paths.end(), file) == paths.end()) {
+        paths.push_back(file);
+      }
+    }
+  }
+  TIFFClose(tiff);
+
+  if(paths.size() < 2) {
+    paths.clear();
+  }
+  return paths;
+}
+
+// private
+/// Open a file of an OME-TIFF series whose metadata was read from another file
+/** @param path The path of the file
+    @param image_count Number of images of the file that the series uses
+**/
+tiff_container::tiff_container(std::string path, int image_count)
+  : path_(path), mode_("r"), mapping_size_(0), located_(0), nm_per_px_(0), byte_swapped_(false)
+{
+  tiff_ = TIFFOpen(path.c_str(), "r");
+  good_ = (bool) tiff_;
+  if(!good_) {
+    throw std::runtime_error("tiff_container: could not open " + path + ", a file of an OME-TIFF series");
+  }
+  images_.resize(image_count);
+  map_file();
+}
+
+/// Lay out the images of an OME-TIFF series, without locating them yet
+/** @param metadata The metadata of the series
+    @param directory Directory the file names of the metadata are relative to
+**/
+void tiff_container::open_series(ome_metadata const& metadata, std::string const& directory)
+{
+  // number of images each file needs, every file is opened once
+  std::vector<std::pair<std::string, int> > files;
+  std::vector<size_t> run_files;
+  for(size_t i = 0; i < metadata.planes.size(); i++) {
+    ome_metadata::plane_run const& run = metadata.planes[i];
+    std::string path = run.file.empty() ? path_ : resolve_path(directory, run.file);
+    size_t f = 0;
+    while(f < files.size() && files[f].first != path) {
+      f++;
+    }
+    if(f == files.size()) {
+      files.push_back(std::make_pair(path, 0));
+    }
+    files[f].second = std::max(files[f].second, run.first_ifd + run.count);
+    run_files.push_back(f);
+  }
+
+  std::vector<tiff_container*> containers;
+  for(size_t f = 0; f < files.size(); f++) {
+    if(same_file(files[f].first, path_)) {
+      images_.resize(files[f].second);
+      containers.push_back(this);
+    } else {
+      parts_.push_back(std::unique_ptr<tiff_container>(new tiff_container(files[f].first, files[f].second)));
+      containers.push_back(parts_.back().get());
+    }
+  }
+
+  int first_image = 0;
+  for(size_t i = 0; i < metadata.planes.size(); i++) {
+    series_segment segment;
+    segment.file = containers[run_files[i]];
+    segment.first_ifd = metadata.planes[i].first_ifd;
+    segment.first_image = first_image;
+    segment.count = metadata.planes[i].count;
+    segments_.push_back(segment);
+    first_image += segment.count;
+  }
+
+  // a single file with its images in order needs no segments
+  if(segments_.size() == 1 && segments_[0].file == this && segments_[0].first_ifd == 0) {
+    segments_.clear();
+  }
+}
+
+/// Describe the image at the current directory of the file
+tiff_container::image_location tiff_container::describe_directory()
+{
+  image_location image;
+  image.directory = TIFFCurrentDirOffset(tiff_);
+  image.offset = 0;
+
+  uint16 compression, samples_per_pixel, bits_per_pixel;
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_BITSPERSAMPLE, &bits_per_pixel);
+  image.bits_per_pixel = bits_per_pixel;
+
+  toff_t *strip_offsets = 0;
+  toff_t *strip_byte_counts = 0;
+  if(TIFFGetField(tiff_, TIFFTAG_IMAGELENGTH, &image.height)
+      && TIFFGetField(tiff_, TIFFTAG_IMAGEWIDTH, &image.width)
+      && compression == COMPRESSION_NONE && samples_per_pixel == 1 && bits_per_pixel == 16 && !TIFFIsTiled(tiff_)
+      && TIFFGetField(tiff_, TIFFTAG_STRIPOFFSETS, &strip_offsets)
+      && TIFFGetField(tiff_, TIFFTAG_STRIPBYTECOUNTS, &strip_byte_counts)) {
+
+    // the pixels can be used in place if the strips are stored one after the other
+    bool contiguous = true;
+    uint64 end = strip_offsets[0];
+    uint32 strips = TIFFNumberOfStrips(tiff_);
+    for(uint32 strip = 0; strip < strips && contiguous; strip++) {
+      contiguous = strip_offsets[strip] == end;
+      end += strip_byte_counts[strip];
+    }
+    if(contiguous && end - strip_offsets[0] >= (uint64) image.height * image.width * sizeof(int16)) {
+      image.offset = strip_offsets[0];
+    }
+  }
+
+  return image;
+}
+
+/// Locate an image of the file, walking the image file directories from the last image located
+/** @param i The number of the image in the file
+    @return The location of the image
+**/
+tiff_container::image_location tiff_container::locate(int i)
+{
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  if(i < 0 || i >= (int) images_.size()) {
+    throw std::runtime_error("tiff_container: no image " + std::to_string(i) + " in " + path_);
+  }
+
+  while(located_ <= i) {
+    bool found;
+    if(located_ == 0) {
+      found = TIFFSetDirectory(tiff_, 0);
+    } else {
+      uint64 previous = images_[located_ - 1].directory;
+      found = (TIFFCurrentDirOffset(tiff_) == previous || TIFFSetSubDirectory(tiff_, previous)) && TIFFReadDirectory(tiff_);
+    }
+    if(!found) {
+      throw std::runtime_error("tiff_container: " + path_ + " holds fewer images than its metadata lists");
+    }
+    images_[located_] = describe_directory();
+    located_++;
+  }
+  return images_[i];
+}
+
+/// Get the segment of the series that holds an image
+/** @param i The number of the image in the series
+    @return The segment
+**/
+tiff_container::series_segment const& tiff_container::find_segment(int i)
+{
+  // the segment with the last first image not after i
+  std::vector<series_segment>::const_iterator s = std::upper_bound(segments_.begin(), segments_.end(), i,
+      [](int image, series_segment const& segment) { return image < segment.first_image; });
+  if(s == segments_.begin() || i >= (s - 1)->first_image + (s - 1)->count) {
+    throw std::runtime_error("tiff_container: no image " + std::to_string(i) + " in the series of " + path_);
+  }
+  return *(s - 1);
+}
+
+/// Get an image of this file, not of the series
+/** @param i The number of the image in the file
+    @return a reference to the image
+**/
+tiff_image16_ref tiff_container::file_image(int i)
+{
+  image_location location = locate(i);
+  if(mapping_ && location.offset
+      && location.offset + (uint64) location.height * location.width * sizeof(int16) <= mapping_size_) {
+    return mapped_image_ref(i, location);
+  }
+
+  TIFF *handle = acquire_handle();
+  try {
+    if(!TIFFSetSubDirectory(handle, location.directory)) {
+      throw std::runtime_error("tiff_container: could not read the directory of an image of " + path_);
+    }
+    tiff_image16_ref image = decode_image(handle, i);
+    release_handle(handle);
+    return image;
+  } catch(...) {
+    release_handle(handle);
+    throw;
+  }
+}
+
+/// Read an image of this file, not of the series, into a buffer of the caller, see read_image
+/** @param i The number of the image in the file
+    @param pixels Receives height * width pixel values, row after row
+    @param height Height the image must have
+    @param width Width the image must have
+**/
+void tiff_container::read_file_image(int i, int16 *pixels, int height, int width)
+{
+  image_location location = locate(i);
+  size_t pixel_count = (size_t) height * width;
+  if(mapping_ && location.offset && location.offset + pixel_count * sizeof(int16) <= mapping_size_) {
+    if((int) location.height != height || (int) location.width != width) {
+      throw std::runtime_error("tiff_container: image " + std::to_string(i) + " of " + path_ + " is not "
+          + std::to_string(height) + " x " + std::to_string(width) + " pixels");
+    }
+    memcpy(pixels, (char *) mapping_.get() + location.offset, pixel_count * sizeof(int16));
+    if(byte_swapped_) {
+      TIFFSwabArrayOfShort((uint16 *) pixels, pixel_count);
+    }
+    advise_next_image(i);
+    return;
+  }
+
+  TIFF *handle = acquire_handle();
+  try {
+    if(!TIFFSetSubDirectory(handle, location.directory)) {
+      throw std::runtime_error("tiff_container: could not read the directory of an image of " + path_);
+    }
+    uint32 file_height, file_width;
+    decoded_size(handle, file_height, file_width);
+    if((int) file_height != height || (int) file_width != width) {
+      throw std::runtime_error("tiff_container: image " + std::to_string(i) + " of " + path_ + " is not "
+          + std::to_string(height) + " x " + std::to_string(width) + " pixels");
+    }
+    decode_pixels(handle, pixels, file_height, file_width);
+    release_handle(handle);
+  } catch(...) {
+    release_handle(handle);
+    throw;
+  }
+}
+
+/// Locate all images of the file in a single pass over the image file directories
+void tiff_container::build_index()
+{
+  std::vector<image_location> images;
+
+  TIFFSetDirectory(tiff_, 0);
+  do {
+    images.push_back(describe_directory());
+  } while(TIFFReadDirectory(tiff_));
+
+  TIFFSetDirectory(tiff_, 0);
+  images_.swap(images);
+  located_ = images_.size();
+}
+
+/// Get the path of the index file that belongs to the tiff file
+std::string tiff_container::index_file_path()
+{
+  return path_ + ".index";
+}
+
+/// Header of an index file, the index is valid as long as size and modification time of the tiff file match
+struct tiff_index_header {
+  char magic[8];              ///< identifies the file format
+  uint64 file_size;           ///< size of the tiff file
+  int64 mtime_sec;            ///< modification time of the tiff file, seconds
+  int64 mtime_nsec;           ///< modification time of the tiff file, nanoseconds
+  uint64 entry_size;          ///< size of an index entry
+  uint64 image_count;         ///< number of images in the tiff file
+};
+
+static const char tiff_index_magic[8] = {'S', 'P', 'D', 'M', 'I', 'D', 'X', '1'};
+
+/// Fill the fields of an index file header that identify the tiff file
+static bool make_index_header(std::string const& path, tiff_index_header& header)
+{
+  struct stat file_stat;
+  if(stat(path.c_str(), &file_stat) != 0) {
+    return false;
+  }
+
+  memset(&header, '\0', sizeof(header));
+  memcpy(header.magic, tiff_index_magic, sizeof(header.magic));
+  header.file_size = file_stat.st_size;
+  header.mtime_sec = file_stat.st_mtim.tv_sec;
+  header.mtime_nsec = file_stat.st_mtim.tv_nsec;
+  return true;
+}
+
+/// Read the index from the index file
+/** @return true iff the index file exists and belongs to the current version of the tiff file
+**/
+bool tiff_container::read_index_file()
+{
+  tiff_index_header expected;
+  if(!make_index_header(path_, expected)) {
+    return false;
+  }
+  expected.entry_size = sizeof(image_location);
+
+  FILE *file = fopen(index_file_path().c_str(), "rb");
+  if(!file) {
+    return false;
+  }
+
+  tiff_index_header header;
+  bool valid = fread(&header, sizeof(header), 1, file) == 1
+      && memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0
+      && header.file_size == expected.file_size
+      && header.mtime_sec == expected.mtime_sec
+      && header.mtime_nsec == expected.mtime_nsec
+      && header.entry_size == expected.entry_size
+      && header.image_count > 0;
+
+  std::vector<image_location> images;
+  if(valid) {
+    images.resize(header.image_count);
+    valid = fread(&images[0], sizeof(image_location), images.size(), file) == images.size();
+  }
+  fclose(file);
+
+  if(valid) {
+    images_.swap(images);
+    located_ = images_.size();
+  }
+  return valid;
+}
+
+/// Write the index to the index file, a file that cannot be written is silently skipped
+void tiff_container::write_index_file()
+{
+  tiff_index_header header;
+  if(images_.empty() || !make_index_header(path_, header)) {
+    return;
+  }
+  header.entry_size = sizeof(image_location);
+  header.image_count = images_.size();
+
+  // write to a temporary file first, so a concurrent reader never sees a partial index
+  std::string temp_path = index_file_path() + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if(!file) {
+    return;
+  }
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(&images_[0], sizeof(image_location), images_.size(), file) == images_.size();
+  written = fclose(file) == 0 && written;
+
+  if(!written || rename(temp_path.c_str(), index_file_path().c_str()) != 0) {
+    unlink(temp_path.c_str());
+  }
+}
+
+/// Map the file into memory if all images can be read without decoding
+/** This requires uncompressed 16 bit gray-scale images whose strips are stored contiguously.
+    Images that are located only when they are read and turn out not to be mappable are decoded
+    with libtiff.
+**/
+void tiff_container::map_file()
+{
+  bool mappable = !images_.empty() && locate(0).offset != 0;
+  for(int i = 0; i < located_ && mappable; i++) {
+    mappable = images_[i].offset != 0;
+  }
+  if(!mappable) {
+    return;
+  }
+
+  int fd = open(path_.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return;
+  }
+
+  struct stat file_stat;
+  void *address = MAP_FAILED;
+  size_t size = 0;
+  if(fstat(fd, &file_stat) == 0) {
+    size = file_stat.st_size;
+    mappable = size > 0;
+    for(int i = 0; i < located_ && mappable; i++) {
+      mappable = images_[i].offset + (uint64) images_[i].height * images_[i].width * sizeof(int16) <= size;
+    }
+    if(mappable) {
+      // private and writeable, so images can be modified in place like images read with libtiff
+      address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+  }
+  close(fd);
+
+  if(address == MAP_FAILED) {
+    return;
+  }
+
+  madvise(address, size, MADV_SEQUENTIAL);
+  mapping_ = std::shared_ptr<void>(address, [size](void *mapping) { munmap(mapping, size); });
+  mapping_size_ = size;
+  byte_swapped_ = TIFFIsByteSwapped(tiff_);
+}
+
+/// Take an idle handle for reading images, open another one if all are in use
+TIFF* tiff_container::acquire_handle()
+{
+  {
+    std::lock_guard<std::mutex> lock(handle_mutex_);
+    if(!read_handles_.empty()) {
+      TIFF *handle = read_handles_.back();
+      read_handles_.pop_back();
+      return handle;
+    }
+  }
+
+  TIFF *handle = TIFFOpen(path_.c_str(), "r");
+  if(!handle) {
+    throw std::runtime_error("tiff_container: could not open " + path_ + " for reading");
+  }
+  return handle;
+}
+
+/// Return a handle taken with acquire_handle()
+void tiff_container::release_handle(TIFF *handle)
+{
+  std::lock_guard<std::mutex> lock(handle_mutex_);
+  read_handles_.push_back(handle);
+}
+
+/// Get the size of the current image of a handle, which must be a 16 bit gray-scale image
+/** @param handle Handle positioned at the image
+    @param height Receives the height of the image
+    @param width Receives the width of the image
+**/
+void tiff_container::decoded_size(TIFF *handle, uint32& height, uint32& width)
+{
+  uint16 bits_per_pixel, samples_per_pixel;
+  height = 0;
+  width = 0;
+  TIFFGetField(handle, TIFFTAG_IMAGELENGTH, &height);
+  TIFFGetField(handle, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetFieldDefaulted(handle, TIFFTAG_BITSPERSAMPLE, &bits_per_pixel);
+  TIFFGetFieldDefaulted(handle, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
+  if(bits_per_pixel != 16 || samples_per_pixel != 1 || height == 0 || width == 0) {
+    throw std::runtime_error("tiff_container: only 16 bit gray-scale images can be read");
+  }
+}
+
+/// Decode the current image of a handle into a pooled buffer
+/** @param handle Handle positioned at the image
+    @param i The number of the image
+**/
+tiff_image16_ref tiff_container::decode_image(TIFF *handle, int i)
+{
+  uint32 height, width;
+  decoded_size(handle, height, width);
+
+  // the rows of a pooled image are contiguous
+  tiff_image16_ref image(frame_pool::get(height, width).acquire(), height, width, width * sizeof(int16), 16, i);
+  decode_pixels(handle, image.data()[0], height, width);
+  return image;
+}
+
+/// Decode the current image of a handle into contiguous rows, strip by strip or tile by tile
+/** @param handle Handle positioned at the image
+    @param pixels Receives height * width pixel values, row after row
+    @param height Height of the image
+    @param width Width of the image
+**/
+void tiff_container::decode_pixels(TIFF *handle, int16 *pixels, uint32 height, uint32 width)
+{
+  if(!TIFFIsTiled(handle)) {
+    uint32 rows_per_strip;
+    TIFFGetFieldDefaulted(handle, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    rows_per_strip = std::min(rows_per_strip, height);
+    for(uint32 row = 0; row < height; row += rows_per_strip) {
+      // the rows are contiguous, so a strip is decoded in place
+      tmsize_t size = (tmsize_t) std::min(rows_per_strip, height - row) * width * sizeof(int16);
+      if(TIFFReadEncodedStrip(handle, TIFFComputeStrip(handle, row, 0), pixels + (size_t) row * width, size) != size) {
+        throw std::runtime_error("tiff_container: could not decode a strip of " + path_);
+      }
+    }
+    return;
+  }
+
+  uint32 tile_width, tile_length;
+  TIFFGetField(handle, TIFFTAG_TILEWIDTH, &tile_width);
+  TIFFGetField(handle, TIFFTAG_TILELENGTH, &tile_length);
+  std::vector<int16> tile(TIFFTileSize(handle) / sizeof(int16));
+  for(uint32 tile_row = 0; tile_row < height; tile_row += tile_length) {
+    for(uint32 tile_col = 0; tile_col < width; tile_col += tile_width) {
+      if(TIFFReadEncodedTile(handle, TIFFComputeTile(handle, tile_col, tile_row, 0, 0), tile.data(), -1) < 0) {
+        throw std::runtime_error("tiff_container: could not decode a tile of " + path_);
+      }
+      uint32 cols = std::min(tile_width, width - tile_col);
+      for(uint32 row = 0; row < tile_length && tile_row + row < height; row++) {
+        memcpy(pixels + (size_t) (tile_row + row) * width + tile_col, &tile[row * tile_width], cols * sizeof(int16));
+      }
+    }
+  }
+}
+
+/// Get an image from the mapped file
+/** The image points into the mapping unless its byte order differs from the host
+    or it is not aligned, then it is copied.
+    @param i The number of the image in the file
+    @param image Location of the image, inside the mapping
+    @return a reference to the requested image
+**/
+tiff_image16_ref tiff_container::mapped_image_ref(int i, image_location const& image)
+{
+  char *base = (char *) mapping_.get();
+  int16 *pixels = (int16 *) (base + image.offset);
+  size_t pixel_count = (size_t) image.height * image.width;
+  bool view = !byte_swapped_ && image.offset % sizeof(int16) == 0;
+
+  // a view only needs row pointers, which come from a pool of buffers without pixels
+  frame_buffer *buffer = frame_pool::get(image.height, view ? 0 : image.width).acquire();
+  if(view) {
+    for(int row = 0; row < (int) image.height; row++) {
+      buffer->rows[row] = pixels + row * image.width;
+    }
+    buffer->mapping = mapping_;
+  } else {
+    memcpy(buffer->pixels, pixels, pixel_count * sizeof(int16));
+    if(byte_swapped_) {
+      TIFFSwabArrayOfShort((uint16 *) buffer->pixels, pixel_count);
+    }
+  }
+
+  advise_next_image(i);
+  return tiff_image16_ref(buffer, image.height, image.width, image.width * sizeof(int16), image.bits_per_pixel, i);
+}
+
+/// Ask the kernel to read ahead the image after a mapped image while that one is processed
+/** @param i The number of the mapped image in the file
+**/
+void tiff_container::advise_next_image(int i)
+{
+  if(i + 1 < (int) images_.size()) {
+    image_location next = locate(i + 1);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t begin = next.offset / page_size * page_size;
+    size_t end = std::min(next.offset + (size_t) next.height * next.width * sizeof(int16), mapping_size_);
+    if(next.offset && begin < end) {
+      madvise((char *) mapping_.get() + begin, end - begin, MADV_WILLNEED);
+    }
+  }
+}
+
 void tiff_container::TIFFWarningHandler(const char* /*module*/, const char* /*fmt*/, va_list /*ap*/)
 {
 
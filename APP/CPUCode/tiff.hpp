@@ -10,14 +10,28 @@
 #include <string>
 #include <tiffio.h>
 #include <ostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "frame_pool.hpp"
+
+struct ome_metadata;
+class pixel_expression;
+class thread_pool;
 
 /// A gray-scale image with 16bit encoding from a TIFF container
+/** References to the same image share its pixels, which come from a frame_pool and
+    return to it when the last reference is dropped. References can be dropped on any thread.
+**/
 class tiff_image16_ref {
   friend class tiff_container;
+  friend class pixel_expression;
 
   public:
     tiff_image16_ref(int height, int width, int bits_per_pixel, int dir_number);
     tiff_image16_ref(tiff_image16_ref const& image);
+    tiff_image16_ref(tiff_image16_ref&& image);
     ~tiff_image16_ref();
 
     tiff_image16_ref copy();
@@ -30,8 +44,10 @@ class tiff_image16_ref {
     int bytes_per_pixel() const;
     int bits_per_pixel() const;
     int dir_number() const;
+    bool contiguous() const;
 
 		tiff_image16_ref& operator=(tiff_image16_ref const& image);
+    tiff_image16_ref& operator=(tiff_image16_ref&& image);
 
     tiff_image16_ref& operator<<=(int shift);
     tiff_image16_ref& operator>>=(int shift);
@@ -42,7 +58,7 @@ class tiff_image16_ref {
 
     tiff_image16_ref& operator-=(int subtrahend);
 
-    tiff_image16_ref& apply_highpass(int fir_radius);
+    tiff_image16_ref& apply_highpass(int fir_radius, thread_pool *pool = 0);
 
     int subtr_and_update_bg(tiff_image16_ref const& bg, float img_weight = 1.0/16);
 
@@ -54,24 +70,74 @@ class tiff_image16_ref {
     void write_as_csv(std::ostream &out);
 
   private:
-    tiff_image16_ref(int16 *const *data, int height, int width,
+    tiff_image16_ref(frame_buffer *buffer, int height, int width,
                  int scanline_size, int bits_per_pixel, int dir_number);
+    void assign(tiff_image16_ref const& image);
+    void release();
 
-    int sum_halo(int row, int col, int fir_radius, int& halo_count);
+    void highpass_band(int first_row, int end_row, int fir_radius, int16 *const *result) const;
 
     int16 *const *data_;        ///< data array of image
     int height_;                ///< height of the image
     int width_;                 ///< width of the image
     int scanline_size_;         ///< size of a line in bytes
     int bits_per_pixel_;        ///< bits used to store a pixel value
-    int *ref_count_;            ///< nr of references that point to same data
+    frame_buffer *buffer_;      ///< pooled pixels and reference count, null if moved from
     int dir_number_;            ///< number of the image in its tiff container
 };
 
+/// A chain of pixel operations on images of one size, evaluated in a single pass
+/** Written like arithmetic on images, e.g. ((img - bg) * gain) >> shift, and evaluated block by block:
+    each block of pixels is read once, goes through all operations while it is in the L1 cache and is
+    written once. The arithmetic saturates to int16 like the compound operators of tiff_image16_ref,
+    and a subtraction stops at zero. The operands are referenced, not copied, and may also be the target,
+    as every pixel only depends on the pixels at the same position.
+**/
+class pixel_expression {
+  public:
+    explicit pixel_expression(tiff_image16_ref const& image);
+
+    pixel_expression operator-(tiff_image16_ref const& image) const;
+    pixel_expression operator+(tiff_image16_ref const& image) const;
+    pixel_expression operator-(int subtrahend) const;
+    pixel_expression operator*(double factor) const;
+    pixel_expression operator<<(int shift) const;
+    pixel_expression operator>>(int shift) const;
+
+    void evaluate_into(tiff_image16_ref& target) const;
+    tiff_image16_ref evaluate() const;
+
+    static const int block_length = 2048;   ///< pixels per block, 4 KiB stay in the L1 cache
+
+  private:
+    /// Operation of the chain
+    struct step {
+      enum { subtract, add, subtract_value, multiply, shift_left, shift_right } kind;
+      int operand;              ///< index of the image operand, -1 for operations with a value
+      int value;                ///< subtrahend or shift
+      double factor;            ///< factor of a multiplication
+    };
+
+    pixel_expression then(step const& next, tiff_image16_ref const* image = 0) const;
+
+    std::vector<tiff_image16_ref> operands_;  ///< images of the chain, it starts with the first one
+    std::vector<step> steps_;                 ///< operations in the order they are applied
+};
+
+pixel_expression operator-(tiff_image16_ref const& image, tiff_image16_ref const& subtrahend);
+pixel_expression operator+(tiff_image16_ref const& image, tiff_image16_ref const& summand);
+pixel_expression operator-(tiff_image16_ref const& image, int subtrahend);
+pixel_expression operator*(tiff_image16_ref const& image, double factor);
+pixel_expression operator<<(tiff_image16_ref const& image, int shift);
+pixel_expression operator>>(tiff_image16_ref const& image, int shift);
+
 /// A TIFF container
+/** Classic TIFF and BigTIFF files can be read. If the first image has OME-XML metadata, the images are
+    located only when they are read, and a series spread over several files is presented as one stack.
+**/
 class tiff_container {
   public:
-    tiff_container(std::string path, std::string mode);
+    tiff_container(std::string path, std::string mode, bool use_index_file = false);
     ~tiff_container();
 
     bool good();
@@ -82,17 +148,74 @@ class tiff_container {
     int total_img_count();
 
     tiff_image16_ref image(int i);
+    void read_image(int i, int16 *pixels, int height, int width);
     void append_image(tiff_image16_ref const& image);
     void append_as_8bit_image(tiff_image16_ref const& image, int shift = 0);
 
+    bool mapped();
+    double nm_per_px();
+
+    static std::vector<std::string> series_paths(std::string const& path);
+
   private:
 
+    /// Location of an image in the file
+    struct image_location {
+      uint64 directory;       ///< offset of the image file directory
+      uint64 offset;          ///< offset of the first pixel, 0 if the pixels are compressed or not contiguous
+      uint32 height;          ///< height of the image
+      uint32 width;           ///< width of the image
+      uint32 bits_per_pixel;  ///< range of a pixel value in bits
+    };
+
+    /// Images of a series that are stored in consecutive image file directories of one file
+    struct series_segment {
+      tiff_container *file;   ///< the file, this container or one of parts_
+      int first_ifd;          ///< directory of the first image in the file
+      int first_image;        ///< number of the first image in the series
+      int count;              ///< number of images
+    };
+
+    tiff_container(std::string path, int image_count);
+    tiff_container(tiff_container const&);              // no copying
+    tiff_container& operator=(tiff_container const&);
+
     static void TIFFWarningHandler(const char* module, const char* fmt, va_list ap);
 
+    void open_series(ome_metadata const& metadata, std::string const& directory);
+    image_location describe_directory();
+    image_location locate(int i);
+    series_segment const& find_segment(int i);
+    tiff_image16_ref file_image(int i);
+    void read_file_image(int i, int16 *pixels, int height, int width);
+    void build_index();
+    bool read_index_file();
+    void write_index_file();
+    std::string index_file_path();
+    void map_file();
+    tiff_image16_ref mapped_image_ref(int i, image_location const& image);
+    void advise_next_image(int i);
+    TIFF* acquire_handle();
+    void release_handle(TIFF *handle);
+    void decoded_size(TIFF *handle, uint32& height, uint32& width);
+    tiff_image16_ref decode_image(TIFF *handle, int i);
+    void decode_pixels(TIFF *handle, int16 *pixels, uint32 height, uint32 width);
+
     TIFF *tiff_;              ///< tiff file handle
     std::string path_;        ///< path of the tiff file
     std::string mode_;        ///< opening mode of the tiff file
     bool good_;               ///< indicated wether tiff file could be opened
+    std::shared_ptr<void> mapping_;       ///< private file mapping, null if the images are read with libtiff
+    size_t mapping_size_;     ///< size of the mapping in bytes
+    std::vector<image_location> images_;  ///< location of every image of the file, empty if the file is written
+    int located_;             ///< number of images at the start of images_ that have been located
+    std::mutex index_mutex_;  ///< guards images_ and located_ while images are located, and tiff_
+    double nm_per_px_;        ///< pixel size from the OME-XML metadata, 0 if unknown
+    std::vector<std::unique_ptr<tiff_container>> parts_;  ///< other files of an OME-TIFF series
+    std::vector<series_segment> segments_;  ///< where the images of a series are, empty for a single file
+    bool byte_swapped_;       ///< true iff the byte order of the file differs from the host
+    std::vector<TIFF*> read_handles_;     ///< idle handles for reading images, one per thread that reads at the same time
+    std::mutex handle_mutex_; ///< guards read_handles_, a handle is not thread-safe
 
 };
 